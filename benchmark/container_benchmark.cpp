@@ -0,0 +1,713 @@
+//
+//  container_benchmark.cpp
+//  stl_extension
+//
+//  Created by Kingle Zhuang on 11/20/19.
+//  Copyright © 2019 RingCentral. All rights reserved.
+//
+
+// Throughput and latency of every container against a std::mutex + STL
+// baseline of the same shape. Each run prefills the container, then every
+// thread replays its own pre-generated sequence of operations; the sweep
+// covers
+//
+//     threads        1, 2, 4, ... up to the given maximum
+//     read/write     100/0, 95/5 and 50/50
+//     keys           uniform and Zipfian (theta 0.99, scrambled)
+//     value size     8, 64 and 256 bytes
+//
+// Keyed containers read with get()/contains() and write with set(),
+// insert() or erase(); the indexed ones read an element under a read view
+// and overwrite it; the queues and stacks ignore the mix and the key
+// distribution and alternate push and pop. Latencies are taken per
+// operation and include one steady_clock read.
+//
+//     container_benchmark [max threads] [operations per thread] [key range] [filter]
+//
+// Only containers whose name contains the filter are run.
+
+#include <map>
+#include <set>
+#include <array>
+#include <cmath>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+#include "../threadsafe_map.hpp"
+#include "../threadsafe_set.hpp"
+#include "../threadsafe_list.hpp"
+#include "../threadsafe_deque.hpp"
+#include "../threadsafe_queue.hpp"
+#include "../threadsafe_stack.hpp"
+#include "../threadsafe_vector.hpp"
+#include "../threadsafe_unordered_map.hpp"
+#include "../threadsafe_unordered_set.hpp"
+
+namespace
+{
+    template <size_t Bytes>
+    struct payload
+    {
+        uint64_t words[Bytes / sizeof(uint64_t)];
+        
+        explicit payload(uint64_t v = 0)
+        {
+            for (auto& w : words)
+            {
+                w = v;
+            }
+        }
+        
+        uint64_t first() const { return words[0]; }
+    };
+    
+    struct workload
+    {
+        unsigned threads;
+        size_t ops;
+        size_t keys;
+        unsigned read_percent;
+        bool zipfian;
+    };
+    
+    struct result
+    {
+        double ops_per_sec;
+        uint64_t p50;
+        uint64_t p99;
+        uint64_t p999;
+    };
+    
+    std::atomic<uint64_t> sink(0);
+    
+    uint64_t splitmix(uint64_t& state)
+    {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+    
+    // Gray et al., "Quickly generating billion-record synthetic databases",
+    // as used by YCSB. The rank is scrambled so the hot keys do not all sit
+    // next to each other in the ordered containers.
+    class zipfian
+    {
+        size_t n_;
+        double theta_;
+        double zetan_;
+        double alpha_;
+        double eta_;
+        
+        static double zeta(size_t n, double theta)
+        {
+            double sum = 0;
+            for (size_t i = 1; i <= n; ++i)
+            {
+                sum += 1.0 / std::pow(double(i), theta);
+            }
+            return sum;
+        }
+        
+    public:
+        explicit zipfian(size_t n, double theta = 0.99) : n_(n), theta_(theta), zetan_(zeta(n, theta))
+        {
+            alpha_ = 1.0 / (1.0 - theta_);
+            eta_ = (1.0 - std::pow(2.0 / double(n_), 1.0 - theta_)) / (1.0 - zeta(2, theta_) / zetan_);
+        }
+        
+        uint64_t next(uint64_t& state) const
+        {
+            double u = double(splitmix(state) >> 11) / double(1ull << 53);
+            double uz = u * zetan_;
+            uint64_t rank = 0;
+            if (uz >= 1.0 + std::pow(0.5, theta_))
+            {
+                rank = uint64_t(double(n_) * std::pow(eta_ * u - eta_ + 1.0, alpha_));
+            }
+            else if (uz >= 1.0)
+            {
+                rank = 1;
+            }
+            rank = rank < n_ ? rank : n_ - 1;
+            return (rank * 0x9E3779B97F4A7C15ull) % n_;
+        }
+    };
+    
+    // Log-linear latency histogram: exact below 32 ns, 16 buckets per power
+    // of two above, so a percentile is off by at most 1/16.
+    class histogram
+    {
+        static constexpr size_t buckets = 32 + 59 * 16;
+        
+        std::array<uint64_t, buckets> counts_{};
+        uint64_t total_ = 0;
+        
+        static size_t index(uint64_t ns)
+        {
+            if (ns < 32)
+            {
+                return size_t(ns);
+            }
+            unsigned msb = 63 - unsigned(__builtin_clzll(ns));
+            return 32 + (msb - 5) * 16 + size_t((ns >> (msb - 4)) & 15);
+        }
+        
+        static uint64_t lower_bound(size_t i)
+        {
+            if (i < 32)
+            {
+                return i;
+            }
+            unsigned msb = unsigned(i - 32) / 16 + 5;
+            return uint64_t(16 + (i - 32) % 16) << (msb - 4);
+        }
+        
+    public:
+        void record(uint64_t ns)
+        {
+            ++counts_[index(ns)];
+            ++total_;
+        }
+        
+        void merge(const histogram& h)
+        {
+            for (size_t i = 0; i < buckets; ++i)
+            {
+                counts_[i] += h.counts_[i];
+            }
+            total_ += h.total_;
+        }
+        
+        uint64_t percentile(double q) const
+        {
+            uint64_t rank = uint64_t(std::ceil(q * double(total_)));
+            uint64_t seen = 0;
+            for (size_t i = 0; i < buckets; ++i)
+            {
+                seen += counts_[i];
+                if (seen >= rank && seen > 0)
+                {
+                    return lower_bound(i);
+                }
+            }
+            return 0;
+        }
+    };
+    
+    // The top bit of an operation marks a write, the rest is the key.
+    constexpr uint64_t write_bit = 1ull << 63;
+    
+    std::vector<uint64_t> generate(const workload& w, unsigned id, const zipfian* z)
+    {
+        uint64_t state = 0x243F6A8885A308D3ull * (id + 1);
+        std::vector<uint64_t> ops(w.ops);
+        for (auto& op : ops)
+        {
+            uint64_t key = z ? z->next(state) : splitmix(state) % w.keys;
+            bool write = splitmix(state) % 100 >= w.read_percent;
+            op = key | (write ? write_bit : 0);
+        }
+        return ops;
+    }
+    
+    template <class Target>
+    result run(const workload& w, const zipfian* z)
+    {
+        Target target(w.keys);
+        
+        std::vector<std::vector<uint64_t>> ops;
+        for (unsigned t = 0; t < w.threads; ++t)
+        {
+            ops.push_back(generate(w, t, z));
+        }
+        std::vector<histogram> latencies(w.threads);
+        
+        std::atomic<unsigned> ready(0);
+        std::atomic<bool> go(false);
+        auto worker = [&](unsigned id)
+        {
+            histogram& h = latencies[id];
+            uint64_t sum = 0;
+            ready.fetch_add(1);
+            while (!go.load(std::memory_order_acquire))
+            {
+                std::this_thread::yield();
+            }
+            
+            uint64_t n = 0;
+            for (uint64_t op : ops[id])
+            {
+                uint64_t key = op & ~write_bit;
+                auto start = std::chrono::steady_clock::now();
+                if (op & write_bit)
+                {
+                    target.write(key, ++n);
+                }
+                else
+                {
+                    sum += target.read(key);
+                }
+                auto elapsed = std::chrono::steady_clock::now() - start;
+                h.record(uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+            }
+            sink.fetch_add(sum, std::memory_order_relaxed);
+        };
+        
+        std::vector<std::thread> pool;
+        for (unsigned t = 0; t < w.threads; ++t)
+        {
+            pool.emplace_back(worker, t);
+        }
+        while (ready.load() != w.threads)
+        {
+            std::this_thread::yield();
+        }
+        
+        auto start = std::chrono::steady_clock::now();
+        go.store(true, std::memory_order_release);
+        for (auto& t : pool)
+        {
+            t.join();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        
+        histogram all;
+        for (const auto& h : latencies)
+        {
+            all.merge(h);
+        }
+        return result{double(w.ops) * w.threads / seconds, all.percentile(0.5), all.percentile(0.99), all.percentile(0.999)};
+    }
+    
+    // Keyed containers with get() and set().
+    template <class Map>
+    struct keyed_target
+    {
+        typedef typename Map::mapped_type value_type;
+        
+        Map map_;
+        
+        explicit keyed_target(size_t keys)
+        {
+            for (uint64_t k = 0; k < keys; ++k)
+            {
+                map_.set(k, value_type(k));
+            }
+        }
+        
+        uint64_t read(uint64_t k) { return map_.get(k).first.first(); }
+        void write(uint64_t k, uint64_t v) { map_.set(k, value_type(v)); }
+    };
+    
+    // The multimaps have no set(): a write replaces every value of the key.
+    template <class Map>
+    struct multi_keyed_target
+    {
+        typedef typename Map::mapped_type value_type;
+        
+        Map map_;
+        
+        explicit multi_keyed_target(size_t keys)
+        {
+            for (uint64_t k = 0; k < keys; ++k)
+            {
+                map_.insert({k, value_type(k)});
+            }
+        }
+        
+        uint64_t read(uint64_t k) { return map_.get(k).first.first(); }
+        
+        void write(uint64_t k, uint64_t v)
+        {
+            map_.erase(k);
+            map_.insert({k, value_type(v)});
+        }
+    };
+    
+    template <class Map>
+    struct locked_keyed_target
+    {
+        typedef typename Map::mapped_type value_type;
+        
+        std::mutex mutex_;
+        Map map_;
+        
+        explicit locked_keyed_target(size_t keys)
+        {
+            for (uint64_t k = 0; k < keys; ++k)
+            {
+                map_.emplace(k, value_type(k));
+            }
+        }
+        
+        uint64_t read(uint64_t k)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = map_.find(k);
+            return it != map_.end() ? value_type(it->second).first() : 0;
+        }
+        
+        void write(uint64_t k, uint64_t v)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            map_[k] = value_type(v);
+        }
+    };
+    
+    // Sets start with the even keys; a write inserts or erases its key.
+    template <class Set>
+    struct set_target
+    {
+        Set set_;
+        
+        explicit set_target(size_t keys)
+        {
+            for (uint64_t k = 0; k < keys; k += 2)
+            {
+                set_.insert(k);
+            }
+        }
+        
+        uint64_t read(uint64_t k) { return set_.contains(k); }
+        
+        void write(uint64_t k, uint64_t v)
+        {
+            if (v & 1)
+            {
+                set_.insert(k);
+            }
+            else
+            {
+                set_.erase(k);
+            }
+        }
+    };
+    
+    template <class Set>
+    struct locked_set_target
+    {
+        std::mutex mutex_;
+        Set set_;
+        
+        explicit locked_set_target(size_t keys)
+        {
+            for (uint64_t k = 0; k < keys; k += 2)
+            {
+                set_.insert(k);
+            }
+        }
+        
+        uint64_t read(uint64_t k)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return set_.count(k);
+        }
+        
+        void write(uint64_t k, uint64_t v)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (v & 1)
+            {
+                set_.insert(k);
+            }
+            else
+            {
+                set_.erase(k);
+            }
+        }
+    };
+    
+    // threadsafe_vector and threadsafe_deque: one element per key.
+    template <class Seq>
+    struct indexed_target
+    {
+        typedef typename Seq::value_type value_type;
+        
+        Seq seq_;
+        
+        explicit indexed_target(size_t keys)
+        {
+            for (uint64_t k = 0; k < keys; ++k)
+            {
+                seq_.push_back(value_type(k));
+            }
+        }
+        
+        uint64_t read(uint64_t k)
+        {
+            auto view = seq_.read();
+            return view.get()[k].first();
+        }
+        
+        void write(uint64_t k, uint64_t v) { seq_.set(k, value_type(v)); }
+    };
+    
+    // Elements are never overwritten in place, so a write appends.
+    template <class Seq>
+    struct concurrent_indexed_target
+    {
+        typedef typename Seq::value_type value_type;
+        
+        Seq seq_;
+        
+        explicit concurrent_indexed_target(size_t keys)
+        {
+            seq_.grow_by(keys);
+        }
+        
+        uint64_t read(uint64_t k) { return seq_[k].first(); }
+        void write(uint64_t, uint64_t v) { seq_.push_back(value_type(v)); }
+    };
+    
+    // threadsafe_list has no indexed access: a read looks at the front and a
+    // write pushes to the back before popping the front, so the list never
+    // shrinks below its initial size.
+    template <class List>
+    struct list_target
+    {
+        typedef typename List::value_type value_type;
+        
+        List list_;
+        
+        explicit list_target(size_t keys)
+        {
+            for (uint64_t k = 0; k < keys; ++k)
+            {
+                list_.push_back(value_type(k));
+            }
+        }
+        
+        uint64_t read(uint64_t)
+        {
+            auto view = list_.read();
+            return view->front().first();
+        }
+        
+        void write(uint64_t, uint64_t v)
+        {
+            list_.push_back(value_type(v));
+            list_.pop_front();
+        }
+    };
+    
+    template <class Seq>
+    struct locked_indexed_target
+    {
+        typedef typename Seq::value_type value_type;
+        
+        std::mutex mutex_;
+        Seq seq_;
+        
+        explicit locked_indexed_target(size_t keys)
+        {
+            for (uint64_t k = 0; k < keys; ++k)
+            {
+                seq_.push_back(value_type(k));
+            }
+        }
+        
+        uint64_t read(uint64_t k)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return seq_[k].first();
+        }
+        
+        void write(uint64_t k, uint64_t v)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            seq_[k] = value_type(v);
+        }
+    };
+    
+    // Queues and stacks: a read pops, a write pushes.
+    template <class Queue, class Push, class Pop>
+    struct queue_target
+    {
+        typedef typename Queue::value_type value_type;
+        
+        Queue queue_;
+        
+        explicit queue_target(size_t keys)
+        {
+            for (uint64_t k = 0; k < keys; ++k)
+            {
+                Push()(queue_, value_type(k));
+            }
+        }
+        
+        uint64_t read(uint64_t)
+        {
+            value_type v;
+            return Pop()(queue_, v) ? v.first() : 0;
+        }
+        
+        void write(uint64_t, uint64_t v) { Push()(queue_, value_type(v)); }
+    };
+    
+    struct push_op
+    {
+        template <class Q, class V> void operator()(Q& q, V&& v) const { q.push(std::forward<V>(v)); }
+    };
+    
+    struct push_back_op
+    {
+        template <class Q, class V> void operator()(Q& q, V&& v) const { q.push_back(std::forward<V>(v)); }
+    };
+    
+    struct try_pop_op
+    {
+        template <class Q, class V> bool operator()(Q& q, V& v) const { return q.try_pop(v); }
+    };
+    
+    struct try_pop_front_op
+    {
+        template <class Q, class V> bool operator()(Q& q, V& v) const { return q.try_pop_front(v); }
+    };
+    
+    template <class Value>
+    struct locked_deque
+    {
+        typedef Value value_type;
+        
+        std::mutex mutex_;
+        std::deque<Value> deque_;
+        
+        void push_back(Value v)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            deque_.push_back(std::move(v));
+        }
+        
+        bool try_pop_front(Value& v)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (deque_.empty())
+            {
+                return false;
+            }
+            v = std::move(deque_.front());
+            deque_.pop_front();
+            return true;
+        }
+    };
+    
+    struct options
+    {
+        std::vector<unsigned> threads;
+        size_t ops;
+        size_t keys;
+        std::string filter;
+        zipfian* zipf;
+    };
+    
+    template <class Target>
+    void sweep(const options& o, const char* name, const char* value, bool mixes)
+    {
+        if (std::strstr(name, o.filter.c_str()) == nullptr)
+        {
+            return;
+        }
+        
+        static const unsigned reads[] = {100, 95, 50};
+        for (unsigned threads : o.threads)
+        {
+            for (unsigned read_percent : reads)
+            {
+                for (bool zipf : {false, true})
+                {
+                    if (!mixes && (read_percent != 50 || zipf))
+                    {
+                        continue;
+                    }
+                    
+                    workload w{threads, o.ops, o.keys, read_percent, zipf};
+                    result r = run<Target>(w, zipf ? o.zipf : nullptr);
+                    char mix[16];
+                    std::snprintf(mix, sizeof(mix), "%u/%u", read_percent, 100 - read_percent);
+                    std::printf("%-36s %5s %8s %7s %7u %14.0f %8llu %8llu %8llu\n", name, value, mixes ? mix : "push/pop", mixes ? (zipf ? "zipf" : "uniform") : "-",
+                                threads, r.ops_per_sec, (unsigned long long)r.p50, (unsigned long long)r.p99, (unsigned long long)r.p999);
+                    std::fflush(stdout);
+                }
+            }
+        }
+    }
+    
+    template <size_t Bytes>
+    void sweep_values(const options& o, const char* value)
+    {
+        typedef payload<Bytes> V;
+        
+        sweep<keyed_target<std::threadsafe_map<uint64_t, V>>>(o, "threadsafe_map", value, true);
+        sweep<multi_keyed_target<std::threadsafe_multimap<uint64_t, V>>>(o, "threadsafe_multimap", value, true);
+        sweep<keyed_target<std::threadsafe_skiplist_map<uint64_t, V>>>(o, "threadsafe_skiplist_map", value, true);
+        sweep<locked_keyed_target<std::map<uint64_t, V>>>(o, "mutex + std::map", value, true);
+        
+        sweep<keyed_target<std::threadsafe_unordered_map<uint64_t, V>>>(o, "threadsafe_unordered_map", value, true);
+        sweep<multi_keyed_target<std::threadsafe_unordered_multimap<uint64_t, V>>>(o, "threadsafe_unordered_multimap", value, true);
+        sweep<keyed_target<std::threadsafe_sharded_unordered_map<uint64_t, V>>>(o, "threadsafe_sharded_unordered_map", value, true);
+        sweep<keyed_target<std::threadsafe_left_right_unordered_map<uint64_t, V>>>(o, "threadsafe_left_right_unordered_map", value, true);
+        sweep<locked_keyed_target<std::unordered_map<uint64_t, V>>>(o, "mutex + std::unordered_map", value, true);
+        
+        sweep<indexed_target<std::threadsafe_vector<V>>>(o, "threadsafe_vector", value, true);
+        sweep<concurrent_indexed_target<std::threadsafe_concurrent_vector<V>>>(o, "threadsafe_concurrent_vector", value, true);
+        sweep<indexed_target<std::threadsafe_deque<V>>>(o, "threadsafe_deque", value, true);
+        sweep<list_target<std::threadsafe_list<V>>>(o, "threadsafe_list", value, true);
+        sweep<locked_indexed_target<std::vector<V>>>(o, "mutex + std::vector", value, true);
+        
+        sweep<queue_target<std::threadsafe_queue<V>, push_op, try_pop_op>>(o, "threadsafe_queue", value, false);
+        sweep<queue_target<std::threadsafe_deque<V>, push_back_op, try_pop_front_op>>(o, "threadsafe_deque (fifo)", value, false);
+        sweep<queue_target<std::threadsafe_blocking_deque<V>, push_back_op, try_pop_front_op>>(o, "threadsafe_blocking_deque", value, false);
+        sweep<queue_target<std::threadsafe_stack<V>, push_op, try_pop_op>>(o, "threadsafe_stack", value, false);
+        sweep<queue_target<std::threadsafe_lockfree_stack<V>, push_op, try_pop_op>>(o, "threadsafe_lockfree_stack", value, false);
+        sweep<queue_target<locked_deque<V>, push_back_op, try_pop_front_op>>(o, "mutex + std::deque", value, false);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned max_threads = argc > 1 ? unsigned(std::atoi(argv[1])) : std::thread::hardware_concurrency();
+    max_threads = max_threads ? max_threads : 1;
+    
+    options o;
+    o.ops = argc > 2 ? size_t(std::atoll(argv[2])) : 100000;
+    o.keys = argc > 3 ? size_t(std::atoll(argv[3])) : 100000;
+    o.keys = o.keys > 1 ? o.keys : 2;
+    o.filter = argc > 4 ? argv[4] : "";
+    for (unsigned t = 1; t < max_threads; t *= 2)
+    {
+        o.threads.push_back(t);
+    }
+    o.threads.push_back(max_threads);
+    
+    zipfian zipf(o.keys);
+    o.zipf = &zipf;
+    
+    std::printf("%zu operations per thread, %zu keys, latencies in ns\n", o.ops, o.keys);
+    std::printf("%-36s %5s %8s %7s %7s %14s %8s %8s %8s\n", "container", "value", "mix", "keys", "threads", "ops/s", "p50", "p99", "p999");
+    
+    // Sets hold the keys themselves, so they only run once.
+    sweep<set_target<std::threadsafe_set<uint64_t>>>(o, "threadsafe_set", "8", true);
+    sweep<set_target<std::threadsafe_multiset<uint64_t>>>(o, "threadsafe_multiset", "8", true);
+    sweep<set_target<std::threadsafe_skiplist_set<uint64_t>>>(o, "threadsafe_skiplist_set", "8", true);
+    sweep<locked_set_target<std::set<uint64_t>>>(o, "mutex + std::set", "8", true);
+    sweep<set_target<std::threadsafe_unordered_set<uint64_t>>>(o, "threadsafe_unordered_set", "8", true);
+    sweep<set_target<std::threadsafe_unordered_multiset<uint64_t>>>(o, "threadsafe_unordered_multiset", "8", true);
+    sweep<set_target<std::threadsafe_lockfree_unordered_set<uint64_t>>>(o, "threadsafe_lockfree_unordered_set", "8", true);
+    sweep<locked_set_target<std::unordered_set<uint64_t>>>(o, "mutex + std::unordered_set", "8", true);
+    
+    sweep_values<8>(o, "8");
+    sweep_values<64>(o, "64");
+    sweep_values<256>(o, "256");
+    return 0;
+}
@@ -0,0 +1,181 @@
+//
+//  reclamation_benchmark.cpp
+//  stl_extension
+//
+//  Created by Kingle Zhuang on 11/20/19.
+//  Copyright © 2019 RingCentral. All rights reserved.
+//
+
+// Per-operation cost of the reclamation schemes in threadsafe_reclamation.hpp.
+// Every thread repeatedly reads the node behind a shared pointer and, for the
+// given percentage of operations, replaces it and retires the old node. The
+// "leak" run never frees anything and is the baseline the other two are
+// compared against.
+//
+//     reclamation_benchmark [threads] [operations per thread] [update %]
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include "../threadsafe_reclamation.hpp"
+
+namespace
+{
+    struct node
+    {
+        uint64_t value;
+        
+        explicit node(uint64_t v) : value(v) {}
+    };
+    
+    void delete_node(void* p)
+    {
+        delete static_cast<node*>(p);
+    }
+    
+    constexpr size_t slots = 64;
+    
+    struct alignas(64) shared_slot
+    {
+        std::atomic<node*> ptr;
+    };
+    
+    shared_slot table[slots];
+    std::atomic<uint64_t> sink(0);
+    
+    struct result
+    {
+        double ns_per_op;
+        size_t max_pending;
+    };
+    
+    struct epoch_scheme
+    {
+        std::__epoch_guard guard_;
+        
+        node* load(const std::atomic<node*>& src) { return src.load(std::memory_order_acquire); }
+        void retire(node* n) { std::__epoch_domain::instance().retire(n, delete_node); }
+        static size_t pending() { return std::__epoch_domain::instance().pending(); }
+    };
+    
+    struct hazard_scheme
+    {
+        std::__hazard_pointer hp_;
+        
+        node* load(const std::atomic<node*>& src) { return hp_.protect(src); }
+        void retire(node* n) { hp_.reset(); std::__hazard_domain::instance().retire(n, delete_node); }
+        static size_t pending() { return std::__hazard_domain::instance().pending(); }
+    };
+    
+    struct leak_scheme
+    {
+        std::vector<node*>& leaked_;
+        
+        node* load(const std::atomic<node*>& src) { return src.load(std::memory_order_acquire); }
+        void retire(node* n) { leaked_.push_back(n); }
+        static size_t pending() { return 0; }
+    };
+    
+    template <class Scheme, class Make>
+    result run(unsigned threads, size_t ops, unsigned update_percent, Make make)
+    {
+        std::atomic<size_t> max_pending(0);
+        auto worker = [&](unsigned id)
+        {
+            uint64_t seed = 0x9E3779B97F4A7C15ull * (id + 1);
+            uint64_t sum = 0;
+            size_t peak = 0;
+            for (size_t i = 0; i < ops; ++i)
+            {
+                seed ^= seed << 13;
+                seed ^= seed >> 7;
+                seed ^= seed << 17;
+                
+                Scheme s = make();
+                std::atomic<node*>& src = table[seed % slots].ptr;
+                node* n = s.load(src);
+                sum += n->value;
+                
+                if (seed % 100 < update_percent)
+                {
+                    node* old = src.exchange(new node(seed), std::memory_order_acq_rel);
+                    s.retire(old);
+                    size_t p = Scheme::pending();
+                    peak = p > peak ? p : peak;
+                }
+            }
+            
+            size_t cur = max_pending.load();
+            while (peak > cur && !max_pending.compare_exchange_weak(cur, peak)) {}
+            sink.fetch_add(sum, std::memory_order_relaxed);
+        };
+        
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> pool;
+        for (unsigned t = 0; t < threads; ++t)
+        {
+            pool.emplace_back(worker, t);
+        }
+        for (auto& t : pool)
+        {
+            t.join();
+        }
+        auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        
+        return result{elapsed / double(ops), max_pending.load()};
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned threads = argc > 1 ? unsigned(std::atoi(argv[1])) : std::thread::hardware_concurrency();
+    size_t ops = argc > 2 ? size_t(std::atoll(argv[2])) : 2000000;
+    unsigned update_percent = argc > 3 ? unsigned(std::atoi(argv[3])) : 10;
+    threads = threads ? threads : 1;
+    
+    for (auto& s : table)
+    {
+        s.ptr.store(new node(0));
+    }
+    
+    std::printf("threads %u, %zu operations per thread, %u%% updates\n", threads, ops, update_percent);
+    std::printf("%-8s %12s %14s\n", "scheme", "ns/op", "max pending");
+    
+    // Every worker appends to its own preallocated list, so the baseline does
+    // not pay for vector growth.
+    std::vector<std::vector<node*>> leaked(threads);
+    for (auto& l : leaked)
+    {
+        l.reserve(ops * update_percent / 100 + 1024);
+    }
+    std::atomic<unsigned> next(0);
+    result r = run<leak_scheme>(threads, ops, update_percent, [&]
+    {
+        static thread_local unsigned id = next++;
+        return leak_scheme{leaked[id]};
+    });
+    std::printf("%-8s %12.1f %14zu\n", "leak", r.ns_per_op, r.max_pending);
+    
+    r = run<epoch_scheme>(threads, ops, update_percent, [] { return epoch_scheme(); });
+    std::printf("%-8s %12.1f %14zu\n", "epoch", r.ns_per_op, r.max_pending);
+    
+    r = run<hazard_scheme>(threads, ops, update_percent, [] { return hazard_scheme(); });
+    std::printf("%-8s %12.1f %14zu\n", "hazard", r.ns_per_op, r.max_pending);
+    
+    for (auto& l : leaked)
+    {
+        for (node* n : l)
+        {
+            delete n;
+        }
+    }
+    for (auto& s : table)
+    {
+        delete s.ptr.load();
+    }
+    return 0;
+}
@@ -0,0 +1,117 @@
+//
+//  concurrent_vector_test.cpp
+//  stl_extension
+//
+//  Created by Kingle Zhuang on 11/20/19.
+//  Copyright © 2019 RingCentral. All rights reserved.
+//
+
+// threadsafe_concurrent_vector with concurrent appenders and readers. Every
+// appended value encodes the thread and sequence number that wrote it, and
+// push_back and grow_by hand back the index they reserved, so afterwards
+// each index must hold exactly what was written there. Readers running at
+// the same time may only ever observe fully published elements.
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <stdexcept>
+#include "stress_test.hpp"
+#include "../threadsafe_vector.hpp"
+
+namespace
+{
+    struct written
+    {
+        uint64_t index;
+        uint64_t value;
+    };
+    
+    uint64_t make_value(unsigned id, uint64_t i)
+    {
+        return (uint64_t(id + 1) << 32) | i;
+    }
+    
+    void append_and_read(unsigned writers, unsigned readers)
+    {
+        const uint64_t per_thread = 50000;
+        const uint64_t batch = 7;
+        std::threadsafe_concurrent_vector<uint64_t> vector;
+        std::vector<std::vector<written>> log(writers);
+        std::atomic<unsigned> running(writers);
+        
+        stress::run(writers + readers, [&](unsigned id)
+        {
+            if (id >= writers)
+            {
+                while (running.load(std::memory_order_acquire) > 0)
+                {
+                    size_t size = vector.size();
+                    size_t seen = 0;
+                    vector.for_each([&](uint64_t v)
+                    {
+                        STRESS_CHECK(v >> 32 >= 1 && v >> 32 <= writers);
+                        ++seen;
+                    });
+                    STRESS_CHECK(seen <= vector.size());
+                    if (size > 0)
+                    {
+                        try
+                        {
+                            uint64_t v = vector.at(size - 1);
+                            STRESS_CHECK(v >> 32 >= 1 && v >> 32 <= writers);
+                        }
+                        catch (const std::out_of_range&)
+                        {
+                            // Reserved but not published yet.
+                        }
+                    }
+                }
+                return;
+            }
+            
+            std::vector<written>& out = log[id];
+            uint64_t i = 0;
+            while (i < per_thread)
+            {
+                if (i % 64 == 0)
+                {
+                    uint64_t v = make_value(id, i);
+                    uint64_t first = vector.grow_by(batch, v);
+                    for (uint64_t b = 0; b < batch; ++b)
+                    {
+                        out.push_back(written{first + b, v});
+                    }
+                    ++i;
+                }
+                else
+                {
+                    uint64_t v = make_value(id, i++);
+                    out.push_back(written{vector.push_back(v), v});
+                }
+            }
+            running.fetch_sub(1, std::memory_order_release);
+        });
+        
+        size_t total = 0;
+        for (const auto& out : log)
+        {
+            total += out.size();
+            for (const written& w : out)
+            {
+                STRESS_CHECK(vector.at(w.index) == w.value);
+                STRESS_CHECK(vector[w.index] == w.value);
+            }
+        }
+        STRESS_CHECK(vector.size() == total);
+        STRESS_CHECK(vector.value().size() == total);
+    }
+}
+
+int main()
+{
+    unsigned threads = stress::threads();
+    append_and_read(threads, 2);
+    std::printf("concurrent_vector_test: ok\n");
+    return 0;
+}
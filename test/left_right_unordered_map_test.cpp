@@ -0,0 +1,133 @@
+//
+//  left_right_unordered_map_test.cpp
+//  stl_extension
+//
+//  Created by Kingle Zhuang on 11/20/19.
+//  Copyright © 2019 RingCentral. All rights reserved.
+//
+
+// threadsafe_left_right_unordered_map with writers switching the two copies
+// as fast as they can while wait-free readers look keys up and iterate. A
+// value is always written as key + keys * n, so whatever a reader finds for
+// a key has to map back to it. A second part checks that both copies stay
+// identical when an update throws on either of its two applications.
+
+#include <atomic>
+#include <cstdint>
+#include <stdexcept>
+#include <unordered_set>
+#include "stress_test.hpp"
+#include "../threadsafe_unordered_map.hpp"
+
+namespace
+{
+    const uint64_t keys = 128;
+    
+    void readers_and_writers(unsigned writers, unsigned readers)
+    {
+        const size_t ops = 10000;
+        std::threadsafe_left_right_unordered_map<uint64_t, uint64_t> map;
+        std::atomic<unsigned> running(writers);
+        
+        stress::run(writers + readers, [&](unsigned id)
+        {
+            uint64_t state = 0x9E3779B97F4A7C15ull * (id + 1);
+            if (id >= writers)
+            {
+                while (running.load(std::memory_order_acquire) > 0)
+                {
+                    uint64_t k = stress::next_random(state) % keys;
+                    auto v = map.get(k);
+                    STRESS_CHECK(!v.second || v.first % keys == k);
+                    map.contains(k);
+                    
+                    std::unordered_set<uint64_t> seen;
+                    map.for_each([&](const auto& kv)
+                    {
+                        STRESS_CHECK(kv.second % keys == kv.first);
+                        STRESS_CHECK(seen.insert(kv.first).second);
+                    });
+                    STRESS_CHECK(seen.size() <= keys);
+                }
+                return;
+            }
+            
+            for (size_t i = 0; i < ops; ++i)
+            {
+                uint64_t r = stress::next_random(state);
+                uint64_t k = r % keys;
+                switch ((r >> 32) % 4)
+                {
+                    case 0:
+                        map.set(k, k + keys * i);
+                        break;
+                    case 1:
+                        map.insert({k, k});
+                        break;
+                    case 2:
+                        map.update(k, [](uint64_t& v) { v += keys; });
+                        break;
+                    default:
+                        map.erase(k);
+                        break;
+                }
+            }
+            running.fetch_sub(1, std::memory_order_release);
+        });
+        
+        auto value = map.value();
+        STRESS_CHECK(value.size() == map.size());
+        for (const auto& kv : value)
+        {
+            STRESS_CHECK(kv.second % keys == kv.first);
+            STRESS_CHECK(map.get(kv.first).first == kv.second);
+        }
+    }
+    
+    // After a failed write both copies must hold the same contents, which a
+    // second write - switching readers to the other copy - makes visible.
+    void throwing_update()
+    {
+        std::threadsafe_left_right_unordered_map<int, int> map;
+        map.set(1, 1);
+        
+        for (int fail_on = 1; fail_on <= 2; ++fail_on)
+        {
+            int calls = 0;
+            bool thrown = false;
+            try
+            {
+                map.update(1, [&](int& v)
+                {
+                    v = 10 * fail_on;
+                    if (++calls == fail_on)
+                    {
+                        throw std::runtime_error("update");
+                    }
+                });
+            }
+            catch (const std::runtime_error&)
+            {
+                thrown = true;
+            }
+            STRESS_CHECK(thrown);
+            
+            // Failing on the first copy leaves the map unchanged; failing on
+            // the second one happens after the write was published.
+            int expected = fail_on == 1 ? 1 : 20;
+            STRESS_CHECK(map.get(1).first == expected);
+            map.set(2, fail_on);
+            STRESS_CHECK(map.get(1).first == expected);
+            map.erase(2);
+            STRESS_CHECK(map.get(1).first == expected);
+        }
+    }
+}
+
+int main()
+{
+    throwing_update();
+    readers_and_writers(2, stress::threads());
+    std::printf("left_right_unordered_map_test: ok\n");
+    return 0;
+}
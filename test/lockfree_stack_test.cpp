@@ -0,0 +1,113 @@
+//
+//  lockfree_stack_test.cpp
+//  stl_extension
+//
+//  Created by Kingle Zhuang on 11/20/19.
+//  Copyright © 2019 RingCentral. All rights reserved.
+//
+
+// threadsafe_lockfree_stack under contention. Every thread pushes values
+// unique to it and pops in bursts, so pushes and pops collide both on the
+// top pointer and in the elimination array. Every value pushed must come
+// out exactly once; a single-threaded run checks the LIFO order.
+
+#include <vector>
+#include <cstdint>
+#include <iterator>
+#include <algorithm>
+#include "stress_test.hpp"
+#include "../threadsafe_stack.hpp"
+
+namespace
+{
+    uint64_t make_value(unsigned id, uint64_t i)
+    {
+        return (uint64_t(id) << 32) | i;
+    }
+    
+    void push_pop(unsigned threads)
+    {
+        const uint64_t per_thread = 100000;
+        std::threadsafe_lockfree_stack<uint64_t> stack;
+        std::vector<std::vector<uint64_t>> popped(threads);
+        
+        stress::run(threads, [&](unsigned id)
+        {
+            uint64_t state = 0x2545F4914F6CDD1Dull * (id + 1);
+            std::vector<uint64_t>& out = popped[id];
+            uint64_t i = 0;
+            while (i < per_thread)
+            {
+                uint64_t burst = stress::next_random(state) % 8 + 1;
+                for (uint64_t b = 0; b < burst && i < per_thread; ++b)
+                {
+                    stack.push(make_value(id, i++));
+                }
+                
+                uint64_t v;
+                switch (stress::next_random(state) % 3)
+                {
+                    case 0:
+                        stack.pop_n(std::back_inserter(out), burst);
+                        break;
+                    case 1:
+                        if (auto o = stack.try_pop())
+                        {
+                            out.push_back(*o);
+                        }
+                        break;
+                    default:
+                        for (uint64_t b = 0; b < burst && stack.try_pop(v); ++b)
+                        {
+                            out.push_back(v);
+                        }
+                        break;
+                }
+            }
+        });
+        
+        std::vector<uint64_t> all;
+        for (const auto& out : popped)
+        {
+            all.insert(all.end(), out.begin(), out.end());
+        }
+        stack.pop_n(std::back_inserter(all), ~size_t(0));
+        STRESS_CHECK(stack.empty());
+        STRESS_CHECK(stack.size() == 0);
+        
+        STRESS_CHECK(all.size() == threads * per_thread);
+        std::sort(all.begin(), all.end());
+        for (unsigned id = 0; id < threads; ++id)
+        {
+            for (uint64_t i = 0; i < per_thread; ++i)
+            {
+                STRESS_CHECK(all[id * per_thread + i] == make_value(id, i));
+            }
+        }
+    }
+    
+    // With a single thread nothing can interleave, so the order is exact.
+    void lifo_order()
+    {
+        std::threadsafe_lockfree_stack<int> stack;
+        for (int i = 0; i < 1000; ++i)
+        {
+            stack.push(i);
+        }
+        for (int i = 999; i >= 0; --i)
+        {
+            int v = -1;
+            STRESS_CHECK(stack.try_pop(v));
+            STRESS_CHECK(v == i);
+        }
+        STRESS_CHECK(!stack.try_pop());
+    }
+}
+
+int main()
+{
+    lifo_order();
+    push_pop(stress::threads());
+    std::printf("lockfree_stack_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,119 @@
+//
+//  lockfree_unordered_set_test.cpp
+//  stl_extension
+//
+//  Created by Kingle Zhuang on 11/20/19.
+//  Copyright © 2019 RingCentral. All rights reserved.
+//
+
+// threadsafe_lockfree_unordered_set under concurrent insert, erase and
+// lookup. Every successful insert and erase is counted per key, so at the
+// end each key must be present exactly when its count is one, and the set
+// must agree with itself through contains(), size(), value() and for_each().
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <unordered_set>
+#include "stress_test.hpp"
+#include "../threadsafe_unordered_set.hpp"
+
+namespace
+{
+    // Disjoint key ranges: every thread owns its keys, so the outcome of
+    // each operation is known in advance, while the buckets and the split
+    // ordered list are shared and keep growing.
+    void owned_keys(unsigned threads)
+    {
+        const uint64_t per_thread = 20000;
+        std::threadsafe_lockfree_unordered_set<uint64_t> set;
+        
+        stress::run(threads, [&](unsigned id)
+        {
+            uint64_t base = id * per_thread;
+            for (uint64_t k = base; k < base + per_thread; ++k)
+            {
+                STRESS_CHECK(set.insert(k));
+                STRESS_CHECK(set.contains(k));
+                STRESS_CHECK(!set.insert(k));
+            }
+            for (uint64_t k = base; k < base + per_thread; k += 2)
+            {
+                STRESS_CHECK(set.erase(k) == 1);
+                STRESS_CHECK(!set.contains(k));
+            }
+            for (uint64_t k = base + 1; k < base + per_thread; k += 2)
+            {
+                STRESS_CHECK(set.contains(k));
+            }
+        });
+        
+        STRESS_CHECK(set.size() == threads * per_thread / 2);
+        std::unordered_set<uint64_t> seen;
+        set.for_each([&](uint64_t k)
+        {
+            STRESS_CHECK(k % 2 == 1);
+            STRESS_CHECK(seen.insert(k).second);
+        });
+        STRESS_CHECK(seen.size() == set.size());
+        STRESS_CHECK(set.value().size() == set.size());
+    }
+    
+    // Every thread inserts and erases the same small range of keys, so the
+    // operations race on the same nodes and on the marked pointers.
+    void shared_keys(unsigned threads)
+    {
+        const uint64_t keys = 64;
+        const size_t ops = 100000;
+        std::threadsafe_lockfree_unordered_set<uint64_t> set;
+        std::vector<std::atomic<long>> balance(keys);
+        
+        stress::run(threads, [&](unsigned id)
+        {
+            uint64_t state = 0x9E3779B97F4A7C15ull * (id + 1);
+            for (size_t i = 0; i < ops; ++i)
+            {
+                uint64_t r = stress::next_random(state);
+                uint64_t k = r % keys;
+                switch ((r >> 32) % 3)
+                {
+                    case 0:
+                        if (set.insert(k))
+                        {
+                            balance[k].fetch_add(1);
+                        }
+                        break;
+                    case 1:
+                        if (set.erase(k))
+                        {
+                            balance[k].fetch_sub(1);
+                        }
+                        break;
+                    default:
+                        set.contains(k);
+                        break;
+                }
+            }
+        });
+        
+        size_t present = 0;
+        for (uint64_t k = 0; k < keys; ++k)
+        {
+            long b = balance[k].load();
+            STRESS_CHECK(b == 0 || b == 1);
+            STRESS_CHECK(set.contains(k) == (b == 1));
+            present += size_t(b);
+        }
+        STRESS_CHECK(set.size() == present);
+        STRESS_CHECK(set.value().size() == present);
+    }
+}
+
+int main()
+{
+    unsigned threads = stress::threads();
+    owned_keys(threads);
+    shared_keys(threads);
+    std::printf("lockfree_unordered_set_test: ok\n");
+    return 0;
+}
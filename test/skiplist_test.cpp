@@ -0,0 +1,158 @@
+//
+//  skiplist_test.cpp
+//  stl_extension
+//
+//  Created by Kingle Zhuang on 11/20/19.
+//  Copyright © 2019 RingCentral. All rights reserved.
+//
+
+// threadsafe_skiplist_set and threadsafe_skiplist_map under concurrent
+// writers and lock-free ordered readers. Successful inserts and erases are
+// counted per key and have to match the final contents; readers check that
+// every traversal is strictly ordered and that a value read for a key was
+// written for that key.
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include "stress_test.hpp"
+#include "../threadsafe_map.hpp"
+#include "../threadsafe_set.hpp"
+
+namespace
+{
+    const uint64_t keys = 256;
+    
+    void set_balance(unsigned threads)
+    {
+        const size_t ops = 50000;
+        std::threadsafe_skiplist_set<uint64_t> set;
+        std::vector<std::atomic<long>> balance(keys);
+        
+        stress::run(threads, [&](unsigned id)
+        {
+            uint64_t state = 0x9E3779B97F4A7C15ull * (id + 1);
+            for (size_t i = 0; i < ops; ++i)
+            {
+                uint64_t r = stress::next_random(state);
+                uint64_t k = r % keys;
+                switch ((r >> 32) % 4)
+                {
+                    case 0:
+                        if (set.insert(k))
+                        {
+                            balance[k].fetch_add(1);
+                        }
+                        break;
+                    case 1:
+                        if (set.erase(k))
+                        {
+                            balance[k].fetch_sub(1);
+                        }
+                        break;
+                    case 2:
+                        set.contains(k);
+                        break;
+                    default:
+                    {
+                        bool first = true;
+                        uint64_t prev = 0;
+                        set.for_each_range(k / 2, k, [&](uint64_t v)
+                        {
+                            STRESS_CHECK(v >= k / 2 && v < k);
+                            STRESS_CHECK(first || v > prev);
+                            first = false;
+                            prev = v;
+                        });
+                        break;
+                    }
+                }
+            }
+        });
+        
+        size_t present = 0;
+        for (uint64_t k = 0; k < keys; ++k)
+        {
+            long b = balance[k].load();
+            STRESS_CHECK(b == 0 || b == 1);
+            STRESS_CHECK(set.contains(k) == (b == 1));
+            present += size_t(b);
+        }
+        STRESS_CHECK(set.size() == present);
+        
+        bool first = true;
+        uint64_t prev = 0;
+        size_t visited = 0;
+        set.for_each([&](uint64_t v)
+        {
+            STRESS_CHECK(first || v > prev);
+            first = false;
+            prev = v;
+            ++visited;
+        });
+        STRESS_CHECK(visited == present);
+    }
+    
+    // Values are written as key + keys * n, so any value read for a key
+    // must map back to that key.
+    void map_values(unsigned threads)
+    {
+        const size_t ops = 50000;
+        std::threadsafe_skiplist_map<uint64_t, uint64_t> map;
+        
+        stress::run(threads, [&](unsigned id)
+        {
+            uint64_t state = 0x2545F4914F6CDD1Dull * (id + 1);
+            for (size_t i = 0; i < ops; ++i)
+            {
+                uint64_t r = stress::next_random(state);
+                uint64_t k = r % keys;
+                switch ((r >> 32) % 4)
+                {
+                    case 0:
+                        map.set(k, k + keys * i);
+                        break;
+                    case 1:
+                        map.erase(k);
+                        break;
+                    case 2:
+                    {
+                        auto v = map.get(k);
+                        STRESS_CHECK(!v.second || v.first % keys == k);
+                        break;
+                    }
+                    default:
+                    {
+                        bool first = true;
+                        uint64_t prev = 0;
+                        map.for_each([&](const auto& kv)
+                        {
+                            STRESS_CHECK(kv.second % keys == kv.first);
+                            STRESS_CHECK(first || kv.first > prev);
+                            first = false;
+                            prev = kv.first;
+                        });
+                        break;
+                    }
+                }
+            }
+        });
+        
+        auto snapshot = map.value();
+        STRESS_CHECK(snapshot.size() == map.size());
+        for (const auto& kv : snapshot)
+        {
+            STRESS_CHECK(kv.second % keys == kv.first);
+            STRESS_CHECK(map.contains(kv.first));
+        }
+    }
+}
+
+int main()
+{
+    unsigned threads = stress::threads();
+    set_balance(threads);
+    map_values(threads);
+    std::printf("skiplist_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,73 @@
+//
+//  stress_test.hpp
+//  stl_extension
+//
+//  Created by Kingle Zhuang on 11/20/19.
+//  Copyright © 2019 RingCentral. All rights reserved.
+//
+
+// Helpers shared by the stress tests. A test is a plain executable that
+// aborts on the first failed check, so it works unchanged under CTest and
+// the sanitizers.
+
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+
+#define STRESS_CHECK(cond)                                                                  \
+    do                                                                                      \
+    {                                                                                       \
+        if (!(cond))                                                                        \
+        {                                                                                   \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);   \
+            std::abort();                                                                   \
+        }                                                                                   \
+    } while (0)
+
+namespace stress
+{
+    // At least four threads, so the interleavings are exercised even on a
+    // single core.
+    inline unsigned threads()
+    {
+        unsigned n = std::thread::hardware_concurrency();
+        return n < 4 ? 4 : n;
+    }
+    
+    // Runs fn(id) on n threads that are released together.
+    template <class Function>
+    void run(unsigned n, Function fn)
+    {
+        std::atomic<bool> go(false);
+        std::vector<std::thread> pool;
+        for (unsigned t = 0; t < n; ++t)
+        {
+            pool.emplace_back([&go, &fn, t]
+            {
+                while (!go.load(std::memory_order_acquire))
+                {
+                    std::this_thread::yield();
+                }
+                fn(t);
+            });
+        }
+        go.store(true, std::memory_order_release);
+        for (auto& t : pool)
+        {
+            t.join();
+        }
+    }
+    
+    inline uint64_t next_random(uint64_t& state)
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+}
@@ -0,0 +1,302 @@
+//
+//  threadsafe_allocator.hpp
+//  stl_extension
+//
+//  Created by Kingle Zhuang on 11/20/19.
+//  Copyright © 2019 RingCentral. All rights reserved.
+//
+
+#pragma once
+
+#include <new>
+#include <mutex>
+#include <vector>
+#include <cstddef>
+#include <type_traits>
+#include "threadsafe_mutex.hpp"
+
+namespace std
+{
+    // Fixed-size block pools behind threadsafe_node_allocator, one per 16 byte
+    // size class up to __max_block. Blocks move between the shared pools and
+    // the per-thread caches a batch at a time, so the spinlock of a pool is
+    // taken once per __batch allocations; memory is carved out of __chunk
+    // byte chunks that are kept for the lifetime of the process.
+    class __node_pools
+    {
+    public:
+        static constexpr size_t __granularity = 16;
+        static constexpr size_t __max_block = 256;
+        static constexpr size_t __classes = __max_block / __granularity;
+        
+    private:
+        static constexpr size_t __batch = 64;
+        static constexpr size_t __chunk = 64 * 1024;
+        
+        struct __block
+        {
+            __block* __next_;
+        };
+        
+        struct __batch_list
+        {
+            __block* __head_;
+            size_t   __count_;
+        };
+        
+        struct alignas(64) __pool
+        {
+            threadsafe_spin_mutex __mutex_;
+            vector<__batch_list> __full_;
+            vector<void*> __chunks_;
+        };
+        
+        struct __thread_cache
+        {
+            __batch_list __lists_[__classes] = {};
+            
+            ~__thread_cache()
+            {
+                for (size_t c = 0; c < __classes; ++c)
+                {
+                    if (__lists_[c].__head_)
+                    {
+                        __instance().__give(c, __lists_[c]);
+                        __lists_[c] = {};
+                    }
+                }
+                __cache_gone() = true;
+            }
+        };
+        
+        __pool __pools_[__classes];
+        
+        // Never destroyed: containers with static storage duration may still
+        // free nodes after the pools would have been torn down.
+        static __node_pools& __instance()
+        {
+            static __node_pools* pools = new __node_pools();
+            return *pools;
+        }
+        
+        static __thread_cache& __cache()
+        {
+            static thread_local __thread_cache cache;
+            return cache;
+        }
+        
+        // Set once the thread's cache has been destroyed. Containers with
+        // static storage duration are torn down after the main thread's
+        // thread_locals, so their nodes then go straight to the pools.
+        static bool& __cache_gone()
+        {
+            static thread_local bool gone = false;
+            return gone;
+        }
+        
+        __batch_list __take(size_t __c)
+        {
+            __pool& pool = __pools_[__c];
+            std::unique_lock<threadsafe_spin_mutex> lock(pool.__mutex_);
+            if (pool.__full_.empty())
+            {
+                __carve(__c, pool);
+            }
+            
+            __batch_list r = pool.__full_.back();
+            pool.__full_.pop_back();
+            return r;
+        }
+        
+        // Takes a single block, leaving the rest of its batch in the pool.
+        void* __take_one(size_t __c)
+        {
+            __pool& pool = __pools_[__c];
+            std::unique_lock<threadsafe_spin_mutex> lock(pool.__mutex_);
+            if (pool.__full_.empty())
+            {
+                __carve(__c, pool);
+            }
+            
+            __batch_list& l = pool.__full_.back();
+            __block* b = l.__head_;
+            l.__head_ = b->__next_;
+            if (--l.__count_ == 0)
+            {
+                pool.__full_.pop_back();
+            }
+            return b;
+        }
+        
+        void __give(size_t __c, __batch_list __l)
+        {
+            __pool& pool = __pools_[__c];
+            std::unique_lock<threadsafe_spin_mutex> lock(pool.__mutex_);
+            pool.__full_.push_back(__l);
+        }
+        
+        static void __carve(size_t __c, __pool& __p)
+        {
+            size_t size = (__c + 1) * __granularity;
+            char* chunk = static_cast<char*>(::operator new(__chunk));
+            __p.__chunks_.push_back(chunk);
+            
+            size_t blocks = __chunk / size;
+            for (size_t first = 0; first < blocks; first += __batch)
+            {
+                size_t last = first + __batch < blocks ? first + __batch : blocks;
+                __block* head = nullptr;
+                for (size_t i = last; i-- > first;)
+                {
+                    __block* b = reinterpret_cast<__block*>(chunk + i * size);
+                    b->__next_ = head;
+                    head = b;
+                }
+                __p.__full_.push_back(__batch_list{head, last - first});
+            }
+        }
+        
+    public:
+        static size_t __class_of(size_t __bytes)
+        {
+            return (__bytes + __granularity - 1) / __granularity - 1;
+        }
+        
+        static void* __allocate(size_t __c)
+        {
+            if (__cache_gone())
+            {
+                return __instance().__take_one(__c);
+            }
+            
+            __batch_list& l = __cache().__lists_[__c];
+            if (!l.__head_)
+            {
+                l = __instance().__take(__c);
+            }
+            
+            __block* b = l.__head_;
+            l.__head_ = b->__next_;
+            --l.__count_;
+            return b;
+        }
+        
+        // Keeps up to two batches per class in the thread's cache and hands
+        // one back to the shared pool beyond that.
+        static void __deallocate(size_t __c, void* __p)
+        {
+            __block* b = static_cast<__block*>(__p);
+            if (__cache_gone())
+            {
+                b->__next_ = nullptr;
+                __instance().__give(__c, __batch_list{b, 1});
+                return;
+            }
+            
+            __batch_list& l = __cache().__lists_[__c];
+            b->__next_ = l.__head_;
+            l.__head_ = b;
+            
+            if (++l.__count_ > 2 * __batch)
+            {
+                __block* tail = l.__head_;
+                for (size_t i = 1; i < __batch; ++i)
+                {
+                    tail = tail->__next_;
+                }
+                
+                __batch_list r{l.__head_, __batch};
+                l.__head_ = tail->__next_;
+                l.__count_ -= __batch;
+                tail->__next_ = nullptr;
+                __instance().__give(__c, r);
+            }
+        }
+    };
+    
+    
+    // Stateless allocator for the node-based containers, for example
+    //
+    //     threadsafe_map<K, V, less<K>, threadsafe_node_allocator<pair<const K, V>>>
+    //
+    // Single-object allocations of up to 256 bytes - the nodes the container
+    // rebinds the allocator to - come from the size class matching the node
+    // and are served from a thread-local free list, so an insert under the
+    // container's lock no longer goes through malloc. Arrays such as the
+    // bucket table of the unordered containers and over-aligned types use
+    // operator new. Freed nodes go back to the pools rather than to the
+    // system, and clear() releases them one by one: the pools are shared by
+    // all containers, so a container cannot drop its nodes in bulk.
+    template <typename _Tp>
+    class threadsafe_node_allocator
+    {
+    public:
+        typedef _Tp                                             value_type;
+        typedef size_t                                          size_type;
+        typedef ptrdiff_t                                       difference_type;
+        typedef true_type                                       propagate_on_container_move_assignment;
+        typedef true_type                                       is_always_equal;
+        
+        template <class _Up>
+        struct rebind
+        {
+            typedef threadsafe_node_allocator<_Up> other;
+        };
+        
+    private:
+        static constexpr bool __pooled = sizeof(_Tp) <= __node_pools::__max_block && alignof(_Tp) <= __node_pools::__granularity;
+        
+    public:
+        threadsafe_node_allocator() noexcept {}
+        
+        template <class _Up>
+        threadsafe_node_allocator(const threadsafe_node_allocator<_Up>&) noexcept {}
+        
+        _Tp* allocate(size_type __n)
+        {
+            if (__pooled && __n == 1)
+            {
+                return static_cast<_Tp*>(__node_pools::__allocate(__node_pools::__class_of(sizeof(_Tp))));
+            }
+            
+            if (__n > size_type(-1) / sizeof(_Tp))
+            {
+                throw bad_array_new_length();
+            }
+            
+            if (alignof(_Tp) > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+            {
+                return static_cast<_Tp*>(::operator new(__n * sizeof(_Tp), align_val_t(alignof(_Tp))));
+            }
+            return static_cast<_Tp*>(::operator new(__n * sizeof(_Tp)));
+        }
+        
+        void deallocate(_Tp* __p, size_type __n) noexcept
+        {
+            if (__pooled && __n == 1)
+            {
+                __node_pools::__deallocate(__node_pools::__class_of(sizeof(_Tp)), __p);
+            }
+            else if (alignof(_Tp) > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+            {
+                ::operator delete(__p, align_val_t(alignof(_Tp)));
+            }
+            else
+            {
+                ::operator delete(__p);
+            }
+        }
+    };
+    
+    template <class _Tp, class _Up>
+    bool operator==(const threadsafe_node_allocator<_Tp>&, const threadsafe_node_allocator<_Up>&) noexcept
+    {
+        return true;
+    }
+    
+    template <class _Tp, class _Up>
+    bool operator!=(const threadsafe_node_allocator<_Tp>&, const threadsafe_node_allocator<_Up>&) noexcept
+    {
+        return false;
+    }
+}
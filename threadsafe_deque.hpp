@@ -9,27 +9,36 @@
 #pragma once
 
 #include <mutex>
+#include <atomic>
 #include <deque>
+#include <chrono>
 #include <memory>
+#include <optional>
 #include <utility>
 #include <algorithm>
 #include <functional>
 #include <shared_mutex>
+#include <memory_resource>
+#include <condition_variable>
+#include "threadsafe_mutex.hpp"
+#include "threadsafe_parallel.hpp"
+#include "threadsafe_read_view.hpp"
 
 namespace std
 {
-    template <typename _Tp, typename _Allocator = allocator<_Tp>>
+    template <typename _Tp, typename _Allocator = allocator<_Tp>, typename _Mutex = shared_timed_mutex>
     class threadsafe_deque
     {
     private:
         typedef std::deque<_Tp, _Allocator> __deque_type;
         
-        mutable std::shared_timed_mutex __mutex_;
-        __deque_type __internal_queue_;
+        mutable _Mutex __mutex_;
+        shared_ptr<__deque_type> __internal_queue_;
         
     public:
         typedef _Tp                                             value_type;
         typedef _Allocator                                      allocator_type;
+        typedef _Mutex                                          mutex_type;
         
         typedef          __deque_type                           deque_type;
         typedef typename __deque_type::reference                reference;
@@ -44,230 +53,783 @@ namespace std
         typedef typename __deque_type::const_reverse_iterator   const_reverse_iterator;
         
     public:
-        threadsafe_deque() : __internal_queue_() {}
-        explicit threadsafe_deque(size_type __n) : __internal_queue_(__n) {}
-        threadsafe_deque(size_type __n, const value_type& __v) : __internal_queue_(__n, __v) {}
-        threadsafe_deque(const deque_type& __l) : __internal_queue_(__l) {}
-        threadsafe_deque(deque_type&& __l) : __internal_queue_(std::move(__l)) {}
-        threadsafe_deque(initializer_list<value_type> __il) : __internal_queue_(__il) {}
+        threadsafe_deque() : __internal_queue_(std::make_shared<__deque_type>()) {}
+        explicit threadsafe_deque(const allocator_type& __a) : __internal_queue_(std::make_shared<__deque_type>(__a)) {}
+        explicit threadsafe_deque(size_type __n) : __internal_queue_(std::make_shared<__deque_type>(__n)) {}
+        threadsafe_deque(size_type __n, const value_type& __v) : __internal_queue_(std::make_shared<__deque_type>(__n, __v)) {}
+        threadsafe_deque(const deque_type& __l) : __internal_queue_(std::make_shared<__deque_type>(__l)) {}
+        threadsafe_deque(deque_type&& __l) : __internal_queue_(std::make_shared<__deque_type>(std::move(__l))) {}
+        threadsafe_deque(initializer_list<value_type> __il) : __internal_queue_(std::make_shared<__deque_type>(__il)) {}
         
         template <class _InputIterator>
-        threadsafe_deque(_InputIterator __f, _InputIterator __l) : __internal_queue_(__f, __l) {}
+        threadsafe_deque(_InputIterator __f, _InputIterator __l) : __internal_queue_(std::make_shared<__deque_type>(__f, __l)) {}
         
         threadsafe_deque(const threadsafe_deque&) = delete;
         threadsafe_deque& operator=(const threadsafe_deque&) = delete;
         threadsafe_deque(threadsafe_deque&&) = delete;
         threadsafe_deque& operator=(threadsafe_deque&&) = delete;
         
+    private:
+        // Copy-on-write: a deque still referenced by a snapshot is copied (or
+        // replaced by an empty one for clear/assign) before it is modified.
+        void __detach(bool __copy = true)
+        {
+            if (__internal_queue_.use_count() > 1)
+            {
+                __internal_queue_ = __copy ? std::make_shared<__deque_type>(*__internal_queue_, __internal_queue_->get_allocator())
+                                           : std::make_shared<__deque_type>(__internal_queue_->get_allocator());
+            }
+            else
+            {
+                atomic_thread_fence(memory_order_acquire);
+            }
+        }
+        
+        template <class _Op>
+        auto __parallel(_Op __op)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            const __deque_type& c = *__internal_queue_;
+            auto visit = [&c](size_t __f, size_t __l, auto& __bl)
+            {
+                for (; __f < __l; ++__f)
+                {
+                    __bl(c[__f]);
+                }
+            };
+            return __op(c.size(), __parallel_pieces(c.size()), visit);
+        }
+        
     public:
         template <class _InputIterator>
         void assign(_InputIterator __f, _InputIterator __l)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_queue_.assign(__f, __l);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            __internal_queue_->assign(__f, __l);
         }
         
         void assign(size_type __n, const value_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_queue_.assign(__n, __v);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            __internal_queue_->assign(__n, __v);
         }
         
         void assign(initializer_list<value_type> __il)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_queue_.assign(__il);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            __internal_queue_->assign(__il);
+        }
+        
+        allocator_type get_allocator() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_queue_->get_allocator();
         }
         
         bool empty() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_queue_.empty();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_queue_->empty();
         }
         
         size_type size() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_queue_.size();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_queue_->size();
         }
         
         size_type max_size() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_queue_.max_size();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_queue_->max_size();
         }
         
         void resize(size_type __n)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_queue_.resize(__n);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_queue_->resize(__n);
         }
         
         void resize(size_type __n, const value_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_queue_.resize(__n, __v);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_queue_->resize(__n, __v);
         }
         
         void shrink_to_fit()
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_queue_.shrink_to_fit();
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_queue_->shrink_to_fit();
         }
         
         const value_type& front()
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return static_cast<const value_type&>(__internal_queue_.front());
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return static_cast<const value_type&>(__internal_queue_->front());
         }
         
         const value_type& back()
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return static_cast<const value_type&>(__internal_queue_.back());
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return static_cast<const value_type&>(__internal_queue_->back());
         }
         
         void push_front(const value_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_queue_.push_front(__v);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_queue_->push_front(__v);
+        }
+        
+        void push_front(value_type&& __v)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_queue_->push_front(std::move(__v));
+        }
+        
+        template <class... _Args>
+        void emplace_front(_Args&&... __args)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_queue_->emplace_front(std::forward<_Args>(__args)...);
         }
         
         void push_back(const value_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_queue_.push_back(__v);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_queue_->push_back(__v);
+        }
+        
+        void push_back(value_type&& __v)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_queue_->push_back(std::move(__v));
+        }
+        
+        template <class... _Args>
+        void emplace_back(_Args&&... __args)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_queue_->emplace_back(std::forward<_Args>(__args)...);
         }
         
         void pop_front()
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_queue_.pop_front();
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_queue_->pop_front();
         }
         
         void pop_back()
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_queue_.pop_back();
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_queue_->pop_back();
+        }
+        
+        bool try_pop_front(value_type& __v)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            if (__internal_queue_->empty())
+            {
+                return false;
+            }
+            
+            __detach();
+            __v = std::move(__internal_queue_->front());
+            __internal_queue_->pop_front();
+            return true;
+        }
+        
+        std::optional<value_type> try_pop_front()
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            if (__internal_queue_->empty())
+            {
+                return std::nullopt;
+            }
+            
+            __detach();
+            std::optional<value_type> r(std::move(__internal_queue_->front()));
+            __internal_queue_->pop_front();
+            return r;
+        }
+        
+        template <class _OutputIterator>
+        size_type pop_front_n(_OutputIterator __out, size_type __n)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            if (__n == 0 || __internal_queue_->empty())
+            {
+                return 0;
+            }
+            
+            __detach();
+            size_type i = 0;
+            for (; i < __n && !__internal_queue_->empty(); ++i)
+            {
+                *__out++ = std::move(__internal_queue_->front());
+                __internal_queue_->pop_front();
+            }
+            return i;
+        }
+        
+        bool try_pop_back(value_type& __v)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            if (__internal_queue_->empty())
+            {
+                return false;
+            }
+            
+            __detach();
+            __v = std::move(__internal_queue_->back());
+            __internal_queue_->pop_back();
+            return true;
+        }
+        
+        std::optional<value_type> try_pop_back()
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            if (__internal_queue_->empty())
+            {
+                return std::nullopt;
+            }
+            
+            __detach();
+            std::optional<value_type> r(std::move(__internal_queue_->back()));
+            __internal_queue_->pop_back();
+            return r;
+        }
+        
+        template <class _OutputIterator>
+        size_type pop_back_n(_OutputIterator __out, size_type __n)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            if (__n == 0 || __internal_queue_->empty())
+            {
+                return 0;
+            }
+            
+            __detach();
+            size_type i = 0;
+            for (; i < __n && !__internal_queue_->empty(); ++i)
+            {
+                *__out++ = std::move(__internal_queue_->back());
+                __internal_queue_->pop_back();
+            }
+            return i;
         }
         
         void clear()
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_queue_.clear();
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            __internal_queue_->clear();
         }
         
         const value_type& operator[](size_type __n)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_queue_[__n];
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return (*__internal_queue_)[__n];
         }
         
         const value_type& at(size_type __n)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_queue_.at(__n);
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_queue_->at(__n);
         }
         
         void set(size_type __n, const value_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_queue_[__n] = __v;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            (*__internal_queue_)[__n] = __v;
+        }
+        
+        void set(size_type __n, value_type&& __v)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            (*__internal_queue_)[__n] = std::move(__v);
         }
         
         void operator=(const deque_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_queue_ = __v;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            *__internal_queue_ = __v;
         }
         
-        void operator=(initializer_list<deque_type> __il)
+        void operator=(initializer_list<value_type> __il)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_queue_ = __il;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            *__internal_queue_ = __il;
         }
         
         deque_type value()
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return *__internal_queue_;
+        }
+        
+        std::shared_ptr<const deque_type> snapshot() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
             return __internal_queue_;
         }
         
-        void erase(std::function<bool(const value_type&)> __comp)
+        threadsafe_read_view<deque_type, mutex_type> read() const
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            for (const_iterator it = __internal_queue_.begin(); it != __internal_queue_.end();)
-            {
-                if (__comp(*it))
-                {
-                    it = __internal_queue_.erase(it);
-                }
-                else
-                {
-                    ++it;
-                }
-            }
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return threadsafe_read_view<deque_type, mutex_type>(std::move(lock), __internal_queue_.get());
+        }
+        
+        threadsafe_read_view<value_type, mutex_type> read(size_type __n) const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            const value_type* p = &__internal_queue_->at(__n);
+            return threadsafe_read_view<value_type, mutex_type>(std::move(lock), p);
+        }
+        
+        template <typename _Predicate>
+        size_type erase(_Predicate __pred)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            auto it = __compact(__internal_queue_->begin(), __internal_queue_->end(), __pred);
+            size_type n = __internal_queue_->end() - it;
+            __internal_queue_->erase(it, __internal_queue_->end());
+            return n;
+        }
+        
+        template <typename _Predicate>
+        size_type parallel_erase(_Predicate __pred)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            auto it = __parallel_remove_if(__internal_queue_->begin(), __internal_queue_->end(), __pred);
+            size_type n = __internal_queue_->end() - it;
+            __internal_queue_->erase(it, __internal_queue_->end());
+            return n;
         }
         
         template <typename _Predicate>
         std::pair<const value_type, bool> find_and_erase(_Predicate __pred)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            const_iterator it = std::find_if(__internal_queue_.begin(), __internal_queue_.end(), __pred);
-            if (it != __internal_queue_.end())
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            const_iterator it = std::find_if(__internal_queue_->begin(), __internal_queue_->end(), __pred);
+            if (it != __internal_queue_->end())
             {
                 value_type r = *it;
-                __internal_queue_.erase(it);
+                __internal_queue_->erase(it);
                 return std::make_pair(r, true);
             }
             
             return std::make_pair(value_type(), false);
         }
         
-        void insert(std::function<const_iterator(const deque_type&)> __pos, const value_type& __v)
+        template <class _Position>
+        void insert(_Position __pos, value_type&& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
             
-            const_iterator pos = __pos(__internal_queue_);
+            const_iterator pos = __pos(*__internal_queue_);
             
-            __internal_queue_.insert(pos, __v);
+            __internal_queue_->insert(pos, std::move(__v));
         }
         
-        void insert(std::function<const_iterator(const deque_type&)> __pos, size_type __n, const value_type& __v)
+        template <class _Position, class... _Args>
+        void emplace(_Position __pos, _Args&&... __args)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
             
-            const_iterator pos = __pos(__internal_queue_);
+            const_iterator pos = __pos(*__internal_queue_);
             
-            __internal_queue_.insert(pos, __n, __v);
+            __internal_queue_->emplace(pos, std::forward<_Args>(__args)...);
         }
         
-        template <class _InputIterator>
-        void insert(std::function<const_iterator(const deque_type&)> __pos, _InputIterator __f, _InputIterator __l)
+        template <class _Position>
+        void insert(_Position __pos, const value_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
             
-            const_iterator pos = __pos(__internal_queue_);
+            const_iterator pos = __pos(*__internal_queue_);
             
-            __internal_queue_.insert(pos, __f, __l);
+            __internal_queue_->insert(pos, __v);
         }
         
-        void insert(std::function<const_iterator(const deque_type&)> __pos, initializer_list<value_type> __il)
+        template <class _Position>
+        void insert(_Position __pos, size_type __n, const value_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
             
-            const_iterator pos = __pos(__internal_queue_);
+            const_iterator pos = __pos(*__internal_queue_);
             
-            __internal_queue_.insert(pos, __il);
+            __internal_queue_->insert(pos, __n, __v);
         }
         
-        void for_each(std::function<void(const value_type&)> __bl)
+        template <class _Position, class _InputIterator,
+                  class = typename enable_if<is_convertible<typename iterator_traits<_InputIterator>::iterator_category, input_iterator_tag>::value>::type>
+        void insert(_Position __pos, _InputIterator __f, _InputIterator __l)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            for (const auto& v : __internal_queue_)
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            
+            const_iterator pos = __pos(*__internal_queue_);
+            
+            __internal_queue_->insert(pos, __f, __l);
+        }
+        
+        template <class _Position>
+        void insert(_Position __pos, initializer_list<value_type> __il)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            
+            const_iterator pos = __pos(*__internal_queue_);
+            
+            __internal_queue_->insert(pos, __il);
+        }
+        
+        template <typename _Function>
+        void for_each(_Function __bl)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            for (const auto& v : *__internal_queue_)
             {
                 __bl(v);
             }
         }
+        
+        // Index cursor, see threadsafe_vector::scan. Pushing or popping at the
+        // front shifts the indices of the elements not yet visited.
+        class scan_cursor
+        {
+            friend class threadsafe_deque;
+            
+            size_type __index_ = 0;
+            bool __done_ = false;
+            
+        public:
+            bool done() const { return __done_; }
+        };
+        
+        template <typename _Function>
+        size_type scan(scan_cursor& __c, size_type __count, _Function __bl)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            if (__c.__done_)
+            {
+                return 0;
+            }
+            
+            size_type size = __internal_queue_->size();
+            size_type n = 0;
+            for (; n < __count && __c.__index_ < size; ++__c.__index_, ++n)
+            {
+                __bl((*__internal_queue_)[__c.__index_]);
+            }
+            __c.__done_ = __c.__index_ >= size;
+            return n;
+        }
+        
+        // See threadsafe_vector::parallel_for_each.
+        template <typename _Function>
+        void parallel_for_each(_Function __bl)
+        {
+            __parallel([&](size_t __units, size_t __pieces, auto& __visit) { __parallel_for_each(__units, __pieces, __visit, __bl); });
+        }
+        
+        template <typename _Result, typename _Accumulate, typename _Combine>
+        _Result parallel_reduce(_Result __identity, _Accumulate __acc, _Combine __comb)
+        {
+            return __parallel([&](size_t __units, size_t __pieces, auto& __visit) { return __parallel_reduce(__units, __pieces, __visit, std::move(__identity), __acc, __comb); });
+        }
+        
+        template <typename _Predicate>
+        size_type parallel_count_if(_Predicate __pred)
+        {
+            return __parallel([&](size_t __units, size_t __pieces, auto& __visit) { return __parallel_count_if(__units, __pieces, __visit, __pred); });
+        }
+    };
+    
+    
+    // Blocking work-queue flavour of threadsafe_deque. Consumers sleep on a
+    // condition variable instead of polling empty(), and producers block (or
+    // fail with try_push_*) while the optional capacity bound is reached.
+    // close() wakes every waiter: pushes fail from then on, and pops keep
+    // draining what is left before reporting false.
+    template <typename _Tp, typename _Allocator = allocator<_Tp>>
+    class threadsafe_blocking_deque
+    {
+    private:
+        typedef std::deque<_Tp, _Allocator> __deque_type;
+        
+        mutable std::mutex __mutex_;
+        std::condition_variable __not_empty_;
+        std::condition_variable __not_full_;
+        __deque_type __internal_queue_;
+        
+    public:
+        typedef _Tp                                             value_type;
+        typedef _Allocator                                      allocator_type;
+        
+        typedef          __deque_type                           deque_type;
+        typedef typename __deque_type::reference                reference;
+        typedef typename __deque_type::const_reference          const_reference;
+        typedef typename __deque_type::size_type                size_type;
+        typedef typename __deque_type::difference_type          difference_type;
+        
+    private:
+        size_type __capacity_;
+        size_type __pop_waiters_;
+        size_type __push_waiters_;
+        bool __closed_;
+        
+    public:
+        explicit threadsafe_blocking_deque(size_type __capacity = 0) : __internal_queue_(), __capacity_(__capacity), __pop_waiters_(0), __push_waiters_(0), __closed_(false) {}
+        
+        threadsafe_blocking_deque(const threadsafe_blocking_deque&) = delete;
+        threadsafe_blocking_deque& operator=(const threadsafe_blocking_deque&) = delete;
+        threadsafe_blocking_deque(threadsafe_blocking_deque&&) = delete;
+        threadsafe_blocking_deque& operator=(threadsafe_blocking_deque&&) = delete;
+        
+    private:
+        bool __full() const
+        {
+            return __capacity_ != 0 && __internal_queue_.size() >= __capacity_;
+        }
+        
+        // Waiters are counted under the lock so that the notification can be
+        // skipped, and sent after unlocking, whenever nobody is asleep.
+        template <class _Vp>
+        void __put(std::unique_lock<std::mutex>& __lock, _Vp&& __v, bool __front)
+        {
+            if (__front)
+            {
+                __internal_queue_.push_front(std::forward<_Vp>(__v));
+            }
+            else
+            {
+                __internal_queue_.push_back(std::forward<_Vp>(__v));
+            }
+            
+            bool wake = __pop_waiters_ != 0;
+            __lock.unlock();
+            if (wake)
+            {
+                __not_empty_.notify_one();
+            }
+        }
+        
+        void __take(std::unique_lock<std::mutex>& __lock, value_type& __v, bool __front)
+        {
+            if (__front)
+            {
+                __v = std::move(__internal_queue_.front());
+                __internal_queue_.pop_front();
+            }
+            else
+            {
+                __v = std::move(__internal_queue_.back());
+                __internal_queue_.pop_back();
+            }
+            
+            bool wake = __push_waiters_ != 0;
+            __lock.unlock();
+            if (wake)
+            {
+                __not_full_.notify_one();
+            }
+        }
+        
+        template <class _Vp>
+        bool __push(_Vp&& __v, bool __front)
+        {
+            std::unique_lock<std::mutex> lock(__mutex_);
+            if (!__closed_ && __full())
+            {
+                ++__push_waiters_;
+                __not_full_.wait(lock, [this] { return __closed_ || !__full(); });
+                --__push_waiters_;
+            }
+            
+            if (__closed_)
+            {
+                return false;
+            }
+            
+            __put(lock, std::forward<_Vp>(__v), __front);
+            return true;
+        }
+        
+        template <class _Vp>
+        bool __try_push(_Vp&& __v, bool __front)
+        {
+            std::unique_lock<std::mutex> lock(__mutex_);
+            if (__closed_ || __full())
+            {
+                return false;
+            }
+            
+            __put(lock, std::forward<_Vp>(__v), __front);
+            return true;
+        }
+        
+        bool __wait_pop(value_type& __v, bool __front)
+        {
+            std::unique_lock<std::mutex> lock(__mutex_);
+            if (!__closed_ && __internal_queue_.empty())
+            {
+                ++__pop_waiters_;
+                __not_empty_.wait(lock, [this] { return __closed_ || !__internal_queue_.empty(); });
+                --__pop_waiters_;
+            }
+            
+            if (__internal_queue_.empty())
+            {
+                return false;
+            }
+            
+            __take(lock, __v, __front);
+            return true;
+        }
+        
+        template <class _Rep, class _Period>
+        bool __wait_pop_for(value_type& __v, bool __front, const chrono::duration<_Rep, _Period>& __timeout)
+        {
+            std::unique_lock<std::mutex> lock(__mutex_);
+            if (!__closed_ && __internal_queue_.empty())
+            {
+                ++__pop_waiters_;
+                __not_empty_.wait_for(lock, __timeout, [this] { return __closed_ || !__internal_queue_.empty(); });
+                --__pop_waiters_;
+            }
+            
+            if (__internal_queue_.empty())
+            {
+                return false;
+            }
+            
+            __take(lock, __v, __front);
+            return true;
+        }
+        
+        bool __try_pop(value_type& __v, bool __front)
+        {
+            std::unique_lock<std::mutex> lock(__mutex_);
+            if (__internal_queue_.empty())
+            {
+                return false;
+            }
+            
+            __take(lock, __v, __front);
+            return true;
+        }
+        
+    public:
+        bool empty() const
+        {
+            std::unique_lock<std::mutex> lock(__mutex_);
+            return __internal_queue_.empty();
+        }
+        
+        size_type size() const
+        {
+            std::unique_lock<std::mutex> lock(__mutex_);
+            return __internal_queue_.size();
+        }
+        
+        size_type capacity() const
+        {
+            return __capacity_;
+        }
+        
+        bool is_closed() const
+        {
+            std::unique_lock<std::mutex> lock(__mutex_);
+            return __closed_;
+        }
+        
+        void close()
+        {
+            {
+                std::unique_lock<std::mutex> lock(__mutex_);
+                __closed_ = true;
+            }
+            __not_empty_.notify_all();
+            __not_full_.notify_all();
+        }
+        
+        void clear()
+        {
+            {
+                std::unique_lock<std::mutex> lock(__mutex_);
+                __internal_queue_.clear();
+            }
+            __not_full_.notify_all();
+        }
+        
+        deque_type value()
+        {
+            std::unique_lock<std::mutex> lock(__mutex_);
+            return __internal_queue_;
+        }
+        
+        // Blocks while the deque is full; returns false once it is closed.
+        bool push_back(const value_type& __v) { return __push(__v, false); }
+        bool push_back(value_type&& __v) { return __push(std::move(__v), false); }
+        bool push_front(const value_type& __v) { return __push(__v, true); }
+        bool push_front(value_type&& __v) { return __push(std::move(__v), true); }
+        
+        // Fails instead of blocking when the deque is full or closed.
+        bool try_push_back(const value_type& __v) { return __try_push(__v, false); }
+        bool try_push_back(value_type&& __v) { return __try_push(std::move(__v), false); }
+        bool try_push_front(const value_type& __v) { return __try_push(__v, true); }
+        bool try_push_front(value_type&& __v) { return __try_push(std::move(__v), true); }
+        
+        // Blocks while the deque is empty; returns false once it is closed and drained.
+        bool wait_pop_front(value_type& __v) { return __wait_pop(__v, true); }
+        bool wait_pop_back(value_type& __v) { return __wait_pop(__v, false); }
+        
+        template <class _Rep, class _Period>
+        bool wait_pop_front_for(value_type& __v, const chrono::duration<_Rep, _Period>& __timeout)
+        {
+            return __wait_pop_for(__v, true, __timeout);
+        }
+        
+        template <class _Rep, class _Period>
+        bool wait_pop_back_for(value_type& __v, const chrono::duration<_Rep, _Period>& __timeout)
+        {
+            return __wait_pop_for(__v, false, __timeout);
+        }
+        
+        bool try_pop_front(value_type& __v) { return __try_pop(__v, true); }
+        bool try_pop_back(value_type& __v) { return __try_pop(__v, false); }
     };
+    
+    
+    namespace pmr
+    {
+        template <typename _Tp, typename _Mutex = shared_timed_mutex>
+        using threadsafe_deque = std::threadsafe_deque<_Tp, polymorphic_allocator<_Tp>, _Mutex>;
+    }
 }
@@ -10,26 +10,33 @@
 
 #include <list>
 #include <mutex>
+#include <atomic>
+#include <vector>
 #include <memory>
 #include <utility>
 #include <algorithm>
 #include <functional>
 #include <shared_mutex>
+#include <memory_resource>
+#include "threadsafe_mutex.hpp"
+#include "threadsafe_parallel.hpp"
+#include "threadsafe_read_view.hpp"
 
 namespace std
 {
-    template <typename _Tp, typename _Allocator = allocator<_Tp>>
+    template <typename _Tp, typename _Allocator = allocator<_Tp>, typename _Mutex = shared_timed_mutex>
     class threadsafe_list
     {
     private:
         typedef std::list<_Tp, _Allocator> __list_type;
         
-        mutable std::shared_timed_mutex __mutex_;
-        __list_type __internal_list_;
+        mutable _Mutex __mutex_;
+        shared_ptr<__list_type> __internal_list_;
         
     public:
         typedef _Tp                                             value_type;
         typedef _Allocator                                      allocator_type;
+        typedef _Mutex                                          mutex_type;
         
         typedef          __list_type                            list_type;
         typedef typename __list_type::reference                 reference;
@@ -44,152 +51,233 @@ namespace std
         typedef typename __list_type::const_reverse_iterator    const_reverse_iterator;
         
     public:
-        threadsafe_list() : __internal_list_() {}
-        explicit threadsafe_list(size_type __n) : __internal_list_(__n) {}
-        threadsafe_list(size_type __n, const value_type& __v) : __internal_list_(__n, __v) {}
-        threadsafe_list(const list_type& __l) : __internal_list_(__l) {}
-        threadsafe_list(list_type&& __l) : __internal_list_(std::move(__l)) {}
-        threadsafe_list(initializer_list<value_type> __il) : __internal_list_(__il) {}
+        threadsafe_list() : __internal_list_(std::make_shared<__list_type>()) {}
+        explicit threadsafe_list(const allocator_type& __a) : __internal_list_(std::make_shared<__list_type>(__a)) {}
+        explicit threadsafe_list(size_type __n) : __internal_list_(std::make_shared<__list_type>(__n)) {}
+        threadsafe_list(size_type __n, const value_type& __v) : __internal_list_(std::make_shared<__list_type>(__n, __v)) {}
+        threadsafe_list(const list_type& __l) : __internal_list_(std::make_shared<__list_type>(__l)) {}
+        threadsafe_list(list_type&& __l) : __internal_list_(std::make_shared<__list_type>(std::move(__l))) {}
+        threadsafe_list(initializer_list<value_type> __il) : __internal_list_(std::make_shared<__list_type>(__il)) {}
         
         template <class _InputIterator>
-        threadsafe_list(_InputIterator __f, _InputIterator __l) : __internal_list_(__f, __l) {}
+        threadsafe_list(_InputIterator __f, _InputIterator __l) : __internal_list_(std::make_shared<__list_type>(__f, __l)) {}
         
         threadsafe_list(const threadsafe_list&) = delete;
         threadsafe_list& operator=(const threadsafe_list&) = delete;
         threadsafe_list(threadsafe_list&&) = delete;
         threadsafe_list& operator=(threadsafe_list&&) = delete;
         
+    private:
+        // Copy-on-write: a list still referenced by a snapshot is copied (or
+        // replaced by an empty one for clear/assign) before it is modified.
+        void __detach(bool __copy = true)
+        {
+            if (__internal_list_.use_count() > 1)
+            {
+                __internal_list_ = __copy ? std::make_shared<__list_type>(*__internal_list_, __internal_list_->get_allocator())
+                                          : std::make_shared<__list_type>(__internal_list_->get_allocator());
+            }
+            else
+            {
+                atomic_thread_fence(memory_order_acquire);
+            }
+        }
+        
     public:
         template <class _InputIterator>
         void assign(_InputIterator __f, _InputIterator __l)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_list_.assign(__f, __l);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            __internal_list_->assign(__f, __l);
         }
         
         void assign(size_type __n, const value_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_list_.assign(__n, __v);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            __internal_list_->assign(__n, __v);
         }
         
         void assign(initializer_list<value_type> __il)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_list_.assign(__il);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            __internal_list_->assign(__il);
+        }
+        
+        allocator_type get_allocator() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_list_->get_allocator();
         }
         
         bool empty() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_list_.empty();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_list_->empty();
         }
         
         size_type size() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_list_.size();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_list_->size();
         }
         
         size_type max_size() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_list_.max_size();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_list_->max_size();
         }
         
         void resize(size_type __n)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_list_.resize(__n);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_list_->resize(__n);
         }
         
         void resize(size_type __n, const value_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_list_.resize(__n, __v);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_list_->resize(__n, __v);
         }
         
         void operator=(const list_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_list_ = __v;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            *__internal_list_ = __v;
         }
         
-        void operator=(initializer_list<list_type> __il)
+        void operator=(initializer_list<value_type> __il)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_list_ = __il;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            *__internal_list_ = __il;
         }
         
         list_type value()
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return *__internal_list_;
+        }
+        
+        std::shared_ptr<const list_type> snapshot() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
             return __internal_list_;
         }
+        
+        threadsafe_read_view<list_type, mutex_type> read() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return threadsafe_read_view<list_type, mutex_type>(std::move(lock), __internal_list_.get());
+        }
 
         const value_type& front()
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return static_cast<const value_type&>(__internal_list_.front());
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return static_cast<const value_type&>(__internal_list_->front());
         }
         
         const value_type& back()
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return static_cast<const value_type&>(__internal_list_.back());
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return static_cast<const value_type&>(__internal_list_->back());
         }
         
         void push_front(const value_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_list_.push_front(__v);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_list_->push_front(__v);
+        }
+        
+        void push_front(value_type&& __v)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_list_->push_front(std::move(__v));
+        }
+        
+        template <class... _Args>
+        void emplace_front(_Args&&... __args)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_list_->emplace_front(std::forward<_Args>(__args)...);
         }
         
         void push_back(const value_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_list_.push_back(__v);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_list_->push_back(__v);
+        }
+        
+        void push_back(value_type&& __v)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_list_->push_back(std::move(__v));
+        }
+        
+        template <class... _Args>
+        void emplace_back(_Args&&... __args)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_list_->emplace_back(std::forward<_Args>(__args)...);
         }
         
         void pop_front()
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_list_.pop_front();
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_list_->pop_front();
         }
         
         void pop_back()
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_list_.pop_back();
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_list_->pop_back();
         }
         
         void clear()
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_list_.clear();
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            __internal_list_->clear();
         }
         
         void remove(const value_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_list_.remove(__v);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_list_->remove(__v);
         }
         
         template <class Pred>
         void remove_if(Pred __pred)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_list_.remove_if(__pred);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_list_->remove_if(__pred);
         }
         
-        void erase(std::function<bool(const value_type&)> __comp)
+        template <typename _Predicate>
+        void erase(_Predicate __comp)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            for (const_iterator it = __internal_list_.begin(); it != __internal_list_.end();)
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            for (const_iterator it = __internal_list_->begin(); it != __internal_list_->end();)
             {
                 if (__comp(*it))
                 {
-                    it = __internal_list_.erase(it);
+                    it = __internal_list_->erase(it);
                 }
                 else
                 {
@@ -201,58 +289,90 @@ namespace std
         template <typename _Predicate>
         std::pair<const value_type, bool> find_and_erase(_Predicate __pred)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            const_iterator it = std::find_if(__internal_list_.begin(), __internal_list_.end(), __pred);
-            if (it != __internal_list_.end())
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            const_iterator it = std::find_if(__internal_list_->begin(), __internal_list_->end(), __pred);
+            if (it != __internal_list_->end())
             {
-                __internal_list_.erase(it);
+                __internal_list_->erase(it);
                 return std::make_pair(*it, true);
             }
             
             return std::make_pair(value_type(), false);
         }
         
-        void insert(std::function<const_iterator(const list_type&)> __pos, const value_type& __v)
+        template <class _Position>
+        void insert(_Position __pos, value_type&& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
             
-            const_iterator pos = __pos(__internal_list_);
+            const_iterator pos = __pos(*__internal_list_);
             
-            __internal_list_.insert(pos, __v);
+            __internal_list_->insert(pos, std::move(__v));
         }
         
-        void insert(std::function<const_iterator(const list_type&)> __pos, size_type __n, const value_type& __v)
+        template <class _Position, class... _Args>
+        void emplace(_Position __pos, _Args&&... __args)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
             
-            const_iterator pos = __pos(__internal_list_);
+            const_iterator pos = __pos(*__internal_list_);
             
-            __internal_list_.insert(pos, __n, __v);
+            __internal_list_->emplace(pos, std::forward<_Args>(__args)...);
         }
         
-        template <class _InputIterator>
-        void insert(std::function<const_iterator(const list_type&)> __pos, _InputIterator __f, _InputIterator __l)
+        template <class _Position>
+        void insert(_Position __pos, const value_type& __v)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            
+            const_iterator pos = __pos(*__internal_list_);
+            
+            __internal_list_->insert(pos, __v);
+        }
+        
+        template <class _Position>
+        void insert(_Position __pos, size_type __n, const value_type& __v)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            
+            const_iterator pos = __pos(*__internal_list_);
+            
+            __internal_list_->insert(pos, __n, __v);
+        }
+        
+        template <class _Position, class _InputIterator,
+                  class = typename enable_if<is_convertible<typename iterator_traits<_InputIterator>::iterator_category, input_iterator_tag>::value>::type>
+        void insert(_Position __pos, _InputIterator __f, _InputIterator __l)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
             
-            const_iterator pos = __pos(__internal_list_);
+            const_iterator pos = __pos(*__internal_list_);
             
-            __internal_list_.insert(pos, __f, __l);
+            __internal_list_->insert(pos, __f, __l);
         }
         
-        void insert(std::function<const_iterator(const list_type&)> __pos, initializer_list<value_type> __il)
+        template <class _Position>
+        void insert(_Position __pos, initializer_list<value_type> __il)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
             
-            const_iterator pos = __pos(__internal_list_);
+            const_iterator pos = __pos(*__internal_list_);
             
-            __internal_list_.insert(pos, __il);
+            __internal_list_->insert(pos, __il);
         }
         
-        void for_each(std::function<void(const value_type&)> __bl)
+        template <typename _Function>
+        void for_each(_Function __bl)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            for (const auto& v : __internal_list_)
+            std::shared_lock<mutex_type> lock(__mutex_);
+            for (const auto& v : *__internal_list_)
             {
                 __bl(v);
             }
@@ -261,8 +381,41 @@ namespace std
         template <typename _Compare>
         void sort(_Compare __comp)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_list_.sort(__comp);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_list_->sort(__comp);
+        }
+        
+        // Stable, like sort(). The list's iterators are merge sorted on
+        // threadsafe_thread_pool::instance() and the nodes are then spliced
+        // into that order, so no element is copied or moved.
+        template <typename _Compare = std::less<value_type>>
+        void parallel_sort(_Compare __comp = _Compare())
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            
+            std::vector<iterator> order;
+            order.reserve(__internal_list_->size());
+            for (iterator it = __internal_list_->begin(); it != __internal_list_->end(); ++it)
+            {
+                order.push_back(it);
+            }
+            
+            auto less = [&__comp](const iterator& __a, const iterator& __b) { return __comp(*__a, *__b); };
+            __parallel_merge_sort(order.data(), order.data() + order.size(), less, true);
+            
+            for (const auto& it : order)
+            {
+                __internal_list_->splice(__internal_list_->end(), *__internal_list_, it);
+            }
         }
     };
+    
+    
+    namespace pmr
+    {
+        template <typename _Tp, typename _Mutex = shared_timed_mutex>
+        using threadsafe_list = std::threadsafe_list<_Tp, polymorphic_allocator<_Tp>, _Mutex>;
+    }
 }
@@ -10,17 +10,27 @@
 
 #include <map>
 #include <mutex>
+#include <atomic>
+#include <vector>
 #include <memory>
 #include <utility>
+#include <iterator>
+#include <optional>
 #include <functional>
 #include <shared_mutex>
+#include <memory_resource>
+#include "threadsafe_mutex.hpp"
+#include "threadsafe_parallel.hpp"
+#include "threadsafe_read_view.hpp"
+#include "threadsafe_skiplist.hpp"
 
 namespace std
 {
     template <
               typename _Key, typename _Tp,
               typename _Compare = less<_Key>,
-              typename _Allocator = allocator<pair<const _Key, _Tp>>
+              typename _Allocator = allocator<pair<const _Key, _Tp>>,
+              typename _Mutex = shared_timed_mutex
              >
     class threadsafe_map
     {
@@ -30,14 +40,15 @@ namespace std
         typedef pair<const key_type, mapped_type>        value_type;
         typedef _Compare                                 key_compare;
         typedef _Allocator                               allocator_type;
+        typedef _Mutex                                   mutex_type;
         typedef value_type&                              reference;
         typedef const value_type&                        const_reference;
 
     private:
         typedef std::map<key_type, mapped_type, key_compare, allocator_type> __map_type;
     
-        mutable std::shared_timed_mutex __mutex_;
-        __map_type __internal_map_;
+        mutable _Mutex __mutex_;
+        shared_ptr<__map_type> __internal_map_;
     
     public:
         typedef          __map_type                         map_type;
@@ -51,105 +62,311 @@ namespace std
         typedef typename __map_type::const_reverse_iterator const_reverse_iterator;
     
     public:
-        threadsafe_map() : __internal_map_() {}
-        threadsafe_map(const map_type& __m) : __internal_map_(__m) {}
-        threadsafe_map(map_type&& __m) : __internal_map_(std::move(__m)) {}
-        threadsafe_map(initializer_list<value_type> __il) : __internal_map_(__il) {}
+        threadsafe_map() : __internal_map_(std::make_shared<__map_type>()) {}
+        explicit threadsafe_map(const allocator_type& __a) : __internal_map_(std::make_shared<__map_type>(__a)) {}
+        threadsafe_map(const map_type& __m) : __internal_map_(std::make_shared<__map_type>(__m)) {}
+        threadsafe_map(map_type&& __m) : __internal_map_(std::make_shared<__map_type>(std::move(__m))) {}
+        threadsafe_map(initializer_list<value_type> __il) : __internal_map_(std::make_shared<__map_type>(__il)) {}
     
         template <class _InputIterator>
-        threadsafe_map(_InputIterator __f, _InputIterator __l) : __internal_map_(__f, __l) {}
+        threadsafe_map(_InputIterator __f, _InputIterator __l) : __internal_map_(std::make_shared<__map_type>(__f, __l)) {}
     
         threadsafe_map(const threadsafe_map&) = delete;
         threadsafe_map& operator=(const threadsafe_map&) = delete;
         threadsafe_map(threadsafe_map&&) = delete;
         threadsafe_map& operator=(threadsafe_map&&) = delete;
     
+    private:
+        // Called under the unique lock before every write. The map is copied
+        // only if a snapshot still refers to it.
+        void __detach(bool __copy = true)
+        {
+            if (__internal_map_.use_count() > 1)
+            {
+                __internal_map_ = __copy ? std::make_shared<__map_type>(*__internal_map_, __internal_map_->get_allocator())
+                                         : std::make_shared<__map_type>(__internal_map_->get_allocator());
+            }
+            else
+            {
+                atomic_thread_fence(memory_order_acquire);
+            }
+        }
+        
+        template <class _Op>
+        auto __parallel(_Op __op)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            const __map_type& c = *__internal_map_;
+            
+            // A tree cannot be split without walking it, so the key ranges are
+            // found with one sequential pass over the elements.
+            size_t pieces = __parallel_pieces(c.size());
+            std::vector<typename __map_type::const_iterator> bounds;
+            bounds.reserve(pieces + 1);
+            auto it = c.begin();
+            for (size_t i = 0; i < pieces; ++i)
+            {
+                bounds.push_back(it);
+                std::advance(it, c.size() * (i + 1) / pieces - c.size() * i / pieces);
+            }
+            bounds.push_back(c.end());
+            
+            auto visit = [&bounds](size_t __f, size_t __l, auto& __bl)
+            {
+                for (auto it = bounds[__f]; it != bounds[__l]; ++it)
+                {
+                    __bl(*it);
+                }
+            };
+            return __op(pieces, pieces, visit);
+        }
+        
     public:
+        allocator_type get_allocator() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_map_->get_allocator();
+        }
+        
         bool empty() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_map_.empty();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_map_->empty();
         }
     
         size_type size() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_map_.size();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_map_->size();
         }
         
         size_type max_size() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_map_.max_size();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_map_->max_size();
         }
         
         void operator=(const map_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_map_ = __v;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            *__internal_map_ = __v;
         }
         
-        void operator=(initializer_list<map_type> __il)
+        void operator=(initializer_list<value_type> __il)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_map_ = __il;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            *__internal_map_ = __il;
         }
         
         map_type value()
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return *__internal_map_;
+        }
+        
+        std::shared_ptr<const map_type> snapshot() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
             return __internal_map_;
         }
         
+        threadsafe_read_view<map_type, mutex_type> read() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return threadsafe_read_view<map_type, mutex_type>(std::move(lock), __internal_map_.get());
+        }
+        
+        threadsafe_read_view<mapped_type, mutex_type> read(const key_type& __k) const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            auto it = __internal_map_->find(__k);
+            const mapped_type* p = it == __internal_map_->end() ? nullptr : &it->second;
+            return threadsafe_read_view<mapped_type, mutex_type>(std::move(lock), p);
+        }
+        
         template <class... _Args>
         bool emplace(_Args&&... __args)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_map_.emplace(std::forward<_Args>(__args)...).second;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_map_->emplace(std::forward<_Args>(__args)...).second;
         }
     
         bool insert(const value_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_map_.insert(__v).second;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_map_->insert(__v).second;
+        }
+        
+        bool insert(value_type&& __v)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_map_->insert(std::move(__v)).second;
         }
     
         void insert(initializer_list<value_type> __il)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_map_.insert(__il);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_map_->insert(__il);
         }
         
         template <class _InputIterator>
         void insert(_InputIterator __f, _InputIterator __l)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_map_.insert(__f, __l);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_map_->insert(__f, __l);
         }
     
+        // The returned reference is unprotected once the call returns; read(k)
+        // keeps the lock held while the value is in use.
         const mapped_type& operator[](const key_type& __k)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_map_[__k];
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return (*__internal_map_)[__k];
         }
     
         const mapped_type& at(const key_type& __k)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_map_.at(__k);
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_map_->at(__k);
         }
         
         void set(const key_type& __k, const mapped_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_map_[__k] = __v;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            (*__internal_map_)[__k] = __v;
+        }
+        
+        void set(const key_type& __k, mapped_type&& __v)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            (*__internal_map_)[__k] = std::move(__v);
+        }
+        
+        template <class... _Args>
+        bool try_emplace(const key_type& __k, _Args&&... __args)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_map_->try_emplace(__k, std::forward<_Args>(__args)...).second;
+        }
+        
+        template <class... _Args>
+        bool try_emplace(key_type&& __k, _Args&&... __args)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_map_->try_emplace(std::move(__k), std::forward<_Args>(__args)...).second;
+        }
+        
+        template <class _Vp>
+        bool insert_or_assign(const key_type& __k, _Vp&& __v)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_map_->insert_or_assign(__k, std::forward<_Vp>(__v)).second;
+        }
+        
+        template <class _Vp>
+        bool insert_or_assign(key_type&& __k, _Vp&& __v)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_map_->insert_or_assign(std::move(__k), std::forward<_Vp>(__v)).second;
         }
     
+        // Read-modify-write helpers: the callable runs on the stored value in
+        // place under one exclusive lock. Each returns whether the key was found
+        // (update, compute_if_present) or inserted (the others).
+        template <class _Function>
+        bool update(const key_type& __k, _Function __fn)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            auto it = __internal_map_->find(__k);
+            if (it == __internal_map_->end())
+            {
+                return false;
+            }
+            
+            __fn(it->second);
+            return true;
+        }
+        
+        // __fn returns false to erase the entry.
+        template <class _Function>
+        bool compute_if_present(const key_type& __k, _Function __fn)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            auto it = __internal_map_->find(__k);
+            if (it == __internal_map_->end())
+            {
+                return false;
+            }
+            
+            if (!__fn(it->second))
+            {
+                __internal_map_->erase(it);
+            }
+            return true;
+        }
+        
+        // __factory is only called when the key is missing.
+        template <class _Factory>
+        bool compute_if_absent(const key_type& __k, _Factory __factory)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            auto it = __internal_map_->lower_bound(__k);
+            if (it != __internal_map_->end() && !__internal_map_->key_comp()(__k, it->first))
+            {
+                return false;
+            }
+            
+            __internal_map_->emplace_hint(it, __k, __factory());
+            return true;
+        }
+        
+        // Inserts __v, or folds it into the stored value with __combiner(stored, __v).
+        template <class _Vp, class _Combiner>
+        bool merge(const key_type& __k, _Vp&& __v, _Combiner __combiner)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            auto r = __internal_map_->try_emplace(__k, std::forward<_Vp>(__v));
+            if (!r.second)
+            {
+                __combiner(r.first->second, std::forward<_Vp>(__v));
+            }
+            return r.second;
+        }
+        
+        // Runs __fn on the stored value, default-constructing it first if needed.
+        template <class _Function>
+        bool upsert(const key_type& __k, _Function __fn)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            auto r = __internal_map_->try_emplace(__k);
+            __fn(r.first->second);
+            return r.second;
+        }
+        
         const std::pair<const mapped_type, bool> get(const key_type& __k)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            auto it = __internal_map_.find(__k);
-            if (it == __internal_map_.end())
+            std::shared_lock<mutex_type> lock(__mutex_);
+            auto it = __internal_map_->find(__k);
+            if (it == __internal_map_->end())
             {
                 return std::make_pair(mapped_type(), false);
             }
@@ -161,38 +378,168 @@ namespace std
     
         void clear()
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_map_.clear();
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            __internal_map_->clear();
         }
     
         bool contains(const key_type& __k)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            auto it = __internal_map_.find(__k);
-            return it != __internal_map_.end();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            auto it = __internal_map_->find(__k);
+            return it != __internal_map_->end();
         }
     
         size_type erase(const key_type& __k)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_map_.erase(__k);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_map_->erase(__k);
         }
     
-        void for_each(std::function<void(const value_type&)> __bl)
+        template <typename _Function>
+        void for_each(_Function __bl)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            for (const auto& v : __internal_map_)
+            std::shared_lock<mutex_type> lock(__mutex_);
+            for (const auto& v : *__internal_map_)
             {
                 __bl(v);
             }
         }
+        
+        // Chunked traversal that releases the lock between calls:
+        //
+        //     scan_cursor c;
+        //     while (!c.done()) m.scan(c, 1024, fn);
+        //
+        // Each call visits up to __count elements and resumes after the last
+        // key it visited, so every element present for the whole scan is seen
+        // exactly once, whatever is inserted or erased in between.
+        class scan_cursor
+        {
+            friend class threadsafe_map;
+            
+            std::optional<key_type> __last_;
+            bool __done_ = false;
+            
+        public:
+            bool done() const { return __done_; }
+        };
+        
+        template <typename _Function>
+        size_type scan(scan_cursor& __c, size_type __count, _Function __bl)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            if (__c.__done_)
+            {
+                return 0;
+            }
+            
+            auto it = __c.__last_ ? __internal_map_->upper_bound(*__c.__last_) : __internal_map_->begin();
+            size_type n = 0;
+            for (; n < __count && it != __internal_map_->end(); ++it, ++n)
+            {
+                __bl(*it);
+            }
+            
+            if (n > 0)
+            {
+                __c.__last_.emplace(std::prev(it)->first);
+            }
+            __c.__done_ = it == __internal_map_->end();
+            return n;
+        }
+        
+        // Pieces are contiguous key ranges; see threadsafe_vector::parallel_for_each.
+        template <typename _Function>
+        void parallel_for_each(_Function __bl)
+        {
+            __parallel([&](size_t __units, size_t __pieces, auto& __visit) { __parallel_for_each(__units, __pieces, __visit, __bl); });
+        }
+        
+        template <typename _Result, typename _Accumulate, typename _Combine>
+        _Result parallel_reduce(_Result __identity, _Accumulate __acc, _Combine __comb)
+        {
+            return __parallel([&](size_t __units, size_t __pieces, auto& __visit) { return __parallel_reduce(__units, __pieces, __visit, std::move(__identity), __acc, __comb); });
+        }
+        
+        template <typename _Predicate>
+        size_type parallel_count_if(_Predicate __pred)
+        {
+            return __parallel([&](size_t __units, size_t __pieces, auto& __visit) { return __parallel_count_if(__units, __pieces, __visit, __pred); });
+        }
+        
+        // Visits the elements with keys in [__lo, __hi) in ascending order.
+        template <typename _Function>
+        void for_each_range(const key_type& __lo, const key_type& __hi, _Function __bl)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            auto comp = __internal_map_->key_comp();
+            for (auto it = __internal_map_->lower_bound(__lo); it != __internal_map_->end() && comp(it->first, __hi); ++it)
+            {
+                __bl(*it);
+            }
+        }
+        
+        // Same range as for_each_range, in descending order.
+        template <typename _Function>
+        void reverse_for_each_range(const key_type& __lo, const key_type& __hi, _Function __bl)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            if (!__internal_map_->key_comp()(__lo, __hi))
+            {
+                return;
+            }
+            
+            auto first = __internal_map_->lower_bound(__lo);
+            for (auto it = __internal_map_->lower_bound(__hi); it != first;)
+            {
+                __bl(*--it);
+            }
+        }
+        
+        std::pair<value_type, bool> lower_bound(const key_type& __k)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            auto it = __internal_map_->lower_bound(__k);
+            if (it == __internal_map_->end())
+            {
+                return std::make_pair(value_type(), false);
+            }
+            return std::make_pair(*it, true);
+        }
+        
+        std::pair<value_type, bool> upper_bound(const key_type& __k)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            auto it = __internal_map_->upper_bound(__k);
+            if (it == __internal_map_->end())
+            {
+                return std::make_pair(value_type(), false);
+            }
+            return std::make_pair(*it, true);
+        }
+        
+        // Copies the __n smallest elements to __out; returns how many there were.
+        template <class _OutputIterator>
+        size_type first_n(_OutputIterator __out, size_type __n)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            size_type i = 0;
+            for (auto it = __internal_map_->begin(); i < __n && it != __internal_map_->end(); ++it, ++i)
+            {
+                *__out++ = *it;
+            }
+            return i;
+        }
     };
     
     
     template <
               typename _Key, typename _Tp,
               typename _Compare = less<_Key>,
-              typename _Allocator = allocator<pair<const _Key, _Tp>>
+              typename _Allocator = allocator<pair<const _Key, _Tp>>,
+              typename _Mutex = shared_timed_mutex
              >
     class threadsafe_multimap
     {
@@ -202,14 +549,15 @@ namespace std
         typedef pair<const key_type, mapped_type>        value_type;
         typedef _Compare                                 key_compare;
         typedef _Allocator                               allocator_type;
+        typedef _Mutex                                   mutex_type;
         typedef value_type&                              reference;
         typedef const value_type&                        const_reference;
     
     private:
         typedef std::multimap<key_type, mapped_type, key_compare, allocator_type> __map_type;
     
-        mutable std::shared_timed_mutex __mutex_;
-        __map_type __internal_map_;
+        mutable _Mutex __mutex_;
+        shared_ptr<__map_type> __internal_map_;
     
     public:
         typedef          __map_type                         map_type;
@@ -223,87 +571,160 @@ namespace std
         typedef typename __map_type::const_reverse_iterator const_reverse_iterator;
         
     public:
-        threadsafe_multimap() : __internal_map_() {}
-        threadsafe_multimap(const map_type& __m) : __internal_map_(__m) {}
-        threadsafe_multimap(map_type&& __m) : __internal_map_(std::move(__m)) {}
-        threadsafe_multimap(initializer_list<value_type> __il) : __internal_map_(__il) {}
+        threadsafe_multimap() : __internal_map_(std::make_shared<__map_type>()) {}
+        explicit threadsafe_multimap(const allocator_type& __a) : __internal_map_(std::make_shared<__map_type>(__a)) {}
+        threadsafe_multimap(const map_type& __m) : __internal_map_(std::make_shared<__map_type>(__m)) {}
+        threadsafe_multimap(map_type&& __m) : __internal_map_(std::make_shared<__map_type>(std::move(__m))) {}
+        threadsafe_multimap(initializer_list<value_type> __il) : __internal_map_(std::make_shared<__map_type>(__il)) {}
         
         template <class _InputIterator>
-        threadsafe_multimap(_InputIterator __f, _InputIterator __l) : __internal_map_(__f, __l) {}
+        threadsafe_multimap(_InputIterator __f, _InputIterator __l) : __internal_map_(std::make_shared<__map_type>(__f, __l)) {}
         
         threadsafe_multimap(const threadsafe_multimap&) = delete;
         threadsafe_multimap& operator=(const threadsafe_multimap&) = delete;
         threadsafe_multimap(threadsafe_multimap&&) = delete;
         threadsafe_multimap& operator=(threadsafe_multimap&&) = delete;
     
+    private:
+        void __detach(bool __copy = true)
+        {
+            if (__internal_map_.use_count() > 1)
+            {
+                __internal_map_ = __copy ? std::make_shared<__map_type>(*__internal_map_, __internal_map_->get_allocator())
+                                         : std::make_shared<__map_type>(__internal_map_->get_allocator());
+            }
+            else
+            {
+                atomic_thread_fence(memory_order_acquire);
+            }
+        }
+        
+        template <class _Op>
+        auto __parallel(_Op __op)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            const __map_type& c = *__internal_map_;
+            
+            size_t pieces = __parallel_pieces(c.size());
+            std::vector<typename __map_type::const_iterator> bounds;
+            bounds.reserve(pieces + 1);
+            auto it = c.begin();
+            for (size_t i = 0; i < pieces; ++i)
+            {
+                bounds.push_back(it);
+                std::advance(it, c.size() * (i + 1) / pieces - c.size() * i / pieces);
+            }
+            bounds.push_back(c.end());
+            
+            auto visit = [&bounds](size_t __f, size_t __l, auto& __bl)
+            {
+                for (auto it = bounds[__f]; it != bounds[__l]; ++it)
+                {
+                    __bl(*it);
+                }
+            };
+            return __op(pieces, pieces, visit);
+        }
+        
     public:
+        allocator_type get_allocator() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_map_->get_allocator();
+        }
+        
         bool empty() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_map_.empty();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_map_->empty();
         }
         
         size_type size() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_map_.size();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_map_->size();
         }
         
         size_type max_size() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_map_.max_size();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_map_->max_size();
         }
         
         void operator=(const map_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_map_ = __v;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            *__internal_map_ = __v;
         }
         
-        void operator=(initializer_list<map_type> __il)
+        void operator=(initializer_list<value_type> __il)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_map_ = __il;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            *__internal_map_ = __il;
         }
         
         map_type value()
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return *__internal_map_;
+        }
+        
+        std::shared_ptr<const map_type> snapshot() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
             return __internal_map_;
         }
         
+        threadsafe_read_view<map_type, mutex_type> read() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return threadsafe_read_view<map_type, mutex_type>(std::move(lock), __internal_map_.get());
+        }
+        
         template <class... _Args>
         void emplace(_Args&&... __args)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_map_.emplace(std::forward<_Args>(__args)...);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_map_->emplace(std::forward<_Args>(__args)...);
         }
         
         void insert(const value_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_map_.insert(__v);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_map_->insert(__v);
+        }
+        
+        void insert(value_type&& __v)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_map_->insert(std::move(__v));
         }
     
         void insert(initializer_list<value_type> __il)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_map_.insert(__il);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_map_->insert(__il);
         }
         
         template <class _InputIterator>
         void insert(_InputIterator __f, _InputIterator __l)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_map_.insert(__f, __l);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_map_->insert(__f, __l);
         }
         
         const std::pair<const mapped_type, bool> get(const key_type& __k)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            auto it = __internal_map_.find(__k);
-            if (it == __internal_map_.end())
+            std::shared_lock<mutex_type> lock(__mutex_);
+            auto it = __internal_map_->find(__k);
+            if (it == __internal_map_->end())
             {
                 return std::make_pair(mapped_type(), false);
             }
@@ -315,37 +736,275 @@ namespace std
         
         void clear()
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_map_.clear();
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            __internal_map_->clear();
         }
         
         bool contains(const key_type& __k)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            auto it = __internal_map_.find(__k);
-            return it != __internal_map_.end();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            auto it = __internal_map_->find(__k);
+            return it != __internal_map_->end();
         }
         
         size_type erase(const key_type& __k)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_map_.erase(__k);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_map_->erase(__k);
         }
     
-        void for_each(std::function<void(const value_type&)> __bl)
+        template <typename _Function>
+        void for_each(_Function __bl)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            for (const auto& v : __internal_map_)
+            std::shared_lock<mutex_type> lock(__mutex_);
+            for (const auto& v : *__internal_map_)
             {
                 __bl(v);
             }
         }
+        
+        // See threadsafe_vector::parallel_for_each.
+        template <typename _Function>
+        void parallel_for_each(_Function __bl)
+        {
+            __parallel([&](size_t __units, size_t __pieces, auto& __visit) { __parallel_for_each(__units, __pieces, __visit, __bl); });
+        }
+        
+        template <typename _Result, typename _Accumulate, typename _Combine>
+        _Result parallel_reduce(_Result __identity, _Accumulate __acc, _Combine __comb)
+        {
+            return __parallel([&](size_t __units, size_t __pieces, auto& __visit) { return __parallel_reduce(__units, __pieces, __visit, std::move(__identity), __acc, __comb); });
+        }
+        
+        template <typename _Predicate>
+        size_type parallel_count_if(_Predicate __pred)
+        {
+            return __parallel([&](size_t __units, size_t __pieces, auto& __visit) { return __parallel_count_if(__units, __pieces, __visit, __pred); });
+        }
     
-        void for_each(const key_type& __k, std::function<void(const std::pair<iterator, iterator>&)> __bl)
+        template <typename _Function>
+        void for_each(const key_type& __k, _Function __bl)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            std::pair<iterator, iterator> r = __internal_map_.equal_range(__k);
+            std::shared_lock<mutex_type> lock(__mutex_);
+            std::pair<iterator, iterator> r = __internal_map_->equal_range(__k);
             __bl(r);
         }
     };
+    
+    
+    // Ordered map for write-heavy concurrent use, backed by a lazy skip list:
+    // get, contains, lower_bound and the traversals take no locks, and
+    // writers only lock the handful of nodes around the key they change. The
+    // traversals are weakly consistent: they see every element that is present
+    // for their whole duration and may or may not see concurrent changes.
+    // for_each passes a pair of const references to the element. Elements are
+    // never handed out by reference otherwise, because a concurrent writer may
+    // replace or remove them at any time. The allocator has to be stateless.
+    template <
+              typename _Key, typename _Tp,
+              typename _Compare = less<_Key>,
+              typename _Allocator = allocator<pair<const _Key, _Tp>>
+             >
+    class threadsafe_skiplist_map
+    {
+    public:
+        typedef _Key                                     key_type;
+        typedef _Tp                                      mapped_type;
+        typedef pair<const key_type, mapped_type>        value_type;
+        typedef _Compare                                 key_compare;
+        typedef _Allocator                               allocator_type;
+        typedef value_type&                              reference;
+        typedef const value_type&                        const_reference;
+        typedef size_t                                   size_type;
+        typedef std::map<key_type, mapped_type, key_compare, allocator_type> map_type;
+        
+    private:
+        typedef __skiplist<key_type, mapped_type, key_compare, allocator_type> __list_type;
+        typedef typename __list_type::__node                                  __node;
+        
+        __list_type __list_;
+        
+    public:
+        threadsafe_skiplist_map() : __list_() {}
+        threadsafe_skiplist_map(const map_type& __m) : __list_() { insert(__m.begin(), __m.end()); }
+        threadsafe_skiplist_map(initializer_list<value_type> __il) : __list_() { insert(__il.begin(), __il.end()); }
+        
+        template <class _InputIterator>
+        threadsafe_skiplist_map(_InputIterator __f, _InputIterator __l) : __list_() { insert(__f, __l); }
+        
+        threadsafe_skiplist_map(const threadsafe_skiplist_map&) = delete;
+        threadsafe_skiplist_map& operator=(const threadsafe_skiplist_map&) = delete;
+        threadsafe_skiplist_map(threadsafe_skiplist_map&&) = delete;
+        threadsafe_skiplist_map& operator=(threadsafe_skiplist_map&&) = delete;
+        
+    private:
+        static std::pair<value_type, bool> __copy(__node* __n)
+        {
+            if (!__n)
+            {
+                return std::make_pair(value_type(), false);
+            }
+            return std::make_pair(value_type(__n->__key_, __list_type::__value(__n)), true);
+        }
+        
+    public:
+        bool empty() const
+        {
+            return __list_.size() == 0;
+        }
+        
+        size_type size() const
+        {
+            return __list_.size();
+        }
+        
+        map_type value()
+        {
+            map_type r;
+            for_each([&r](const auto& __v) { r.emplace_hint(r.end(), __v.first, __v.second); });
+            return r;
+        }
+        
+        template <class... _Args>
+        bool emplace(_Args&&... __args)
+        {
+            value_type v(std::forward<_Args>(__args)...);
+            return __list_.try_emplace(v.first, std::move(v.second));
+        }
+        
+        bool insert(const value_type& __v)
+        {
+            return __list_.try_emplace(__v.first, __v.second);
+        }
+        
+        bool insert(value_type&& __v)
+        {
+            return __list_.try_emplace(__v.first, std::move(__v.second));
+        }
+        
+        void insert(initializer_list<value_type> __il)
+        {
+            insert(__il.begin(), __il.end());
+        }
+        
+        template <class _InputIterator>
+        void insert(_InputIterator __f, _InputIterator __l)
+        {
+            for (; __f != __l; ++__f)
+            {
+                insert(*__f);
+            }
+        }
+        
+        void set(const key_type& __k, const mapped_type& __v)
+        {
+            __list_.insert_or_assign(__k, __v);
+        }
+        
+        void set(const key_type& __k, mapped_type&& __v)
+        {
+            __list_.insert_or_assign(__k, std::move(__v));
+        }
+        
+        template <class... _Args>
+        bool try_emplace(const key_type& __k, _Args&&... __args)
+        {
+            return __list_.try_emplace(__k, std::forward<_Args>(__args)...);
+        }
+        
+        template <class... _Args>
+        bool try_emplace(key_type&& __k, _Args&&... __args)
+        {
+            return __list_.try_emplace(std::move(__k), std::forward<_Args>(__args)...);
+        }
+        
+        template <class _Vp>
+        bool insert_or_assign(const key_type& __k, _Vp&& __v)
+        {
+            return __list_.insert_or_assign(__k, std::forward<_Vp>(__v));
+        }
+        
+        template <class _Vp>
+        bool insert_or_assign(key_type&& __k, _Vp&& __v)
+        {
+            return __list_.insert_or_assign(std::move(__k), std::forward<_Vp>(__v));
+        }
+        
+        const std::pair<const mapped_type, bool> get(const key_type& __k)
+        {
+            __epoch_guard guard;
+            __node* n = __list_.__find_live(__k);
+            if (!n)
+            {
+                return std::make_pair(mapped_type(), false);
+            }
+            return std::make_pair(__list_type::__value(n), true);
+        }
+        
+        bool contains(const key_type& __k)
+        {
+            __epoch_guard guard;
+            return __list_.__find_live(__k) != nullptr;
+        }
+        
+        size_type erase(const key_type& __k)
+        {
+            return __list_.erase(__k) ? 1 : 0;
+        }
+        
+        // Removes the elements one by one; concurrent inserts may survive.
+        void clear()
+        {
+            __epoch_guard guard;
+            for (__node* n = __list_.__first(); n; n = __list_type::__succ(n))
+            {
+                __list_.erase(n->__key_);
+            }
+        }
+        
+        std::pair<value_type, bool> lower_bound(const key_type& __k)
+        {
+            __epoch_guard guard;
+            return __copy(__list_.__lower_bound(__k, false));
+        }
+        
+        std::pair<value_type, bool> upper_bound(const key_type& __k)
+        {
+            __epoch_guard guard;
+            return __copy(__list_.__lower_bound(__k, true));
+        }
+        
+        template <typename _Function>
+        void for_each(_Function __bl)
+        {
+            __epoch_guard guard;
+            for (__node* n = __list_.__first(); n; n = __list_type::__succ(n))
+            {
+                __bl(std::pair<const key_type&, const mapped_type&>(n->__key_, __list_type::__value(n)));
+            }
+        }
+        
+        // Visits the keys in [__lo, __hi) in order.
+        template <typename _Function>
+        void for_each_range(const key_type& __lo, const key_type& __hi, _Function __bl)
+        {
+            __epoch_guard guard;
+            for (__node* n = __list_.__lower_bound(__lo, false); n && __list_.__less(n->__key_, __hi); n = __list_type::__succ(n))
+            {
+                __bl(std::pair<const key_type&, const mapped_type&>(n->__key_, __list_type::__value(n)));
+            }
+        }
+    };
+    
+    
+    namespace pmr
+    {
+        template <typename _Key, typename _Tp, typename _Compare = less<_Key>, typename _Mutex = shared_timed_mutex>
+        using threadsafe_map = std::threadsafe_map<_Key, _Tp, _Compare, polymorphic_allocator<pair<const _Key, _Tp>>, _Mutex>;
+
+        template <typename _Key, typename _Tp, typename _Compare = less<_Key>, typename _Mutex = shared_timed_mutex>
+        using threadsafe_multimap = std::threadsafe_multimap<_Key, _Tp, _Compare, polymorphic_allocator<pair<const _Key, _Tp>>, _Mutex>;
+    }
 }
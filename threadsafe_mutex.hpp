@@ -0,0 +1,129 @@
+//
+//  threadsafe_mutex.hpp
+//  stl_extension
+//
+//  Created by Kingle Zhuang on 11/20/19.
+//  Copyright © 2019 RingCentral. All rights reserved.
+//
+
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+
+namespace std
+{
+    // Spin-wait hint for busy loops.
+    inline void __threadsafe_relax()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+        __asm__ __volatile__("yield");
+#endif
+    }
+    
+    
+    // Lock policies for the _Mutex parameter of the threadsafe_* containers.
+    // The containers take std::shared_lock for readers and std::unique_lock for
+    // writers, so a policy has to provide both the exclusive and the shared
+    // lock functions. The policies below have no reader/writer distinction and
+    // map the shared functions onto the exclusive ones; std::shared_timed_mutex
+    // (the default) and std::shared_mutex can be used as they are.
+    
+    class threadsafe_exclusive_mutex
+    {
+    private:
+        std::mutex __mutex_;
+        
+    public:
+        threadsafe_exclusive_mutex() = default;
+        threadsafe_exclusive_mutex(const threadsafe_exclusive_mutex&) = delete;
+        threadsafe_exclusive_mutex& operator=(const threadsafe_exclusive_mutex&) = delete;
+        
+    public:
+        void lock() { __mutex_.lock(); }
+        bool try_lock() { return __mutex_.try_lock(); }
+        void unlock() { __mutex_.unlock(); }
+        
+        void lock_shared() { __mutex_.lock(); }
+        bool try_lock_shared() { return __mutex_.try_lock(); }
+        void unlock_shared() { __mutex_.unlock(); }
+    };
+    
+    
+    // Test-and-test-and-set spinlock. Waiters spin on a plain load so the cache
+    // line stays shared until the owner releases it, backing off exponentially
+    // and yielding the CPU once the backoff is exhausted.
+    class threadsafe_spin_mutex
+    {
+    private:
+        static constexpr unsigned __max_backoff = 1024;
+        
+        atomic<bool> __locked_;
+        
+    public:
+        threadsafe_spin_mutex() noexcept : __locked_(false) {}
+        threadsafe_spin_mutex(const threadsafe_spin_mutex&) = delete;
+        threadsafe_spin_mutex& operator=(const threadsafe_spin_mutex&) = delete;
+        
+    public:
+        void lock()
+        {
+            unsigned backoff = 1;
+            while (__locked_.exchange(true, memory_order_acquire))
+            {
+                while (__locked_.load(memory_order_relaxed))
+                {
+                    if (backoff < __max_backoff)
+                    {
+                        for (unsigned i = 0; i < backoff; ++i)
+                        {
+                            __threadsafe_relax();
+                        }
+                        backoff <<= 1;
+                    }
+                    else
+                    {
+                        this_thread::yield();
+                    }
+                }
+            }
+        }
+        
+        bool try_lock()
+        {
+            return !__locked_.load(memory_order_relaxed) && !__locked_.exchange(true, memory_order_acquire);
+        }
+        
+        void unlock()
+        {
+            __locked_.store(false, memory_order_release);
+        }
+        
+        void lock_shared() { lock(); }
+        bool try_lock_shared() { return try_lock(); }
+        void unlock_shared() { unlock(); }
+    };
+    
+    
+    // For instances that are confined to a single thread: every lock operation
+    // compiles away.
+    class threadsafe_null_mutex
+    {
+    public:
+        threadsafe_null_mutex() = default;
+        threadsafe_null_mutex(const threadsafe_null_mutex&) = delete;
+        threadsafe_null_mutex& operator=(const threadsafe_null_mutex&) = delete;
+        
+    public:
+        void lock() {}
+        bool try_lock() { return true; }
+        void unlock() {}
+        
+        void lock_shared() {}
+        bool try_lock_shared() { return true; }
+        void unlock_shared() {}
+    };
+}
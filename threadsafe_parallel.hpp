@@ -0,0 +1,588 @@
+//
+//  threadsafe_parallel.hpp
+//  stl_extension
+//
+//  Created by Kingle Zhuang on 11/20/19.
+//  Copyright © 2019 RingCentral. All rights reserved.
+//
+
+#pragma once
+
+#include <array>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <iterator>
+#include <utility>
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <type_traits>
+#include <condition_variable>
+
+namespace std
+{
+    // Work-stealing thread pool behind the parallel_* members of the
+    // containers. Every worker owns a deque: it pushes and pops its own tasks
+    // at the back and, once that runs dry, steals from the front of the
+    // others. Tasks submitted from outside the pool are spread round-robin.
+    class threadsafe_thread_pool
+    {
+    public:
+        typedef function<void()> task_type;
+        
+    private:
+        struct alignas(64) __worker
+        {
+            mutex __mutex_;
+            deque<task_type> __tasks_;
+        };
+        
+        size_t __size_;
+        unique_ptr<__worker[]> __workers_;
+        vector<thread> __threads_;
+        
+        atomic<size_t> __next_;
+        atomic<size_t> __pending_;
+        
+        mutex __idle_mutex_;
+        condition_variable __idle_cv_;
+        bool __stop_;
+        
+        struct __current
+        {
+            const threadsafe_thread_pool* __pool_ = nullptr;
+            size_t __index_ = 0;
+        };
+        
+        static __current& __local()
+        {
+            static thread_local __current current;
+            return current;
+        }
+        
+        bool __pop(size_t __self, task_type& __task)
+        {
+            for (size_t i = 0; i < __size_; ++i)
+            {
+                __worker& w = __workers_[(__self + i) % __size_];
+                std::unique_lock<mutex> lock(w.__mutex_);
+                if (w.__tasks_.empty())
+                {
+                    continue;
+                }
+                
+                if (i == 0)
+                {
+                    __task = std::move(w.__tasks_.back());
+                    w.__tasks_.pop_back();
+                }
+                else
+                {
+                    __task = std::move(w.__tasks_.front());
+                    w.__tasks_.pop_front();
+                }
+                __pending_.fetch_sub(1, memory_order_relaxed);
+                return true;
+            }
+            return false;
+        }
+        
+        void __run(size_t __self)
+        {
+            __local().__pool_ = this;
+            __local().__index_ = __self;
+            
+            task_type task;
+            while (true)
+            {
+                if (__pop(__self, task))
+                {
+                    task();
+                    task = nullptr;
+                    continue;
+                }
+                
+                std::unique_lock<mutex> lock(__idle_mutex_);
+                __idle_cv_.wait(lock, [this] { return __stop_ || __pending_.load(memory_order_relaxed) > 0; });
+                if (__stop_ && __pending_.load(memory_order_relaxed) == 0)
+                {
+                    return;
+                }
+            }
+        }
+        
+    public:
+        explicit threadsafe_thread_pool(size_t __n = thread::hardware_concurrency()) : __size_(__n ? __n : 1), __workers_(new __worker[__size_]), __next_(0), __pending_(0), __stop_(false)
+        {
+            __threads_.reserve(__size_);
+            for (size_t i = 0; i < __size_; ++i)
+            {
+                __threads_.emplace_back(&threadsafe_thread_pool::__run, this, i);
+            }
+        }
+        
+        threadsafe_thread_pool(const threadsafe_thread_pool&) = delete;
+        threadsafe_thread_pool& operator=(const threadsafe_thread_pool&) = delete;
+        
+        // Runs the tasks that are still queued before joining the workers.
+        ~threadsafe_thread_pool()
+        {
+            {
+                std::unique_lock<mutex> lock(__idle_mutex_);
+                __stop_ = true;
+            }
+            __idle_cv_.notify_all();
+            
+            for (auto& t : __threads_)
+            {
+                t.join();
+            }
+        }
+        
+        static threadsafe_thread_pool& instance()
+        {
+            static threadsafe_thread_pool pool;
+            return pool;
+        }
+        
+    public:
+        size_t size() const
+        {
+            return __size_;
+        }
+        
+        void submit(task_type __task)
+        {
+            const __current& current = __local();
+            size_t index = current.__pool_ == this ? current.__index_ : __next_.fetch_add(1, memory_order_relaxed) % __size_;
+            
+            // Counted before it is queued, so a thief that runs it at once
+            // cannot take __pending_ below zero.
+            __pending_.fetch_add(1, memory_order_relaxed);
+            try
+            {
+                std::unique_lock<mutex> lock(__workers_[index].__mutex_);
+                __workers_[index].__tasks_.push_back(std::move(__task));
+            }
+            catch (...)
+            {
+                __pending_.fetch_sub(1, memory_order_relaxed);
+                throw;
+            }
+            
+            {
+                std::unique_lock<mutex> lock(__idle_mutex_);
+            }
+            __idle_cv_.notify_one();
+        }
+    };
+    
+    
+    // Calls __f(i) for every i in [0, __n) on the shared pool. The calling
+    // thread claims pieces as well and only returns once all of them are
+    // finished, so nested calls from inside a task cannot deadlock. The first
+    // exception thrown by __f is rethrown here; pieces not started by then
+    // are skipped.
+    template <class _Function>
+    void __parallel_invoke(size_t __n, _Function& __f)
+    {
+        if (__n <= 1)
+        {
+            if (__n == 1)
+            {
+                __f(size_t(0));
+            }
+            return;
+        }
+        
+        struct __state
+        {
+            atomic<size_t> __next_{0};
+            atomic<size_t> __done_{0};
+            atomic<bool> __failed_{false};
+            exception_ptr __error_;
+            mutex __mutex_;
+            condition_variable __cv_;
+        };
+        
+        auto state = make_shared<__state>();
+        _Function* f = &__f;
+        auto work = [state, f, __n]
+        {
+            size_t i;
+            while ((i = state->__next_.fetch_add(1, memory_order_relaxed)) < __n)
+            {
+                try
+                {
+                    if (!state->__failed_.load(memory_order_relaxed))
+                    {
+                        (*f)(i);
+                    }
+                }
+                catch (...)
+                {
+                    std::unique_lock<mutex> lock(state->__mutex_);
+                    if (!state->__error_)
+                    {
+                        state->__error_ = current_exception();
+                    }
+                    state->__failed_.store(true, memory_order_relaxed);
+                }
+                
+                if (state->__done_.fetch_add(1, memory_order_acq_rel) + 1 == __n)
+                {
+                    std::unique_lock<mutex> lock(state->__mutex_);
+                    state->__cv_.notify_all();
+                }
+            }
+        };
+        
+        threadsafe_thread_pool& pool = threadsafe_thread_pool::instance();
+        size_t helpers = std::min(pool.size(), __n - 1);
+        for (size_t i = 0; i < helpers; ++i)
+        {
+            pool.submit(work);
+        }
+        work();
+        
+        std::unique_lock<mutex> lock(state->__mutex_);
+        state->__cv_.wait(lock, [&] { return state->__done_.load(memory_order_acquire) == __n; });
+        if (state->__error_)
+        {
+            rethrow_exception(state->__error_);
+        }
+    }
+    
+    // Number of pieces to cut __n units of work into: enough for the pool to
+    // balance the load, but none smaller than __grain units.
+    inline size_t __parallel_pieces(size_t __n, size_t __grain = 2048)
+    {
+        size_t limit = 4 * (threadsafe_thread_pool::instance().size() + 1);
+        size_t pieces = (__n + __grain - 1) / __grain;
+        return pieces < limit ? pieces : limit;
+    }
+    
+    // The containers describe their layout as __units consecutive units
+    // (indices, buckets, precomputed key ranges) and provide
+    // __visit(first, last, fn), which calls fn on every element of the units
+    // [first, last). The helpers below cut the units into __pieces ranges.
+    template <class _Visit, class _Function>
+    void __parallel_for_each(size_t __units, size_t __pieces, _Visit& __visit, _Function& __bl)
+    {
+        auto piece = [&](size_t i)
+        {
+            __visit(__units * i / __pieces, __units * (i + 1) / __pieces, __bl);
+        };
+        __parallel_invoke(__pieces, piece);
+    }
+    
+    // Every piece folds its elements into a local copy of __identity with
+    // __acc and stores the result once, in a slot of its own cache line, so
+    // the pieces never write next to each other (and a bool result never
+    // ends up in a vector<bool>). The partial results are merged with __comb
+    // in container order.
+    template <class _Visit, class _Tp, class _Accumulate, class _Combine>
+    _Tp __parallel_reduce(size_t __units, size_t __pieces, _Visit& __visit, _Tp __identity, _Accumulate& __acc, _Combine& __comb)
+    {
+        struct alignas(64) alignas(_Tp) __partial
+        {
+            optional<_Tp> __value_;
+        };
+        
+        unique_ptr<__partial[]> partial(new __partial[__pieces]);
+        auto piece = [&](size_t i)
+        {
+            _Tp r = __identity;
+            auto fold = [&](const auto& v) { r = __acc(std::move(r), v); };
+            __visit(__units * i / __pieces, __units * (i + 1) / __pieces, fold);
+            partial[i].__value_.emplace(std::move(r));
+        };
+        __parallel_invoke(__pieces, piece);
+        
+        for (size_t i = 0; i < __pieces; ++i)
+        {
+            __identity = __comb(std::move(__identity), std::move(*partial[i].__value_));
+        }
+        return __identity;
+    }
+    
+    template <class _Visit, class _Predicate>
+    size_t __parallel_count_if(size_t __units, size_t __pieces, _Visit& __visit, _Predicate& __pred)
+    {
+        auto acc = [&](size_t n, const auto& v) { return __pred(v) ? n + 1 : n; };
+        auto comb = [](size_t a, size_t b) { return a + b; };
+        return __parallel_reduce(__units, __pieces, __visit, size_t(0), acc, comb);
+    }
+    
+    // Stable merge of the sorted runs [__f1, __l1) and [__f2, __l2) into __out,
+    // moving the elements. The longer run is cut at evenly spaced positions
+    // and the matching cut in the other run is found by binary search, which
+    // splits the merge into independent pieces.
+    template <class _Tp, class _Compare>
+    void __parallel_merge(_Tp* __f1, _Tp* __l1, _Tp* __f2, _Tp* __l2, _Tp* __out, _Compare& __comp)
+    {
+        size_t n1 = __l1 - __f1;
+        size_t n2 = __l2 - __f2;
+        size_t pieces = __parallel_pieces(n1 + n2);
+        
+        // The cuts are taken before any piece starts moving elements out.
+        vector<pair<_Tp*, _Tp*>> cuts(pieces + 1);
+        for (size_t j = 0; j <= pieces; ++j)
+        {
+            if (j == 0 || j == pieces)
+            {
+                cuts[j] = j ? make_pair(__l1, __l2) : make_pair(__f1, __f2);
+            }
+            else if (n1 >= n2)
+            {
+                _Tp* a = __f1 + n1 * j / pieces;
+                cuts[j] = make_pair(a, std::lower_bound(__f2, __l2, *a, __comp));
+            }
+            else
+            {
+                _Tp* b = __f2 + n2 * j / pieces;
+                cuts[j] = make_pair(std::upper_bound(__f1, __l1, *b, __comp), b);
+            }
+        }
+        
+        auto piece = [&](size_t i)
+        {
+            std::merge(make_move_iterator(cuts[i].first), make_move_iterator(cuts[i + 1].first),
+                       make_move_iterator(cuts[i].second), make_move_iterator(cuts[i + 1].second),
+                       __out + (cuts[i].first - __f1) + (cuts[i].second - __f2), __comp);
+        };
+        __parallel_invoke(pieces, piece);
+    }
+    
+    // Sorts evenly sized pieces concurrently, then merges them pairwise,
+    // going back and forth between the range and a buffer of the same size.
+    template <class _Tp, class _Compare>
+    void __parallel_merge_sort(_Tp* __f, _Tp* __l, _Compare& __comp, bool __stable)
+    {
+        size_t n = __l - __f;
+        size_t pieces = __parallel_pieces(n, 1 << 14);
+        if (pieces <= 1)
+        {
+            __stable ? std::stable_sort(__f, __l, __comp) : std::sort(__f, __l, __comp);
+            return;
+        }
+        
+        auto bound = [&](size_t i) { return n * (i < pieces ? i : pieces) / pieces; };
+        auto sort_piece = [&](size_t i)
+        {
+            __stable ? std::stable_sort(__f + bound(i), __f + bound(i + 1), __comp) : std::sort(__f + bound(i), __f + bound(i + 1), __comp);
+        };
+        __parallel_invoke(pieces, sort_piece);
+        
+        // The sorted pieces are moved into the buffer, which becomes the
+        // source of the first round; the moved-from range is only assigned to.
+        vector<_Tp> buffer(make_move_iterator(__f), make_move_iterator(__l));
+        _Tp* src = buffer.data();
+        _Tp* dst = __f;
+        for (size_t width = 1; width < pieces; width *= 2)
+        {
+            for (size_t i = 0; i < pieces; i += 2 * width)
+            {
+                __parallel_merge(src + bound(i), src + bound(i + width), src + bound(i + width), src + bound(i + 2 * width), dst + bound(i), __comp);
+            }
+            std::swap(src, dst);
+        }
+        
+        if (src != __f)
+        {
+            auto move_back = [&](size_t i) { std::move(src + bound(i), src + bound(i + 1), __f + bound(i)); };
+            __parallel_invoke(pieces, move_back);
+        }
+    }
+    
+    // remove_if. Arithmetic elements are compacted without a branch on the
+    // predicate: every element is written to the output position and the
+    // position only advances for the ones that are kept.
+    template <class _ForwardIterator, class _Predicate>
+    _ForwardIterator __compact(_ForwardIterator __f, _ForwardIterator __l, _Predicate& __pred, true_type)
+    {
+        _ForwardIterator out = __f;
+        for (; __f != __l; ++__f)
+        {
+            auto v = *__f;
+            *out = v;
+            std::advance(out, !__pred(v));
+        }
+        return out;
+    }
+    
+    template <class _ForwardIterator, class _Predicate>
+    _ForwardIterator __compact(_ForwardIterator __f, _ForwardIterator __l, _Predicate& __pred, false_type)
+    {
+        return std::remove_if(__f, __l, [&__pred](const auto& v) { return __pred(v); });
+    }
+    
+    template <class _ForwardIterator, class _Predicate>
+    _ForwardIterator __compact(_ForwardIterator __f, _ForwardIterator __l, _Predicate& __pred)
+    {
+        typedef typename iterator_traits<_ForwardIterator>::value_type _Tp;
+        return __compact(__f, __l, __pred, integral_constant<bool, is_arithmetic<_Tp>::value>());
+    }
+    
+    // Every piece is compacted in place concurrently, which is where the
+    // predicate runs; the surviving blocks are then moved down in order.
+    template <class _RandomAccessIterator, class _Predicate>
+    _RandomAccessIterator __parallel_remove_if(_RandomAccessIterator __f, _RandomAccessIterator __l, _Predicate& __pred)
+    {
+        size_t n = __l - __f;
+        size_t pieces = __parallel_pieces(n);
+        if (pieces <= 1)
+        {
+            return __compact(__f, __l, __pred);
+        }
+        
+        vector<_RandomAccessIterator> ends(pieces);
+        auto piece = [&](size_t i)
+        {
+            ends[i] = __compact(__f + n * i / pieces, __f + n * (i + 1) / pieces, __pred);
+        };
+        __parallel_invoke(pieces, piece);
+        
+        _RandomAccessIterator out = ends[0];
+        for (size_t i = 1; i < pieces; ++i)
+        {
+            out = std::move(__f + n * i / pieces, ends[i], out);
+        }
+        return out;
+    }
+    
+    template <class _Tp>
+    struct __is_radix_sortable : integral_constant<bool, (is_integral<_Tp>::value && !is_same<_Tp, bool>::value) ||
+                                                         is_same<_Tp, float>::value || is_same<_Tp, double>::value> {};
+    
+    // Maps a key onto an unsigned integer of the same width whose natural
+    // order matches the key's: the sign bit of signed integers is flipped,
+    // negative floats have all bits flipped and positive ones the sign bit.
+    // -0.0 is folded into +0.0 first; std::less treats the two as equal, and
+    // a stable sort must not reorder them.
+    template <class _Tp, bool = is_integral<_Tp>::value>
+    struct __radix_traits
+    {
+        typedef typename make_unsigned<_Tp>::type __key_type;
+        
+        static __key_type __key(_Tp __v)
+        {
+            return is_signed<_Tp>::value ? __key_type(__v) ^ (__key_type(1) << (sizeof(__key_type) * 8 - 1)) : __key_type(__v);
+        }
+    };
+    
+    template <class _Tp>
+    struct __radix_traits<_Tp, false>
+    {
+        typedef typename conditional<sizeof(_Tp) == 4, uint32_t, uint64_t>::type __key_type;
+        
+        static __key_type __key(_Tp __v)
+        {
+            __key_type u;
+            __v = __v == _Tp(0) ? _Tp(0) : __v;
+            std::memcpy(&u, &__v, sizeof(u));
+            return (u >> (sizeof(__key_type) * 8 - 1)) ? ~u : u | (__key_type(1) << (sizeof(__key_type) * 8 - 1));
+        }
+    };
+    
+    // Parallel LSD radix sort, one byte per pass. Each pass histograms the
+    // pieces concurrently, turns the histograms into per-piece output offsets
+    // and scatters the pieces concurrently; passes in which every key has the
+    // same digit are skipped. The sort is stable.
+    template <class _Tp>
+    void __parallel_radix_sort(_Tp* __f, _Tp* __l)
+    {
+        size_t n = __l - __f;
+        size_t pieces = __parallel_pieces(n, 1 << 16);
+        if (pieces <= 1 && n < 256)
+        {
+            std::stable_sort(__f, __l);
+            return;
+        }
+        pieces = pieces ? pieces : 1;
+        
+        auto bound = [&](size_t i) { return n * i / pieces; };
+        vector<array<size_t, 256>> offsets(pieces);
+        vector<_Tp> buffer(n);
+        _Tp* src = __f;
+        _Tp* dst = buffer.data();
+        
+        for (unsigned shift = 0; shift < sizeof(typename __radix_traits<_Tp>::__key_type) * 8; shift += 8)
+        {
+            auto count = [&](size_t i)
+            {
+                array<size_t, 256>& c = offsets[i];
+                c.fill(0);
+                for (_Tp* p = src + bound(i); p != src + bound(i + 1); ++p)
+                {
+                    ++c[(__radix_traits<_Tp>::__key(*p) >> shift) & 0xff];
+                }
+            };
+            __parallel_invoke(pieces, count);
+            
+            bool trivial = false;
+            size_t total = 0;
+            for (size_t d = 0; d < 256; ++d)
+            {
+                size_t digit = 0;
+                for (size_t i = 0; i < pieces; ++i)
+                {
+                    size_t c = offsets[i][d];
+                    offsets[i][d] = total;
+                    total += c;
+                    digit += c;
+                }
+                trivial = trivial || digit == n;
+            }
+            if (trivial)
+            {
+                continue;
+            }
+            
+            auto scatter = [&](size_t i)
+            {
+                array<size_t, 256>& o = offsets[i];
+                for (_Tp* p = src + bound(i); p != src + bound(i + 1); ++p)
+                {
+                    dst[o[(__radix_traits<_Tp>::__key(*p) >> shift) & 0xff]++] = *p;
+                }
+            };
+            __parallel_invoke(pieces, scatter);
+            std::swap(src, dst);
+        }
+        
+        if (src != __f)
+        {
+            std::memcpy(__f, src, n * sizeof(_Tp));
+        }
+    }
+    
+    template <class _Tp, class _Compare>
+    void __parallel_sort(_Tp* __f, _Tp* __l, _Compare& __comp, bool __stable, false_type)
+    {
+        __parallel_merge_sort(__f, __l, __comp, __stable);
+    }
+    
+    template <class _Tp, class _Compare>
+    void __parallel_sort(_Tp* __f, _Tp* __l, _Compare&, bool, true_type)
+    {
+        __parallel_radix_sort(__f, __l);
+    }
+    
+    // Entry point for the parallel_sort members. Arithmetic elements ordered
+    // by std::less take the radix path, everything else is merge sorted.
+    template <class _Tp, class _Compare>
+    void __parallel_sort(_Tp* __f, _Tp* __l, _Compare& __comp, bool __stable)
+    {
+        typedef integral_constant<bool, __is_radix_sortable<_Tp>::value &&
+                                        (is_same<_Compare, less<_Tp>>::value || is_same<_Compare, less<>>::value)> __radix;
+        __parallel_sort(__f, __l, __comp, __stable, __radix());
+    }
+}
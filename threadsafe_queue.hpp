@@ -0,0 +1,250 @@
+//
+//  threadsafe_queue.hpp
+//  stl_extension
+//
+//  Created by Kingle Zhuang on 11/20/19.
+//  Copyright © 2019 RingCentral. All rights reserved.
+//
+
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <optional>
+#include <functional>
+#include "threadsafe_mutex.hpp"
+
+namespace std
+{
+    // FIFO specialisation of threadsafe_deque / threadsafe_list using the
+    // Michael & Scott two-lock queue: a singly linked list that always starts
+    // with a dummy node, where push only takes the tail lock and pop only takes
+    // the head lock, so producers and consumers never contend with each other.
+    // Nodes are allocated and freed outside both critical sections, by any
+    // number of producers and consumers at once, so the allocator has to be
+    // stateless.
+    template <typename _Tp, typename _Allocator = allocator<_Tp>, typename _Mutex = mutex>
+    class threadsafe_queue
+    {
+    public:
+        typedef _Tp                                             value_type;
+        typedef _Allocator                                      allocator_type;
+        typedef _Mutex                                          mutex_type;
+        typedef value_type&                                     reference;
+        typedef const value_type&                               const_reference;
+        typedef size_t                                          size_type;
+        
+    private:
+        struct __node
+        {
+            atomic<__node*> __next_;
+            alignas(value_type) unsigned char __storage_[sizeof(value_type)];
+            
+            __node() : __next_(nullptr) {}
+            
+            value_type* __value() { return reinterpret_cast<value_type*>(__storage_); }
+        };
+        
+        static_assert(allocator_traits<allocator_type>::is_always_equal::value, "threadsafe_queue requires a stateless allocator");
+        
+        typedef typename allocator_traits<allocator_type>::template rebind_alloc<__node> __node_allocator;
+        typedef allocator_traits<__node_allocator>                                      __node_traits;
+        
+        __node_allocator __alloc_;
+        
+        alignas(64) mutable mutex_type __head_mutex_;
+        __node* __head_;
+        
+        alignas(64) mutable mutex_type __tail_mutex_;
+        __node* __tail_;
+        
+        alignas(64) atomic<size_type> __size_;
+        
+    public:
+        threadsafe_queue() : __alloc_(), __head_(__allocate()), __tail_(__head_), __size_(0) {}
+        
+        threadsafe_queue(initializer_list<value_type> __il) : threadsafe_queue()
+        {
+            for (const auto& v : __il)
+            {
+                push(v);
+            }
+        }
+        
+        template <class _InputIterator>
+        threadsafe_queue(_InputIterator __f, _InputIterator __l) : threadsafe_queue()
+        {
+            for (; __f != __l; ++__f)
+            {
+                push(*__f);
+            }
+        }
+        
+        threadsafe_queue(const threadsafe_queue&) = delete;
+        threadsafe_queue& operator=(const threadsafe_queue&) = delete;
+        threadsafe_queue(threadsafe_queue&&) = delete;
+        threadsafe_queue& operator=(threadsafe_queue&&) = delete;
+        
+        ~threadsafe_queue()
+        {
+            __node* n = __head_->__next_.load(memory_order_relaxed);
+            __deallocate(__head_);
+            __release(n);
+        }
+        
+    private:
+        __node* __allocate()
+        {
+            __node* n = __node_traits::allocate(__alloc_, 1);
+            ::new (static_cast<void*>(n)) __node();
+            return n;
+        }
+        
+        void __deallocate(__node* __n)
+        {
+            __n->~__node();
+            __node_traits::deallocate(__alloc_, __n, 1);
+        }
+        
+        // Frees a detached chain of value-carrying nodes.
+        void __release(__node* __n)
+        {
+            while (__n)
+            {
+                __node* next = __n->__next_.load(memory_order_relaxed);
+                __n->__value()->~value_type();
+                __deallocate(__n);
+                __n = next;
+            }
+        }
+        
+        template <class... _Args>
+        void __push(_Args&&... __args)
+        {
+            __node* n = __allocate();
+            try
+            {
+                ::new (static_cast<void*>(n->__storage_)) value_type(std::forward<_Args>(__args)...);
+            }
+            catch (...)
+            {
+                __deallocate(n);
+                throw;
+            }
+            
+            std::unique_lock<mutex_type> lock(__tail_mutex_);
+            __size_.fetch_add(1, memory_order_relaxed);
+            __tail_->__next_.store(n, memory_order_release);
+            __tail_ = n;
+        }
+        
+        // Unlinks the first element; its node becomes the new dummy and the old
+        // dummy is returned so the caller can free it after unlocking.
+        __node* __pop(value_type& __v)
+        {
+            std::unique_lock<mutex_type> lock(__head_mutex_);
+            __node* first = __head_->__next_.load(memory_order_acquire);
+            if (!first)
+            {
+                return nullptr;
+            }
+            
+            __v = std::move(*first->__value());
+            first->__value()->~value_type();
+            
+            __node* old = __head_;
+            __head_ = first;
+            __size_.fetch_sub(1, memory_order_relaxed);
+            return old;
+        }
+        
+    public:
+        bool empty() const
+        {
+            return __size_.load(memory_order_relaxed) == 0;
+        }
+        
+        size_type size() const
+        {
+            return __size_.load(memory_order_relaxed);
+        }
+        
+        void push(const value_type& __v)
+        {
+            __push(__v);
+        }
+        
+        void push(value_type&& __v)
+        {
+            __push(std::move(__v));
+        }
+        
+        template <class... _Args>
+        void emplace(_Args&&... __args)
+        {
+            __push(std::forward<_Args>(__args)...);
+        }
+        
+        bool try_pop(value_type& __v)
+        {
+            __node* old = __pop(__v);
+            if (!old)
+            {
+                return false;
+            }
+            
+            __deallocate(old);
+            return true;
+        }
+        
+        std::optional<value_type> try_pop()
+        {
+            std::unique_lock<mutex_type> lock(__head_mutex_);
+            __node* first = __head_->__next_.load(memory_order_acquire);
+            if (!first)
+            {
+                return std::nullopt;
+            }
+            
+            std::optional<value_type> r(std::move(*first->__value()));
+            first->__value()->~value_type();
+            
+            __node* old = __head_;
+            __head_ = first;
+            __size_.fetch_sub(1, memory_order_relaxed);
+            lock.unlock();
+            
+            __deallocate(old);
+            return r;
+        }
+        
+        void clear()
+        {
+            std::unique_lock<mutex_type> head_lock(__head_mutex_);
+            std::unique_lock<mutex_type> tail_lock(__tail_mutex_);
+            
+            __node* chain = __head_->__next_.load(memory_order_relaxed);
+            __head_->__next_.store(nullptr, memory_order_relaxed);
+            __tail_ = __head_;
+            __size_.store(0, memory_order_relaxed);
+            
+            tail_lock.unlock();
+            head_lock.unlock();
+            __release(chain);
+        }
+        
+        template <typename _Function>
+        void for_each(_Function __bl)
+        {
+            std::unique_lock<mutex_type> head_lock(__head_mutex_);
+            std::unique_lock<mutex_type> tail_lock(__tail_mutex_);
+            
+            for (__node* n = __head_->__next_.load(memory_order_relaxed); n; n = n->__next_.load(memory_order_relaxed))
+            {
+                __bl(*n->__value());
+            }
+        }
+    };
+}
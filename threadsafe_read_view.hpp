@@ -0,0 +1,84 @@
+//
+//  threadsafe_read_view.hpp
+//  stl_extension
+//
+//  Created by Kingle Zhuang on 11/20/19.
+//  Copyright © 2019 RingCentral. All rights reserved.
+//
+
+#pragma once
+
+#include <mutex>
+#include <utility>
+#include <shared_mutex>
+
+namespace std
+{
+    // Zero-copy read access to a threadsafe_* container or to one of its
+    // elements. The view owns the container's shared lock until it goes out of
+    // scope or release() is called, so the referenced object stays valid for
+    // exactly that long; writers are blocked in the meantime, so keep views
+    // short-lived. A view of an element that does not exist is empty.
+    template <typename _Tp, typename _Mutex>
+    class threadsafe_read_view
+    {
+    public:
+        typedef _Tp                                             value_type;
+        typedef _Mutex                                          mutex_type;
+        typedef const value_type&                               const_reference;
+        typedef const value_type*                               const_pointer;
+        
+    private:
+        std::shared_lock<mutex_type> __lock_;
+        const_pointer __ptr_;
+        
+    public:
+        threadsafe_read_view(std::shared_lock<mutex_type>&& __lock, const_pointer __p) : __lock_(std::move(__lock)), __ptr_(__p) {}
+        
+        threadsafe_read_view(threadsafe_read_view&& __v) : __lock_(std::move(__v.__lock_)), __ptr_(__v.__ptr_)
+        {
+            __v.__ptr_ = nullptr;
+        }
+        
+        threadsafe_read_view& operator=(threadsafe_read_view&& __v)
+        {
+            __lock_ = std::move(__v.__lock_);
+            __ptr_ = __v.__ptr_;
+            __v.__ptr_ = nullptr;
+            return *this;
+        }
+        
+        threadsafe_read_view(const threadsafe_read_view&) = delete;
+        threadsafe_read_view& operator=(const threadsafe_read_view&) = delete;
+        
+    public:
+        explicit operator bool() const
+        {
+            return __ptr_ != nullptr;
+        }
+        
+        const_reference get() const
+        {
+            return *__ptr_;
+        }
+        
+        const_reference operator*() const
+        {
+            return *__ptr_;
+        }
+        
+        const_pointer operator->() const
+        {
+            return __ptr_;
+        }
+        
+        void release()
+        {
+            __ptr_ = nullptr;
+            if (__lock_.owns_lock())
+            {
+                __lock_.unlock();
+            }
+        }
+    };
+}
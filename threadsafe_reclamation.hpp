@@ -0,0 +1,455 @@
+//
+//  threadsafe_reclamation.hpp
+//  stl_extension
+//
+//  Created by Kingle Zhuang on 11/20/19.
+//  Copyright © 2019 RingCentral. All rights reserved.
+//
+
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <stdexcept>
+#include <algorithm>
+
+namespace std
+{
+    // Epoch based reclamation shared by the lock-free containers. A thread
+    // enters a critical section with __epoch_guard before it dereferences any
+    // shared node, and a node that has been unlinked is handed to retire()
+    // instead of being deleted. Retired nodes are freed once the global epoch
+    // has advanced twice, at which point no guard can still observe them.
+    // The ordering rests on seq_cst read-modify-writes of the thread's own
+    // epoch rather than on standalone fences, which ThreadSanitizer does not
+    // model: entering publishes the local epoch with an exchange, which also
+    // releases everything the previous critical section read to whoever
+    // later sees the new epoch, and retiring does an empty fetch_add before
+    // it reads the global epoch. Either is a full barrier on x86 and on
+    // ARMv8.1 and later.
+    class __epoch_domain
+    {
+    public:
+        typedef void (*__deleter_type)(void*);
+        
+    private:
+        struct __retired
+        {
+            void*          __ptr_;
+            __deleter_type __deleter_;
+            uint64_t       __epoch_;
+        };
+        
+        struct alignas(64) __record
+        {
+            atomic<uint64_t>  __epoch_;
+            atomic<bool>      __in_use_;
+            __record*         __next_;
+            unsigned          __nesting_;
+            size_t            __next_collect_;
+            vector<__retired> __limbo_;
+            
+            __record() : __epoch_(0), __in_use_(true), __next_(nullptr), __nesting_(0), __next_collect_(__collect_threshold) {}
+        };
+        
+        struct __thread_handle
+        {
+            __record* __rec_ = nullptr;
+            
+            ~__thread_handle()
+            {
+                if (__rec_)
+                {
+                    __rec_->__in_use_.store(false, memory_order_release);
+                }
+            }
+        };
+        
+        static constexpr size_t __collect_threshold = 64;
+        
+        atomic<uint64_t> __global_epoch_;
+        atomic<__record*> __records_;
+        
+        __epoch_domain() : __global_epoch_(1), __records_(nullptr) {}
+        
+        ~__epoch_domain()
+        {
+            __record* rec = __records_.load(memory_order_acquire);
+            while (rec)
+            {
+                for (const auto& r : rec->__limbo_)
+                {
+                    r.__deleter_(r.__ptr_);
+                }
+                
+                __record* next = rec->__next_;
+                delete rec;
+                rec = next;
+            }
+        }
+        
+        __record* __acquire()
+        {
+            for (__record* rec = __records_.load(memory_order_acquire); rec; rec = rec->__next_)
+            {
+                bool expected = false;
+                if (!rec->__in_use_.load(memory_order_relaxed) &&
+                    rec->__in_use_.compare_exchange_strong(expected, true, memory_order_acquire))
+                {
+                    return rec;
+                }
+            }
+            
+            __record* rec = new __record();
+            __record* head = __records_.load(memory_order_relaxed);
+            do
+            {
+                rec->__next_ = head;
+            } while (!__records_.compare_exchange_weak(head, rec, memory_order_release, memory_order_relaxed));
+            return rec;
+        }
+        
+        __record* __local()
+        {
+            static thread_local __thread_handle handle;
+            if (!handle.__rec_)
+            {
+                handle.__rec_ = __acquire();
+            }
+            return handle.__rec_;
+        }
+        
+        uint64_t __try_advance()
+        {
+            uint64_t e = __global_epoch_.load(memory_order_seq_cst);
+            
+            for (__record* rec = __records_.load(memory_order_acquire); rec; rec = rec->__next_)
+            {
+                uint64_t local = rec->__epoch_.load(memory_order_seq_cst);
+                if (local != 0 && local != e)
+                {
+                    return e;
+                }
+            }
+            
+            __global_epoch_.compare_exchange_strong(e, e + 1, memory_order_acq_rel, memory_order_acquire);
+            return __global_epoch_.load(memory_order_acquire);
+        }
+        
+        void __collect(__record* __rec)
+        {
+            uint64_t e = __try_advance();
+            
+            auto& limbo = __rec->__limbo_;
+            size_t kept = 0;
+            for (size_t i = 0; i < limbo.size(); ++i)
+            {
+                if (e - limbo[i].__epoch_ >= 2)
+                {
+                    limbo[i].__deleter_(limbo[i].__ptr_);
+                }
+                else
+                {
+                    limbo[kept++] = limbo[i];
+                }
+            }
+            limbo.resize(kept);
+            __rec->__next_collect_ = kept + __collect_threshold;
+        }
+        
+    public:
+        __epoch_domain(const __epoch_domain&) = delete;
+        __epoch_domain& operator=(const __epoch_domain&) = delete;
+        
+        static __epoch_domain& instance()
+        {
+            static __epoch_domain domain;
+            return domain;
+        }
+        
+        void enter()
+        {
+            __record* rec = __local();
+            if (rec->__nesting_++ == 0)
+            {
+                rec->__epoch_.exchange(__global_epoch_.load(memory_order_seq_cst), memory_order_seq_cst);
+            }
+        }
+        
+        void exit()
+        {
+            __record* rec = __local();
+            if (--rec->__nesting_ == 0)
+            {
+                rec->__epoch_.store(0, memory_order_release);
+            }
+        }
+        
+        // Nodes retired by the calling thread that have not been freed yet.
+        size_t pending()
+        {
+            return __local()->__limbo_.size();
+        }
+        
+        void retire(void* __p, __deleter_type __d)
+        {
+            __record* rec = __local();
+            
+            // The caller's unlink may be a plain release store, which a
+            // later load can overtake; the RMW keeps the epoch read after it.
+            rec->__epoch_.fetch_add(0, memory_order_seq_cst);
+            rec->__limbo_.push_back(__retired{__p, __d, __global_epoch_.load(memory_order_seq_cst)});
+            
+            if (rec->__limbo_.size() >= rec->__next_collect_)
+            {
+                __collect(rec);
+            }
+        }
+    };
+    
+    class __epoch_guard
+    {
+    public:
+        __epoch_guard() { __epoch_domain::instance().enter(); }
+        ~__epoch_guard() { __epoch_domain::instance().exit(); }
+        
+        __epoch_guard(const __epoch_guard&) = delete;
+        __epoch_guard& operator=(const __epoch_guard&) = delete;
+    };
+    
+    
+    // Hazard pointers, for containers that cannot accept EBR's failure mode:
+    // a thread that stalls inside an __epoch_guard stops the epoch and with
+    // it all reclamation. Here a reader publishes each node it is about to
+    // dereference in one of its hazard slots, and a retired node is freed as
+    // soon as no slot holds it. A thread scans once its retire list reaches
+    // __scan_threshold plus twice the number of slots in the domain - the
+    // fixed part keeps scans amortised while few threads are registered - so
+    // at most __scan_threshold + 2 * __slots_per_thread * records nodes per
+    // thread stay unreclaimed, at the price of a seq_cst store on every
+    // protected load.
+    class __hazard_domain
+    {
+    public:
+        typedef void (*__deleter_type)(void*);
+        
+        static constexpr unsigned __slots_per_thread = 4;
+        
+    private:
+        struct __retired
+        {
+            void*          __ptr_;
+            __deleter_type __deleter_;
+        };
+        
+        struct alignas(64) __record
+        {
+            atomic<void*>     __hazards_[__slots_per_thread];
+            atomic<bool>      __in_use_;
+            __record*         __next_;
+            unsigned          __used_;
+            vector<__retired> __retired_;
+            
+            __record() : __in_use_(true), __next_(nullptr), __used_(0)
+            {
+                for (auto& h : __hazards_)
+                {
+                    h.store(nullptr, memory_order_relaxed);
+                }
+            }
+        };
+        
+        // A record outlives its thread; the next thread to acquire it
+        // inherits the nodes that were still protected at exit.
+        struct __thread_handle
+        {
+            __record* __rec_ = nullptr;
+            
+            ~__thread_handle()
+            {
+                if (__rec_)
+                {
+                    __rec_->__in_use_.store(false, memory_order_release);
+                }
+            }
+        };
+        
+        static constexpr size_t __scan_threshold = 64;
+        
+        atomic<__record*> __records_;
+        atomic<size_t> __record_count_;
+        
+        __hazard_domain() : __records_(nullptr), __record_count_(0) {}
+        
+        ~__hazard_domain()
+        {
+            __record* rec = __records_.load(memory_order_acquire);
+            while (rec)
+            {
+                for (const auto& r : rec->__retired_)
+                {
+                    r.__deleter_(r.__ptr_);
+                }
+                
+                __record* next = rec->__next_;
+                delete rec;
+                rec = next;
+            }
+        }
+        
+        __record* __acquire()
+        {
+            for (__record* rec = __records_.load(memory_order_acquire); rec; rec = rec->__next_)
+            {
+                bool expected = false;
+                if (!rec->__in_use_.load(memory_order_relaxed) &&
+                    rec->__in_use_.compare_exchange_strong(expected, true, memory_order_acquire))
+                {
+                    return rec;
+                }
+            }
+            
+            __record* rec = new __record();
+            __record* head = __records_.load(memory_order_relaxed);
+            do
+            {
+                rec->__next_ = head;
+            } while (!__records_.compare_exchange_weak(head, rec, memory_order_release, memory_order_relaxed));
+            __record_count_.fetch_add(1, memory_order_relaxed);
+            return rec;
+        }
+        
+        __record* __local()
+        {
+            static thread_local __thread_handle handle;
+            if (!handle.__rec_)
+            {
+                handle.__rec_ = __acquire();
+            }
+            return handle.__rec_;
+        }
+        
+        void __scan(__record* __rec)
+        {
+            // Full barrier between the caller's unlink and the hazard loads,
+            // as a seq_cst RMW on the thread's own record rather than a fence
+            // ThreadSanitizer cannot see.
+            __rec->__in_use_.exchange(true, memory_order_seq_cst);
+            
+            vector<void*> hazards;
+            for (__record* rec = __records_.load(memory_order_acquire); rec; rec = rec->__next_)
+            {
+                for (const auto& h : rec->__hazards_)
+                {
+                    void* p = h.load(memory_order_acquire);
+                    if (p)
+                    {
+                        hazards.push_back(p);
+                    }
+                }
+            }
+            sort(hazards.begin(), hazards.end());
+            
+            auto& retired = __rec->__retired_;
+            size_t kept = 0;
+            for (size_t i = 0; i < retired.size(); ++i)
+            {
+                if (binary_search(hazards.begin(), hazards.end(), retired[i].__ptr_))
+                {
+                    retired[kept++] = retired[i];
+                }
+                else
+                {
+                    retired[i].__deleter_(retired[i].__ptr_);
+                }
+            }
+            retired.resize(kept);
+        }
+        
+    public:
+        __hazard_domain(const __hazard_domain&) = delete;
+        __hazard_domain& operator=(const __hazard_domain&) = delete;
+        
+        static __hazard_domain& instance()
+        {
+            static __hazard_domain domain;
+            return domain;
+        }
+        
+        // Hands out one of the calling thread's hazard slots.
+        atomic<void*>* acquire_slot()
+        {
+            __record* rec = __local();
+            for (unsigned i = 0; i < __slots_per_thread; ++i)
+            {
+                if (!(rec->__used_ & (1u << i)))
+                {
+                    rec->__used_ |= 1u << i;
+                    return &rec->__hazards_[i];
+                }
+            }
+            throw std::length_error("__hazard_domain: out of hazard slots");
+        }
+        
+        void release_slot(atomic<void*>* __slot)
+        {
+            __record* rec = __local();
+            __slot->store(nullptr, memory_order_release);
+            rec->__used_ &= ~(1u << (__slot - rec->__hazards_));
+        }
+        
+        size_t pending()
+        {
+            return __local()->__retired_.size();
+        }
+        
+        void retire(void* __p, __deleter_type __d)
+        {
+            __record* rec = __local();
+            rec->__retired_.push_back(__retired{__p, __d});
+            
+            if (rec->__retired_.size() >= __scan_threshold + 2 * __slots_per_thread * __record_count_.load(memory_order_relaxed))
+            {
+                __scan(rec);
+            }
+        }
+    };
+    
+    class __hazard_pointer
+    {
+    private:
+        atomic<void*>* __slot_;
+        
+    public:
+        __hazard_pointer() : __slot_(__hazard_domain::instance().acquire_slot()) {}
+        ~__hazard_pointer() { __hazard_domain::instance().release_slot(__slot_); }
+        
+        __hazard_pointer(const __hazard_pointer&) = delete;
+        __hazard_pointer& operator=(const __hazard_pointer&) = delete;
+        
+        // Loads __src and publishes the result, retrying until the published
+        // value is still current, so it cannot have been retired and freed
+        // before this slot became visible to the scanners.
+        template <class _Tp>
+        _Tp* protect(const atomic<_Tp*>& __src)
+        {
+            _Tp* p = __src.load(memory_order_relaxed);
+            while (true)
+            {
+                __slot_->store(p, memory_order_seq_cst);
+                _Tp* q = __src.load(memory_order_acquire);
+                if (q == p)
+                {
+                    return p;
+                }
+                p = q;
+            }
+        }
+        
+        void reset()
+        {
+            __slot_->store(nullptr, memory_order_release);
+        }
+    };
+}
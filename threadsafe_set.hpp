@@ -10,17 +10,27 @@
 
 #include <set>
 #include <mutex>
+#include <atomic>
+#include <vector>
 #include <memory>
 #include <utility>
+#include <iterator>
+#include <optional>
 #include <functional>
 #include <shared_mutex>
+#include <memory_resource>
+#include "threadsafe_mutex.hpp"
+#include "threadsafe_parallel.hpp"
+#include "threadsafe_read_view.hpp"
+#include "threadsafe_skiplist.hpp"
 
 namespace std
 {
     template <
               typename _Key,
               typename _Compare = less<_Key>,
-              typename _Allocator = allocator<_Key>
+              typename _Allocator = allocator<_Key>,
+              typename _Mutex = shared_timed_mutex
              >
     class threadsafe_set
     {
@@ -30,14 +40,15 @@ namespace std
         typedef _Compare                                 key_compare;
         typedef key_compare                              value_compare;
         typedef _Allocator                               allocator_type;
+        typedef _Mutex                                   mutex_type;
         typedef value_type&                              reference;
         typedef const value_type&                        const_reference;
         
     private:
         typedef std::set<value_type, value_compare, allocator_type> __set_type;
         
-        mutable std::shared_timed_mutex __mutex_;
-        __set_type __internal_set_;
+        mutable _Mutex __mutex_;
+        shared_ptr<__set_type> __internal_set_;
         
     public:
         typedef          __set_type                         set_type;
@@ -51,123 +62,198 @@ namespace std
         typedef typename __set_type::const_reverse_iterator const_reverse_iterator;
         
     public:
-        threadsafe_set() : __internal_set_() {}
-        threadsafe_set(const set_type& __s) : __internal_set_(__s) {}
-        threadsafe_set(set_type&& __s) : __internal_set_(std::move(__s)) {}
-        threadsafe_set(initializer_list<value_type> __il) : __internal_set_(__il) {}
+        threadsafe_set() : __internal_set_(std::make_shared<__set_type>()) {}
+        explicit threadsafe_set(const allocator_type& __a) : __internal_set_(std::make_shared<__set_type>(__a)) {}
+        threadsafe_set(const set_type& __s) : __internal_set_(std::make_shared<__set_type>(__s)) {}
+        threadsafe_set(set_type&& __s) : __internal_set_(std::make_shared<__set_type>(std::move(__s))) {}
+        threadsafe_set(initializer_list<value_type> __il) : __internal_set_(std::make_shared<__set_type>(__il)) {}
         
         template <class _InputIterator>
-        threadsafe_set(_InputIterator __f, _InputIterator __l) : __internal_set_(__f, __l) {}
+        threadsafe_set(_InputIterator __f, _InputIterator __l) : __internal_set_(std::make_shared<__set_type>(__f, __l)) {}
         
         threadsafe_set(const threadsafe_set&) = delete;
         threadsafe_set& operator=(const threadsafe_set&) = delete;
         threadsafe_set(threadsafe_set&&) = delete;
         threadsafe_set& operator=(threadsafe_set&&) = delete;
         
+    private:
+        // Called under the unique lock before every write. The set is copied
+        // only if a snapshot still refers to it.
+        void __detach(bool __copy = true)
+        {
+            if (__internal_set_.use_count() > 1)
+            {
+                __internal_set_ = __copy ? std::make_shared<__set_type>(*__internal_set_, __internal_set_->get_allocator())
+                                         : std::make_shared<__set_type>(__internal_set_->get_allocator());
+            }
+            else
+            {
+                atomic_thread_fence(memory_order_acquire);
+            }
+        }
+        
+        template <class _Op>
+        auto __parallel(_Op __op)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            const __set_type& c = *__internal_set_;
+            
+            size_t pieces = __parallel_pieces(c.size());
+            std::vector<typename __set_type::const_iterator> bounds;
+            bounds.reserve(pieces + 1);
+            auto it = c.begin();
+            for (size_t i = 0; i < pieces; ++i)
+            {
+                bounds.push_back(it);
+                std::advance(it, c.size() * (i + 1) / pieces - c.size() * i / pieces);
+            }
+            bounds.push_back(c.end());
+            
+            auto visit = [&bounds](size_t __f, size_t __l, auto& __bl)
+            {
+                for (auto it = bounds[__f]; it != bounds[__l]; ++it)
+                {
+                    __bl(*it);
+                }
+            };
+            return __op(pieces, pieces, visit);
+        }
+        
     public:
+        allocator_type get_allocator() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_set_->get_allocator();
+        }
+        
         bool empty() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_set_.empty();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_set_->empty();
         }
         
         size_type size() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_set_.size();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_set_->size();
         }
         
         size_type max_size() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_set_.max_size();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_set_->max_size();
         }
         
         void operator=(const set_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_set_ = __v;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            *__internal_set_ = __v;
         }
         
-        void operator=(initializer_list<set_type> __il)
+        void operator=(initializer_list<value_type> __il)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_set_ = __il;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            *__internal_set_ = __il;
         }
         
         set_type value()
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return *__internal_set_;
+        }
+        
+        std::shared_ptr<const set_type> snapshot() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
             return __internal_set_;
         }
         
+        threadsafe_read_view<set_type, mutex_type> read() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return threadsafe_read_view<set_type, mutex_type>(std::move(lock), __internal_set_.get());
+        }
+        
         set_type set_intersection(const set_type& s)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::shared_lock<mutex_type> lock(__mutex_);
             
             set_type r;
-            std::set_intersection(__internal_set_.begin(), __internal_set_.end(), s.begin(), s.end(), std::inserter(r, r.begin()));
+            std::set_intersection(__internal_set_->begin(), __internal_set_->end(), s.begin(), s.end(), std::inserter(r, r.begin()));
             return r;
         }
         
         set_type set_union(const set_type& s)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::shared_lock<mutex_type> lock(__mutex_);
             
             set_type r;
-            std::set_union(__internal_set_.begin(), __internal_set_.end(), s.begin(), s.end(), std::inserter(r, r.begin()));
+            std::set_union(__internal_set_->begin(), __internal_set_->end(), s.begin(), s.end(), std::inserter(r, r.begin()));
             return r;
         }
         
         set_type set_different(const set_type& s)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::shared_lock<mutex_type> lock(__mutex_);
             
             set_type r;
-            std::set_difference(__internal_set_.begin(), __internal_set_.end(), s.begin(), s.end(), std::inserter(r, r.begin()));
+            std::set_difference(__internal_set_->begin(), __internal_set_->end(), s.begin(), s.end(), std::inserter(r, r.begin()));
             return r;
         }
         
         set_type set_symmetric_difference(const set_type& s)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::shared_lock<mutex_type> lock(__mutex_);
             
             set_type r;
-            std::set_symmetric_difference(__internal_set_.begin(), __internal_set_.end(), s.begin(), s.end(), std::inserter(r, r.begin()));
+            std::set_symmetric_difference(__internal_set_->begin(), __internal_set_->end(), s.begin(), s.end(), std::inserter(r, r.begin()));
             return r;
         }
         
         template <class... _Args>
         bool emplace(_Args&&... __args)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_set_.emplace(std::forward<_Args>(__args)...).second;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_set_->emplace(std::forward<_Args>(__args)...).second;
         }
         
         bool insert(const value_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_set_.insert(__v).second;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_set_->insert(__v).second;
+        }
+        
+        bool insert(value_type&& __v)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_set_->insert(std::move(__v)).second;
         }
         
         void insert(initializer_list<value_type> __il)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_set_.insert(__il);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_set_->insert(__il);
         }
         
         template <class _InputIterator>
         void insert(_InputIterator __f, _InputIterator __l)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_set_.insert(__f, __l);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_set_->insert(__f, __l);
         }
         
         const std::pair<const value_type, bool> get(const key_type& __k)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            auto it = __internal_set_.find(__k);
-            if (it == __internal_set_.end())
+            std::shared_lock<mutex_type> lock(__mutex_);
+            auto it = __internal_set_->find(__k);
+            if (it == __internal_set_->end())
             {
                 return std::make_pair(value_type(), false);
             }
@@ -179,38 +265,161 @@ namespace std
         
         void clear()
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_set_.clear();
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            __internal_set_->clear();
         }
         
         bool contains(const key_type& __k)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            auto it = __internal_set_.find(__k);
-            return it != __internal_set_.end();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            auto it = __internal_set_->find(__k);
+            return it != __internal_set_->end();
         }
         
         size_type erase(const key_type& __k)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_set_.erase(__k);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_set_->erase(__k);
         }
         
-        void for_each(std::function<void(const value_type&)> __bl)
+        template <typename _Function>
+        void for_each(_Function __bl)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            for (const auto& v : __internal_set_)
+            std::shared_lock<mutex_type> lock(__mutex_);
+            for (const auto& v : *__internal_set_)
             {
                 __bl(v);
             }
         }
+        
+        // Resumes after the last visited key; see threadsafe_map::scan.
+        class scan_cursor
+        {
+            friend class threadsafe_set;
+            
+            std::optional<key_type> __last_;
+            bool __done_ = false;
+            
+        public:
+            bool done() const { return __done_; }
+        };
+        
+        template <typename _Function>
+        size_type scan(scan_cursor& __c, size_type __count, _Function __bl)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            if (__c.__done_)
+            {
+                return 0;
+            }
+            
+            auto it = __c.__last_ ? __internal_set_->upper_bound(*__c.__last_) : __internal_set_->begin();
+            size_type n = 0;
+            for (; n < __count && it != __internal_set_->end(); ++it, ++n)
+            {
+                __bl(*it);
+            }
+            
+            if (n > 0)
+            {
+                __c.__last_.emplace(*std::prev(it));
+            }
+            __c.__done_ = it == __internal_set_->end();
+            return n;
+        }
+        
+        // Pieces are contiguous key ranges; see threadsafe_vector::parallel_for_each.
+        template <typename _Function>
+        void parallel_for_each(_Function __bl)
+        {
+            __parallel([&](size_t __units, size_t __pieces, auto& __visit) { __parallel_for_each(__units, __pieces, __visit, __bl); });
+        }
+        
+        template <typename _Result, typename _Accumulate, typename _Combine>
+        _Result parallel_reduce(_Result __identity, _Accumulate __acc, _Combine __comb)
+        {
+            return __parallel([&](size_t __units, size_t __pieces, auto& __visit) { return __parallel_reduce(__units, __pieces, __visit, std::move(__identity), __acc, __comb); });
+        }
+        
+        template <typename _Predicate>
+        size_type parallel_count_if(_Predicate __pred)
+        {
+            return __parallel([&](size_t __units, size_t __pieces, auto& __visit) { return __parallel_count_if(__units, __pieces, __visit, __pred); });
+        }
+        
+        // Visits the elements with keys in [__lo, __hi) in ascending order.
+        template <typename _Function>
+        void for_each_range(const key_type& __lo, const key_type& __hi, _Function __bl)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            auto comp = __internal_set_->key_comp();
+            for (auto it = __internal_set_->lower_bound(__lo); it != __internal_set_->end() && comp(*it, __hi); ++it)
+            {
+                __bl(*it);
+            }
+        }
+        
+        // Same range as for_each_range, in descending order.
+        template <typename _Function>
+        void reverse_for_each_range(const key_type& __lo, const key_type& __hi, _Function __bl)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            if (!__internal_set_->key_comp()(__lo, __hi))
+            {
+                return;
+            }
+            
+            auto first = __internal_set_->lower_bound(__lo);
+            for (auto it = __internal_set_->lower_bound(__hi); it != first;)
+            {
+                __bl(*--it);
+            }
+        }
+        
+        std::pair<value_type, bool> lower_bound(const key_type& __k)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            auto it = __internal_set_->lower_bound(__k);
+            if (it == __internal_set_->end())
+            {
+                return std::make_pair(value_type(), false);
+            }
+            return std::make_pair(*it, true);
+        }
+        
+        std::pair<value_type, bool> upper_bound(const key_type& __k)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            auto it = __internal_set_->upper_bound(__k);
+            if (it == __internal_set_->end())
+            {
+                return std::make_pair(value_type(), false);
+            }
+            return std::make_pair(*it, true);
+        }
+        
+        // Copies the __n smallest elements to __out; returns how many there were.
+        template <class _OutputIterator>
+        size_type first_n(_OutputIterator __out, size_type __n)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            size_type i = 0;
+            for (auto it = __internal_set_->begin(); i < __n && it != __internal_set_->end(); ++it, ++i)
+            {
+                *__out++ = *it;
+            }
+            return i;
+        }
     };
     
     
     template <
               typename _Key,
               typename _Compare = less<_Key>,
-              typename _Allocator = allocator<_Key>
+              typename _Allocator = allocator<_Key>,
+              typename _Mutex = shared_timed_mutex
              >
     class threadsafe_multiset
     {
@@ -220,14 +429,15 @@ namespace std
         typedef _Compare                                 key_compare;
         typedef key_compare                              value_compare;
         typedef _Allocator                               allocator_type;
+        typedef _Mutex                                   mutex_type;
         typedef value_type&                              reference;
         typedef const value_type&                        const_reference;
         
     private:
         typedef std::multiset<value_type, value_compare, allocator_type> __set_type;
         
-        mutable std::shared_timed_mutex __mutex_;
-        __set_type __internal_set_;
+        mutable _Mutex __mutex_;
+        shared_ptr<__set_type> __internal_set_;
         
     public:
         typedef          __set_type                         set_type;
@@ -241,123 +451,196 @@ namespace std
         typedef typename __set_type::const_reverse_iterator const_reverse_iterator;
         
     public:
-        threadsafe_multiset() : __internal_set_() {}
-        threadsafe_multiset(const set_type& __s) : __internal_set_(__s) {}
-        threadsafe_multiset(set_type&& __s) : __internal_set_(std::move(__s)) {}
-        threadsafe_multiset(initializer_list<value_type> __il) : __internal_set_(__il) {}
+        threadsafe_multiset() : __internal_set_(std::make_shared<__set_type>()) {}
+        explicit threadsafe_multiset(const allocator_type& __a) : __internal_set_(std::make_shared<__set_type>(__a)) {}
+        threadsafe_multiset(const set_type& __s) : __internal_set_(std::make_shared<__set_type>(__s)) {}
+        threadsafe_multiset(set_type&& __s) : __internal_set_(std::make_shared<__set_type>(std::move(__s))) {}
+        threadsafe_multiset(initializer_list<value_type> __il) : __internal_set_(std::make_shared<__set_type>(__il)) {}
         
         template <class _InputIterator>
-        threadsafe_multiset(_InputIterator __f, _InputIterator __l) : __internal_set_(__f, __l) {}
+        threadsafe_multiset(_InputIterator __f, _InputIterator __l) : __internal_set_(std::make_shared<__set_type>(__f, __l)) {}
         
         threadsafe_multiset(const threadsafe_multiset&) = delete;
         threadsafe_multiset& operator=(const threadsafe_multiset&) = delete;
         threadsafe_multiset(threadsafe_multiset&&) = delete;
         threadsafe_multiset& operator=(threadsafe_multiset&&) = delete;
         
+    private:
+        void __detach(bool __copy = true)
+        {
+            if (__internal_set_.use_count() > 1)
+            {
+                __internal_set_ = __copy ? std::make_shared<__set_type>(*__internal_set_, __internal_set_->get_allocator())
+                                         : std::make_shared<__set_type>(__internal_set_->get_allocator());
+            }
+            else
+            {
+                atomic_thread_fence(memory_order_acquire);
+            }
+        }
+        
+        template <class _Op>
+        auto __parallel(_Op __op)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            const __set_type& c = *__internal_set_;
+            
+            size_t pieces = __parallel_pieces(c.size());
+            std::vector<typename __set_type::const_iterator> bounds;
+            bounds.reserve(pieces + 1);
+            auto it = c.begin();
+            for (size_t i = 0; i < pieces; ++i)
+            {
+                bounds.push_back(it);
+                std::advance(it, c.size() * (i + 1) / pieces - c.size() * i / pieces);
+            }
+            bounds.push_back(c.end());
+            
+            auto visit = [&bounds](size_t __f, size_t __l, auto& __bl)
+            {
+                for (auto it = bounds[__f]; it != bounds[__l]; ++it)
+                {
+                    __bl(*it);
+                }
+            };
+            return __op(pieces, pieces, visit);
+        }
+        
     public:
+        allocator_type get_allocator() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_set_->get_allocator();
+        }
+        
         bool empty() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_set_.empty();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_set_->empty();
         }
         
         size_type size() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_set_.size();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_set_->size();
         }
         
         size_type max_size() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_set_.max_size();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_set_->max_size();
         }
         
         void operator=(const set_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_set_ = __v;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            *__internal_set_ = __v;
         }
         
-        void operator=(initializer_list<set_type> __il)
+        void operator=(initializer_list<value_type> __il)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_set_ = __il;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            *__internal_set_ = __il;
         }
         
         set_type value()
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return *__internal_set_;
+        }
+        
+        std::shared_ptr<const set_type> snapshot() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
             return __internal_set_;
         }
         
+        threadsafe_read_view<set_type, mutex_type> read() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return threadsafe_read_view<set_type, mutex_type>(std::move(lock), __internal_set_.get());
+        }
+        
         set_type set_intersection(const set_type& s)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::shared_lock<mutex_type> lock(__mutex_);
             
             set_type r;
-            std::set_intersection(__internal_set_.begin(), __internal_set_.end(), s.begin(), s.end(), std::inserter(r, r.begin()));
+            std::set_intersection(__internal_set_->begin(), __internal_set_->end(), s.begin(), s.end(), std::inserter(r, r.begin()));
             return r;
         }
         
         set_type set_union(const set_type& s)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::shared_lock<mutex_type> lock(__mutex_);
             
             set_type r;
-            std::set_union(__internal_set_.begin(), __internal_set_.end(), s.begin(), s.end(), std::inserter(r, r.begin()));
+            std::set_union(__internal_set_->begin(), __internal_set_->end(), s.begin(), s.end(), std::inserter(r, r.begin()));
             return r;
         }
         
         set_type set_different(const set_type& s)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::shared_lock<mutex_type> lock(__mutex_);
             
             set_type r;
-            std::set_difference(__internal_set_.begin(), __internal_set_.end(), s.begin(), s.end(), std::inserter(r, r.begin()));
+            std::set_difference(__internal_set_->begin(), __internal_set_->end(), s.begin(), s.end(), std::inserter(r, r.begin()));
             return r;
         }
         
         set_type set_symmetric_difference(const set_type& s)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::shared_lock<mutex_type> lock(__mutex_);
             
             set_type r;
-            std::set_symmetric_difference(__internal_set_.begin(), __internal_set_.end(), s.begin(), s.end(), std::inserter(r, r.begin()));
+            std::set_symmetric_difference(__internal_set_->begin(), __internal_set_->end(), s.begin(), s.end(), std::inserter(r, r.begin()));
             return r;
         }
         
         template <class... _Args>
         void emplace(_Args&&... __args)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_set_.emplace(std::forward<_Args>(__args)...);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_set_->emplace(std::forward<_Args>(__args)...);
         }
         
         void insert(const value_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_set_.insert(__v);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_set_->insert(__v);
+        }
+        
+        void insert(value_type&& __v)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_set_->insert(std::move(__v));
         }
         
         void insert(initializer_list<value_type> __il)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_set_.insert(__il);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_set_->insert(__il);
         }
         
         template <class _InputIterator>
         void insert(_InputIterator __f, _InputIterator __l)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_set_.insert(__f, __l);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_set_->insert(__f, __l);
         }
         
         const std::pair<const value_type, bool> get(const key_type& __k)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            auto it = __internal_set_.find(__k);
-            if (it == __internal_set_.end())
+            std::shared_lock<mutex_type> lock(__mutex_);
+            auto it = __internal_set_->find(__k);
+            if (it == __internal_set_->end())
             {
                 return std::make_pair(value_type(), false);
             }
@@ -369,37 +652,219 @@ namespace std
         
         void clear()
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_set_.clear();
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            __internal_set_->clear();
         }
         
         bool contains(const key_type& __k)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            auto it = __internal_set_.find(__k);
-            return it != __internal_set_.end();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            auto it = __internal_set_->find(__k);
+            return it != __internal_set_->end();
         }
         
         size_type erase(const key_type& __k)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_set_.erase(__k);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_set_->erase(__k);
         }
         
-        void for_each(std::function<void(const value_type&)> __bl)
+        template <typename _Function>
+        void for_each(_Function __bl)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            for (const auto& v : __internal_set_)
+            std::shared_lock<mutex_type> lock(__mutex_);
+            for (const auto& v : *__internal_set_)
             {
                 __bl(v);
             }
         }
         
-        void for_each(const key_type& __k, std::function<void(const std::pair<iterator, iterator>&)> __bl)
+        // See threadsafe_vector::parallel_for_each.
+        template <typename _Function>
+        void parallel_for_each(_Function __bl)
+        {
+            __parallel([&](size_t __units, size_t __pieces, auto& __visit) { __parallel_for_each(__units, __pieces, __visit, __bl); });
+        }
+        
+        template <typename _Result, typename _Accumulate, typename _Combine>
+        _Result parallel_reduce(_Result __identity, _Accumulate __acc, _Combine __comb)
+        {
+            return __parallel([&](size_t __units, size_t __pieces, auto& __visit) { return __parallel_reduce(__units, __pieces, __visit, std::move(__identity), __acc, __comb); });
+        }
+        
+        template <typename _Predicate>
+        size_type parallel_count_if(_Predicate __pred)
+        {
+            return __parallel([&](size_t __units, size_t __pieces, auto& __visit) { return __parallel_count_if(__units, __pieces, __visit, __pred); });
+        }
+        
+        template <typename _Function>
+        void for_each(const key_type& __k, _Function __bl)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            std::pair<iterator, iterator> r = __internal_set_.equal_range(__k);
+            std::shared_lock<mutex_type> lock(__mutex_);
+            std::pair<iterator, iterator> r = __internal_set_->equal_range(__k);
             __bl(r);
         }
     };
+    
+    
+    // Skip-list based counterpart of threadsafe_set with lock-free lookups and
+    // weakly consistent traversals; see threadsafe_skiplist_map.
+    template <typename _Key, typename _Compare = less<_Key>, typename _Allocator = allocator<_Key>>
+    class threadsafe_skiplist_set
+    {
+    public:
+        typedef _Key                                     key_type;
+        typedef key_type                                 value_type;
+        typedef _Compare                                 key_compare;
+        typedef key_compare                              value_compare;
+        typedef _Allocator                               allocator_type;
+        typedef value_type&                              reference;
+        typedef const value_type&                        const_reference;
+        typedef size_t                                   size_type;
+        typedef std::set<key_type, key_compare, allocator_type> set_type;
+        
+    private:
+        typedef __skiplist<key_type, __skiplist_no_value, key_compare, allocator_type> __list_type;
+        typedef typename __list_type::__node                                          __node;
+        
+        __list_type __list_;
+        
+    public:
+        threadsafe_skiplist_set() : __list_() {}
+        threadsafe_skiplist_set(const set_type& __s) : __list_() { insert(__s.begin(), __s.end()); }
+        threadsafe_skiplist_set(initializer_list<value_type> __il) : __list_() { insert(__il.begin(), __il.end()); }
+        
+        template <class _InputIterator>
+        threadsafe_skiplist_set(_InputIterator __f, _InputIterator __l) : __list_() { insert(__f, __l); }
+        
+        threadsafe_skiplist_set(const threadsafe_skiplist_set&) = delete;
+        threadsafe_skiplist_set& operator=(const threadsafe_skiplist_set&) = delete;
+        threadsafe_skiplist_set(threadsafe_skiplist_set&&) = delete;
+        threadsafe_skiplist_set& operator=(threadsafe_skiplist_set&&) = delete;
+        
+    private:
+        static std::pair<value_type, bool> __copy(__node* __n)
+        {
+            if (!__n)
+            {
+                return std::make_pair(value_type(), false);
+            }
+            return std::make_pair(__n->__key_, true);
+        }
+        
+    public:
+        bool empty() const
+        {
+            return __list_.size() == 0;
+        }
+        
+        size_type size() const
+        {
+            return __list_.size();
+        }
+        
+        set_type value()
+        {
+            set_type r;
+            for_each([&r](const value_type& __v) { r.emplace_hint(r.end(), __v); });
+            return r;
+        }
+        
+        template <class... _Args>
+        bool emplace(_Args&&... __args)
+        {
+            return __list_.try_emplace(value_type(std::forward<_Args>(__args)...));
+        }
+        
+        bool insert(const value_type& __v)
+        {
+            return __list_.try_emplace(__v);
+        }
+        
+        bool insert(value_type&& __v)
+        {
+            return __list_.try_emplace(std::move(__v));
+        }
+        
+        void insert(initializer_list<value_type> __il)
+        {
+            insert(__il.begin(), __il.end());
+        }
+        
+        template <class _InputIterator>
+        void insert(_InputIterator __f, _InputIterator __l)
+        {
+            for (; __f != __l; ++__f)
+            {
+                insert(*__f);
+            }
+        }
+        
+        bool contains(const key_type& __k)
+        {
+            __epoch_guard guard;
+            return __list_.__find_live(__k) != nullptr;
+        }
+        
+        size_type erase(const key_type& __k)
+        {
+            return __list_.erase(__k) ? 1 : 0;
+        }
+        
+        // Removes the elements one by one; concurrent inserts may survive.
+        void clear()
+        {
+            __epoch_guard guard;
+            for (__node* n = __list_.__first(); n; n = __list_type::__succ(n))
+            {
+                __list_.erase(n->__key_);
+            }
+        }
+        
+        std::pair<value_type, bool> lower_bound(const key_type& __k)
+        {
+            __epoch_guard guard;
+            return __copy(__list_.__lower_bound(__k, false));
+        }
+        
+        std::pair<value_type, bool> upper_bound(const key_type& __k)
+        {
+            __epoch_guard guard;
+            return __copy(__list_.__lower_bound(__k, true));
+        }
+        
+        template <typename _Function>
+        void for_each(_Function __bl)
+        {
+            __epoch_guard guard;
+            for (__node* n = __list_.__first(); n; n = __list_type::__succ(n))
+            {
+                __bl(static_cast<const value_type&>(n->__key_));
+            }
+        }
+        
+        // Visits the keys in [__lo, __hi) in order.
+        template <typename _Function>
+        void for_each_range(const key_type& __lo, const key_type& __hi, _Function __bl)
+        {
+            __epoch_guard guard;
+            for (__node* n = __list_.__lower_bound(__lo, false); n && __list_.__less(n->__key_, __hi); n = __list_type::__succ(n))
+            {
+                __bl(static_cast<const value_type&>(n->__key_));
+            }
+        }
+    };
+    
+    
+    namespace pmr
+    {
+        template <typename _Key, typename _Compare = less<_Key>, typename _Mutex = shared_timed_mutex>
+        using threadsafe_set = std::threadsafe_set<_Key, _Compare, polymorphic_allocator<_Key>, _Mutex>;
+        
+        template <typename _Key, typename _Compare = less<_Key>, typename _Mutex = shared_timed_mutex>
+        using threadsafe_multiset = std::threadsafe_multiset<_Key, _Compare, polymorphic_allocator<_Key>, _Mutex>;
+    }
 }
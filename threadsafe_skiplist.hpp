@@ -0,0 +1,554 @@
+//
+//  threadsafe_skiplist.hpp
+//  stl_extension
+//
+//  Created by Kingle Zhuang on 11/20/19.
+//  Copyright © 2019 RingCentral. All rights reserved.
+//
+
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <utility>
+#include <type_traits>
+#include "threadsafe_mutex.hpp"
+#include "threadsafe_reclamation.hpp"
+
+namespace std
+{
+    struct __skiplist_no_value {};
+    
+    // Lazy concurrent skip list (Herlihy, Lev, Luchangco and Shavit), the core
+    // of threadsafe_skiplist_map and threadsafe_skiplist_set. Searches and
+    // traversals take no locks; insert and erase lock only the predecessors
+    // whose links change, always in descending key order. A node is logically
+    // removed when it is marked and is unlinked right after, under the same
+    // locks. Values live in their own allocation so that a writer can swap in
+    // a new one while readers still copy the old one; unlinked nodes and
+    // replaced values are reclaimed through the epoch domain.
+    //
+    // The __find_live/__lower_bound/__first/__succ/__value accessors return
+    // raw nodes and must be called inside an __epoch_guard. Sets use
+    // __skiplist_no_value as _Tp and never allocate a value. The allocator has
+    // to be stateless.
+    template <class _Key, class _Tp, class _Compare, class _Allocator>
+    class __skiplist
+    {
+    public:
+        typedef _Key                                            key_type;
+        typedef _Tp                                             mapped_type;
+        typedef _Compare                                        key_compare;
+        typedef _Allocator                                      allocator_type;
+        typedef size_t                                          size_type;
+        
+        static constexpr int __max_level = 32;
+        
+        struct __node
+        {
+            key_type              __key_;
+            atomic<mapped_type*>  __value_;
+            threadsafe_spin_mutex __mutex_;
+            atomic<bool>          __marked_;
+            atomic<bool>          __linked_;
+            int                   __level_;
+            
+            template <class _Kp>
+            __node(_Kp&& __k, mapped_type* __v, int __level)
+                : __key_(std::forward<_Kp>(__k)), __value_(__v), __marked_(false), __linked_(false), __level_(__level) {}
+            
+            // The tower of next pointers is allocated right behind the node.
+            atomic<__node*>* __next()
+            {
+                return reinterpret_cast<atomic<__node*>*>(reinterpret_cast<unsigned char*>(this) + __tower_offset);
+            }
+            
+            bool __live() const
+            {
+                return __linked_.load(memory_order_acquire) && !__marked_.load(memory_order_acquire);
+            }
+        };
+        
+    private:
+        typedef typename allocator_traits<allocator_type>::template rebind_alloc<__node>      __node_allocator;
+        typedef allocator_traits<__node_allocator>                                           __node_traits;
+        typedef typename allocator_traits<allocator_type>::template rebind_alloc<mapped_type> __value_allocator;
+        typedef allocator_traits<__value_allocator>                                          __value_traits;
+        
+        static constexpr size_t __tower_align  = alignof(atomic<__node*>);
+        static constexpr size_t __tower_offset = (sizeof(__node) + __tower_align - 1) / __tower_align * __tower_align;
+        
+        key_compare           __comp_;
+        atomic<__node*>       __head_[__max_level];
+        threadsafe_spin_mutex __head_mutex_;
+        alignas(64) atomic<size_type> __size_;
+        
+    public:
+        __skiplist() : __comp_(), __size_(0)
+        {
+            for (auto& h : __head_)
+            {
+                h.store(nullptr, memory_order_relaxed);
+            }
+        }
+        
+        __skiplist(const __skiplist&) = delete;
+        __skiplist& operator=(const __skiplist&) = delete;
+        
+        ~__skiplist()
+        {
+            __node* n = __head_[0].load(memory_order_relaxed);
+            while (n)
+            {
+                __node* next = n->__next()[0].load(memory_order_relaxed);
+                __destroy(n);
+                n = next;
+            }
+        }
+        
+    private:
+        // The head is not a node: a null predecessor stands for it.
+        atomic<__node*>* __next(__node* __n)
+        {
+            return __n ? __n->__next() : __head_;
+        }
+        
+        threadsafe_spin_mutex& __mutex(__node* __n)
+        {
+            return __n ? __n->__mutex_ : __head_mutex_;
+        }
+        
+        static bool __is_marked(__node* __n)
+        {
+            return __n && __n->__marked_.load(memory_order_acquire);
+        }
+        
+        static size_type __units(int __level)
+        {
+            return (__tower_offset + __level * sizeof(atomic<__node*>) + sizeof(__node) - 1) / sizeof(__node);
+        }
+        
+        template <class... _Args>
+        static mapped_type* __make_value(_Args&&... __args)
+        {
+            if constexpr (is_same<mapped_type, __skiplist_no_value>::value)
+            {
+                return nullptr;
+            }
+            else
+            {
+                __value_allocator a;
+                mapped_type* v = __value_traits::allocate(a, 1);
+                try
+                {
+                    __value_traits::construct(a, v, std::forward<_Args>(__args)...);
+                }
+                catch (...)
+                {
+                    __value_traits::deallocate(a, v, 1);
+                    throw;
+                }
+                return v;
+            }
+        }
+        
+        static void __free_value(mapped_type* __v)
+        {
+            if (__v)
+            {
+                __value_allocator a;
+                __value_traits::destroy(a, __v);
+                __value_traits::deallocate(a, __v, 1);
+            }
+        }
+        
+        static void __reclaim_value(void* __p)
+        {
+            __free_value(static_cast<mapped_type*>(__p));
+        }
+        
+        // Takes ownership of __v, also when it throws.
+        template <class _Kp>
+        static __node* __create(_Kp&& __k, mapped_type* __v, int __level)
+        {
+            __node_allocator a;
+            size_type units = __units(__level);
+            __node* n = nullptr;
+            try
+            {
+                n = __node_traits::allocate(a, units);
+                ::new (static_cast<void*>(n)) __node(std::forward<_Kp>(__k), __v, __level);
+            }
+            catch (...)
+            {
+                if (n)
+                {
+                    __node_traits::deallocate(a, n, units);
+                }
+                __free_value(__v);
+                throw;
+            }
+            
+            atomic<__node*>* next = n->__next();
+            for (int i = 0; i < __level; ++i)
+            {
+                ::new (static_cast<void*>(next + i)) atomic<__node*>(nullptr);
+            }
+            return n;
+        }
+        
+        static void __destroy(__node* __n)
+        {
+            __free_value(__n->__value_.load(memory_order_relaxed));
+            size_type units = __units(__n->__level_);
+            __n->~__node();
+            
+            __node_allocator a;
+            __node_traits::deallocate(a, __n, units);
+        }
+        
+        static void __reclaim(void* __p)
+        {
+            __destroy(static_cast<__node*>(__p));
+        }
+        
+        static int __random_level()
+        {
+            static thread_local uint64_t seed = reinterpret_cast<uintptr_t>(&seed) | 1;
+            uint64_t x = seed;
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            seed = x;
+            
+            int level = 1;
+            while (level < __max_level && (x & 1))
+            {
+                ++level;
+                x >>= 1;
+            }
+            return level;
+        }
+        
+        // Fills the predecessor and successor of __k at every level and returns
+        // the highest level at which a node with key __k was found, or -1.
+        int __find(const key_type& __k, __node** __preds, __node** __succs)
+        {
+            int found = -1;
+            __node* pred = nullptr;
+            for (int l = __max_level - 1; l >= 0; --l)
+            {
+                __node* curr = __next(pred)[l].load(memory_order_acquire);
+                while (curr && __comp_(curr->__key_, __k))
+                {
+                    pred = curr;
+                    curr = pred->__next()[l].load(memory_order_acquire);
+                }
+                
+                if (found == -1 && curr && !__comp_(__k, curr->__key_))
+                {
+                    found = l;
+                }
+                __preds[l] = pred;
+                __succs[l] = curr;
+            }
+            return found;
+        }
+        
+        // Locks the distinct predecessors of levels [0, __level) bottom-up and
+        // validates that they are unmarked and still point at __succs. The
+        // locks taken are reported through __highest, also on failure.
+        bool __lock_preds(__node** __preds, __node** __succs, int __level, int& __highest, bool __succ_marked_ok)
+        {
+            __highest = -1;
+            for (int l = 0; l < __level; ++l)
+            {
+                __node* pred = __preds[l];
+                if (l == 0 || pred != __preds[l - 1])
+                {
+                    __mutex(pred).lock();
+                    __highest = l;
+                }
+                
+                if (__is_marked(pred) ||
+                    (!__succ_marked_ok && __is_marked(__succs[l])) ||
+                    __next(pred)[l].load(memory_order_acquire) != __succs[l])
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+        
+        void __unlock_preds(__node** __preds, int __highest)
+        {
+            for (int l = 0; l <= __highest; ++l)
+            {
+                if (l == 0 || __preds[l] != __preds[l - 1])
+                {
+                    __mutex(__preds[l]).unlock();
+                }
+            }
+        }
+        
+        bool __link(__node* __n, __node** __preds, __node** __succs)
+        {
+            int level = __n->__level_;
+            int highest;
+            bool valid = __lock_preds(__preds, __succs, level, highest, false);
+            if (valid)
+            {
+                for (int l = 0; l < level; ++l)
+                {
+                    __n->__next()[l].store(__succs[l], memory_order_relaxed);
+                }
+                for (int l = 0; l < level; ++l)
+                {
+                    __next(__preds[l])[l].store(__n, memory_order_release);
+                }
+                __n->__linked_.store(true, memory_order_release);
+                __size_.fetch_add(1, memory_order_relaxed);
+            }
+            __unlock_preds(__preds, highest);
+            return valid;
+        }
+        
+        static void __wait_linked(__node* __n)
+        {
+            while (!__n->__linked_.load(memory_order_acquire))
+            {
+                __threadsafe_relax();
+            }
+        }
+        
+        // Swaps in __v unless __n is being removed. Erase marks under the same
+        // node lock, so a replaced value can never be lost to a removal.
+        bool __replace(__node* __n, mapped_type* __v)
+        {
+            if (__n->__marked_.load(memory_order_acquire))
+            {
+                return false;
+            }
+            __wait_linked(__n);
+            
+            std::unique_lock<threadsafe_spin_mutex> lock(__n->__mutex_);
+            if (__n->__marked_.load(memory_order_relaxed))
+            {
+                return false;
+            }
+            mapped_type* old = __n->__value_.exchange(__v, memory_order_acq_rel);
+            lock.unlock();
+            
+            __epoch_domain::instance().retire(old, &__reclaim_value);
+            return true;
+        }
+        
+    public:
+        size_type size() const
+        {
+            return __size_.load(memory_order_relaxed);
+        }
+        
+        // Inserts __k with a value built from __args if it is absent; the
+        // value is only constructed when the node is actually created.
+        template <class _Kp, class... _Args>
+        bool try_emplace(_Kp&& __k, _Args&&... __args)
+        {
+            __epoch_guard guard;
+            __node* preds[__max_level];
+            __node* succs[__max_level];
+            __node* n = nullptr;
+            for (;;)
+            {
+                int found = __find(n ? n->__key_ : __k, preds, succs);
+                if (found != -1)
+                {
+                    __node* curr = succs[found];
+                    if (!curr->__marked_.load(memory_order_acquire))
+                    {
+                        __wait_linked(curr);
+                        if (n)
+                        {
+                            __destroy(n);
+                        }
+                        return false;
+                    }
+                    continue;
+                }
+                
+                if (!n)
+                {
+                    n = __create(std::forward<_Kp>(__k), __make_value(std::forward<_Args>(__args)...), __random_level());
+                }
+                if (__link(n, preds, succs))
+                {
+                    return true;
+                }
+            }
+        }
+        
+        template <class _Kp, class... _Args>
+        bool insert_or_assign(_Kp&& __k, _Args&&... __args)
+        {
+            __epoch_guard guard;
+            mapped_type* v = __make_value(std::forward<_Args>(__args)...);
+            __node* preds[__max_level];
+            __node* succs[__max_level];
+            __node* n = nullptr;
+            for (;;)
+            {
+                int found = __find(n ? n->__key_ : __k, preds, succs);
+                if (found != -1)
+                {
+                    if (__replace(succs[found], v))
+                    {
+                        if (n)
+                        {
+                            n->__value_.store(nullptr, memory_order_relaxed);
+                            __destroy(n);
+                        }
+                        return false;
+                    }
+                    continue;
+                }
+                
+                if (!n)
+                {
+                    n = __create(std::forward<_Kp>(__k), v, __random_level());
+                }
+                if (__link(n, preds, succs))
+                {
+                    return true;
+                }
+            }
+        }
+        
+        bool erase(const key_type& __k)
+        {
+            __epoch_guard guard;
+            __node* preds[__max_level];
+            __node* succs[__max_level];
+            __node* victim = nullptr;
+            int level = 0;
+            for (;;)
+            {
+                int found = __find(__k, preds, succs);
+                if (!victim)
+                {
+                    if (found == -1)
+                    {
+                        return false;
+                    }
+                    
+                    // Only a fully linked node found at its top level can be
+                    // removed; anything else is still being inserted or removed.
+                    __node* n = succs[found];
+                    if (!n->__linked_.load(memory_order_acquire) || n->__level_ - 1 != found || n->__marked_.load(memory_order_acquire))
+                    {
+                        return false;
+                    }
+                    
+                    n->__mutex_.lock();
+                    if (n->__marked_.load(memory_order_relaxed))
+                    {
+                        n->__mutex_.unlock();
+                        return false;
+                    }
+                    n->__marked_.store(true, memory_order_release);
+                    victim = n;
+                    level = n->__level_;
+                }
+                
+                int highest;
+                bool valid = __lock_preds(preds, succs, level, highest, true);
+                if (valid)
+                {
+                    for (int l = level - 1; l >= 0; --l)
+                    {
+                        __next(preds[l])[l].store(victim->__next()[l].load(memory_order_acquire), memory_order_release);
+                    }
+                }
+                __unlock_preds(preds, highest);
+                
+                if (valid)
+                {
+                    victim->__mutex_.unlock();
+                    __size_.fetch_sub(1, memory_order_relaxed);
+                    __epoch_domain::instance().retire(victim, &__reclaim);
+                    return true;
+                }
+            }
+        }
+        
+        __node* __find_live(const key_type& __k)
+        {
+            __node* pred = nullptr;
+            for (int l = __max_level - 1; l >= 0; --l)
+            {
+                __node* curr = __next(pred)[l].load(memory_order_acquire);
+                while (curr && __comp_(curr->__key_, __k))
+                {
+                    pred = curr;
+                    curr = pred->__next()[l].load(memory_order_acquire);
+                }
+                
+                if (curr && !__comp_(__k, curr->__key_))
+                {
+                    return curr->__live() ? curr : nullptr;
+                }
+            }
+            return nullptr;
+        }
+        
+        // First live node with a key not less than __k, or greater than __k
+        // when __strict is set. The answer is the node the bottom level
+        // stopped at: reloading pred's link could return a node inserted
+        // after pred since, whose key may still be below the bound.
+        __node* __lower_bound(const key_type& __k, bool __strict)
+        {
+            __node* pred = nullptr;
+            __node* curr = nullptr;
+            for (int l = __max_level - 1; l >= 0; --l)
+            {
+                curr = __next(pred)[l].load(memory_order_acquire);
+                while (curr && (__strict ? !__comp_(__k, curr->__key_) : __comp_(curr->__key_, __k)))
+                {
+                    pred = curr;
+                    curr = pred->__next()[l].load(memory_order_acquire);
+                }
+            }
+            return __skip_dead(curr);
+        }
+        
+        __node* __first()
+        {
+            return __skip_dead(__head_[0].load(memory_order_acquire));
+        }
+        
+        static __node* __succ(__node* __n)
+        {
+            return __skip_dead(__n->__next()[0].load(memory_order_acquire));
+        }
+        
+        static __node* __skip_dead(__node* __n)
+        {
+            while (__n && !__n->__live())
+            {
+                __n = __n->__next()[0].load(memory_order_acquire);
+            }
+            return __n;
+        }
+        
+        static const mapped_type& __value(__node* __n)
+        {
+            return *__n->__value_.load(memory_order_acquire);
+        }
+        
+        bool __less(const key_type& __a, const key_type& __b) const
+        {
+            return __comp_(__a, __b);
+        }
+    };
+}
@@ -10,20 +10,27 @@
 
 #include <stack>
 #include <mutex>
+#include <atomic>
 #include <memory>
+#include <cstdint>
+#include <optional>
+#include <utility>
 #include <functional>
 #include <shared_mutex>
+#include "threadsafe_mutex.hpp"
+#include "threadsafe_read_view.hpp"
+#include "threadsafe_reclamation.hpp"
 
 namespace std
 {
-    template <typename _Tp, typename _Container = deque<_Tp>>
+    template <typename _Tp, typename _Container = deque<_Tp>, typename _Mutex = shared_timed_mutex>
     class threadsafe_stack
     {
     private:
         typedef std::stack<_Tp, _Container> __stack_type;
         
-        mutable std::shared_timed_mutex __mutex_;
-        __stack_type __internal_stack_;
+        mutable _Mutex __mutex_;
+        shared_ptr<__stack_type> __internal_stack_;
         
     public:
         typedef          __stack_type                  stack_type;
@@ -32,48 +39,497 @@ namespace std
         typedef typename __stack_type::reference       reference;
         typedef typename __stack_type::const_reference const_reference;
         typedef typename __stack_type::size_type       size_type;
+        typedef          _Mutex                        mutex_type;
         
     public:
-        threadsafe_stack() : __internal_stack_() {}
-        threadsafe_stack(const stack_type& __s) : __internal_stack_(__s) {}
-        threadsafe_stack(stack_type&& __s) : __internal_stack_(std::move(__s)) {}
-        explicit threadsafe_stack(const container_type& __c) : __internal_stack_(__c) {}
-        explicit threadsafe_stack(container_type&& __c) : __internal_stack_(std::move(__c)) {}
+        threadsafe_stack() : __internal_stack_(std::make_shared<__stack_type>()) {}
+        threadsafe_stack(const stack_type& __s) : __internal_stack_(std::make_shared<__stack_type>(__s)) {}
+        threadsafe_stack(stack_type&& __s) : __internal_stack_(std::make_shared<__stack_type>(std::move(__s))) {}
+        explicit threadsafe_stack(const container_type& __c) : __internal_stack_(std::make_shared<__stack_type>(__c)) {}
+        explicit threadsafe_stack(container_type&& __c) : __internal_stack_(std::make_shared<__stack_type>(std::move(__c))) {}
         
         threadsafe_stack(const threadsafe_stack&) = delete;
         threadsafe_stack& operator=(const threadsafe_stack&) = delete;
         threadsafe_stack(threadsafe_stack&&) = delete;
         threadsafe_stack& operator=(threadsafe_stack&&) = delete;
         
+    private:
+        // Called under the unique lock before every write; copies the stack if
+        // a snapshot still refers to it.
+        void __detach()
+        {
+            if (__internal_stack_.use_count() > 1)
+            {
+                __internal_stack_ = std::make_shared<__stack_type>(*__internal_stack_);
+            }
+            else
+            {
+                atomic_thread_fence(memory_order_acquire);
+            }
+        }
+        
     public:
         bool empty() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_stack_.empty();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_stack_->empty();
         }
         
         size_type size() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_stack_.size();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_stack_->size();
+        }
+        
+        std::shared_ptr<const stack_type> snapshot() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_stack_;
+        }
+        
+        threadsafe_read_view<stack_type, mutex_type> read() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return threadsafe_read_view<stack_type, mutex_type>(std::move(lock), __internal_stack_.get());
         }
         
         const value_type& top()
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return static_cast<const value_type&>(__internal_stack_.top());
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return static_cast<const value_type&>(__internal_stack_->top());
         }
         
         void push(const value_type& __x)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_stack_.push(__x);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_stack_->push(__x);
+        }
+        
+        void push(value_type&& __x)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_stack_->push(std::move(__x));
+        }
+        
+        template <class... _Args>
+        void emplace(_Args&&... __args)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_stack_->emplace(std::forward<_Args>(__args)...);
         }
         
         void pop()
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_stack_.pop();
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_stack_->pop();
+        }
+        
+        bool try_pop(value_type& __v)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            if (__internal_stack_->empty())
+            {
+                return false;
+            }
+            
+            __detach();
+            __v = std::move(__internal_stack_->top());
+            __internal_stack_->pop();
+            return true;
+        }
+        
+        std::optional<value_type> try_pop()
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            if (__internal_stack_->empty())
+            {
+                return std::nullopt;
+            }
+            
+            __detach();
+            std::optional<value_type> r(std::move(__internal_stack_->top()));
+            __internal_stack_->pop();
+            return r;
+        }
+        
+        template <class _OutputIterator>
+        size_type pop_n(_OutputIterator __out, size_type __n)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            if (__n == 0 || __internal_stack_->empty())
+            {
+                return 0;
+            }
+            
+            __detach();
+            size_type i = 0;
+            for (; i < __n && !__internal_stack_->empty(); ++i)
+            {
+                *__out++ = std::move(__internal_stack_->top());
+                __internal_stack_->pop();
+            }
+            return i;
+        }
+    };
+    
+    
+    // Lock-free variant of threadsafe_stack: a Treiber stack whose top pointer
+    // is swung with CAS. Popped nodes are retired through the epoch domain, so
+    // a node cannot be freed and reused while another thread still holds it,
+    // which also rules out ABA on the top pointer. A push or pop that loses the
+    // CAS backs off into an elimination array, where a pending push can hand
+    // its node straight to a concurrent pop without touching the top at all.
+    // There is no top(): the element may be popped and destroyed by another
+    // thread as soon as it is observed. The allocator has to be stateless.
+    template <typename _Tp, typename _Allocator = allocator<_Tp>>
+    class threadsafe_lockfree_stack
+    {
+    public:
+        typedef _Tp                                             value_type;
+        typedef _Allocator                                      allocator_type;
+        typedef value_type&                                     reference;
+        typedef const value_type&                               const_reference;
+        typedef size_t                                          size_type;
+        
+    private:
+        struct __node
+        {
+            __node*    __next_;
+            value_type __value_;
+            
+            template <class... _Args>
+            explicit __node(_Args&&... __args) : __next_(nullptr), __value_(std::forward<_Args>(__args)...) {}
+        };
+        
+        struct alignas(64) __slot
+        {
+            atomic<__node*> __node_;
+            
+            __slot() : __node_(nullptr) {}
+        };
+        
+        // Per-thread elimination state: a xorshift seed for picking a slot and
+        // the width of the slot range in use, which shrinks when offers time
+        // out and widens when slots are found busy.
+        struct __exchanger
+        {
+            uint32_t __seed_  = 0x9E3779B9u;
+            unsigned __range_ = 1;
+        };
+        
+        typedef typename allocator_traits<allocator_type>::template rebind_alloc<__node> __node_allocator;
+        typedef allocator_traits<__node_allocator>                                      __node_traits;
+        
+        static constexpr unsigned __elimination_width = 16;
+        static constexpr unsigned __elimination_spins = 128;
+        
+        alignas(64) atomic<__node*> __top_;
+        alignas(64) atomic<ptrdiff_t> __size_;
+        __slot __slots_[__elimination_width];
+        
+    public:
+        threadsafe_lockfree_stack() : __top_(nullptr), __size_(0) {}
+        
+        threadsafe_lockfree_stack(initializer_list<value_type> __il) : threadsafe_lockfree_stack()
+        {
+            for (const auto& v : __il)
+            {
+                push(v);
+            }
+        }
+        
+        template <class _InputIterator>
+        threadsafe_lockfree_stack(_InputIterator __f, _InputIterator __l) : threadsafe_lockfree_stack()
+        {
+            for (; __f != __l; ++__f)
+            {
+                push(*__f);
+            }
+        }
+        
+        threadsafe_lockfree_stack(const threadsafe_lockfree_stack&) = delete;
+        threadsafe_lockfree_stack& operator=(const threadsafe_lockfree_stack&) = delete;
+        threadsafe_lockfree_stack(threadsafe_lockfree_stack&&) = delete;
+        threadsafe_lockfree_stack& operator=(threadsafe_lockfree_stack&&) = delete;
+        
+        ~threadsafe_lockfree_stack()
+        {
+            __node* n = __top_.load(memory_order_relaxed);
+            while (n)
+            {
+                __node* next = n->__next_;
+                __destroy(n);
+                n = next;
+            }
+        }
+        
+    private:
+        template <class... _Args>
+        static __node* __create(_Args&&... __args)
+        {
+            __node_allocator a;
+            __node* n = __node_traits::allocate(a, 1);
+            try
+            {
+                __node_traits::construct(a, n, std::forward<_Args>(__args)...);
+            }
+            catch (...)
+            {
+                __node_traits::deallocate(a, n, 1);
+                throw;
+            }
+            return n;
+        }
+        
+        static void __destroy(__node* __n)
+        {
+            __node_allocator a;
+            __node_traits::destroy(a, __n);
+            __node_traits::deallocate(a, __n, 1);
+        }
+        
+        static void __reclaim(void* __p)
+        {
+            __destroy(static_cast<__node*>(__p));
+        }
+        
+        static __exchanger& __local()
+        {
+            static thread_local __exchanger ex;
+            return ex;
+        }
+        
+        __slot& __pick(__exchanger& __ex)
+        {
+            uint32_t x = __ex.__seed_;
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            __ex.__seed_ = x;
+            return __slots_[x % __ex.__range_];
+        }
+        
+        static void __widen(__exchanger& __ex)
+        {
+            if (__ex.__range_ < __elimination_width)
+            {
+                __ex.__range_ <<= 1;
+            }
+        }
+        
+        static void __narrow(__exchanger& __ex)
+        {
+            if (__ex.__range_ > 1)
+            {
+                __ex.__range_ >>= 1;
+            }
+        }
+        
+        // Offers __n in a free slot and waits for a pop to take it. Returns
+        // true if the node was handed over, false if it is still ours.
+        bool __offer(__node* __n)
+        {
+            __exchanger& ex = __local();
+            __slot& slot = __pick(ex);
+            
+            __node* expected = nullptr;
+            if (!slot.__node_.compare_exchange_strong(expected, __n, memory_order_release, memory_order_relaxed))
+            {
+                __widen(ex);
+                return false;
+            }
+            
+            for (unsigned i = 0; i < __elimination_spins; ++i)
+            {
+                if (slot.__node_.load(memory_order_relaxed) != __n)
+                {
+                    return true;
+                }
+                __threadsafe_relax();
+            }
+            
+            expected = __n;
+            if (slot.__node_.compare_exchange_strong(expected, nullptr, memory_order_relaxed, memory_order_relaxed))
+            {
+                __narrow(ex);
+                return false;
+            }
+            return true;
+        }
+        
+        // Takes a node offered by a concurrent push, if there is one.
+        __node* __accept()
+        {
+            __exchanger& ex = __local();
+            __slot& slot = __pick(ex);
+            
+            __node* n = slot.__node_.load(memory_order_relaxed);
+            if (n && slot.__node_.compare_exchange_strong(n, nullptr, memory_order_acquire, memory_order_relaxed))
+            {
+                return n;
+            }
+            
+            if (n)
+            {
+                __widen(ex);
+            }
+            else
+            {
+                __narrow(ex);
+            }
+            return nullptr;
+        }
+        
+        void __push(__node* __n)
+        {
+            __node* top = __top_.load(memory_order_relaxed);
+            for (;;)
+            {
+                __n->__next_ = top;
+                if (__top_.compare_exchange_weak(top, __n, memory_order_release, memory_order_relaxed))
+                {
+                    __size_.fetch_add(1, memory_order_relaxed);
+                    return;
+                }
+                
+                if (__offer(__n))
+                {
+                    return;
+                }
+                top = __top_.load(memory_order_relaxed);
+            }
+        }
+        
+        // Unlinks a node from the top or takes one from the elimination array.
+        // The caller owns the returned node; a node unlinked from the top may
+        // still be read by other threads and has to be retired, not destroyed,
+        // which is reported through __shared.
+        __node* __pop(bool& __shared)
+        {
+            __epoch_guard guard;
+            __node* top = __top_.load(memory_order_acquire);
+            for (;;)
+            {
+                if (!top)
+                {
+                    return nullptr;
+                }
+                
+                if (__top_.compare_exchange_weak(top, top->__next_, memory_order_acquire, memory_order_acquire))
+                {
+                    __size_.fetch_sub(1, memory_order_relaxed);
+                    __shared = true;
+                    return top;
+                }
+                
+                if (__node* n = __accept())
+                {
+                    __shared = false;
+                    return n;
+                }
+                top = __top_.load(memory_order_acquire);
+            }
+        }
+        
+        void __release(__node* __n, bool __shared)
+        {
+            if (__shared)
+            {
+                __epoch_domain::instance().retire(__n, &__reclaim);
+            }
+            else
+            {
+                __destroy(__n);
+            }
+        }
+        
+    public:
+        bool empty() const
+        {
+            return __top_.load(memory_order_relaxed) == nullptr;
+        }
+        
+        // Approximate under concurrent modification.
+        size_type size() const
+        {
+            ptrdiff_t n = __size_.load(memory_order_relaxed);
+            return n > 0 ? size_type(n) : 0;
+        }
+        
+        void push(const value_type& __x)
+        {
+            __push(__create(__x));
+        }
+        
+        void push(value_type&& __x)
+        {
+            __push(__create(std::move(__x)));
+        }
+        
+        template <class... _Args>
+        void emplace(_Args&&... __args)
+        {
+            __push(__create(std::forward<_Args>(__args)...));
+        }
+        
+        void pop()
+        {
+            bool shared = false;
+            if (__node* n = __pop(shared))
+            {
+                __release(n, shared);
+            }
+        }
+        
+        bool try_pop(value_type& __v)
+        {
+            bool shared = false;
+            __node* n = __pop(shared);
+            if (!n)
+            {
+                return false;
+            }
+            
+            __v = std::move(n->__value_);
+            __release(n, shared);
+            return true;
+        }
+        
+        std::optional<value_type> try_pop()
+        {
+            bool shared = false;
+            __node* n = __pop(shared);
+            if (!n)
+            {
+                return std::nullopt;
+            }
+            
+            std::optional<value_type> r(std::move(n->__value_));
+            __release(n, shared);
+            return r;
+        }
+        
+        template <class _OutputIterator>
+        size_type pop_n(_OutputIterator __out, size_type __n)
+        {
+            size_type i = 0;
+            for (; i < __n; ++i)
+            {
+                bool shared = false;
+                __node* n = __pop(shared);
+                if (!n)
+                {
+                    break;
+                }
+                
+                *__out++ = std::move(n->__value_);
+                __release(n, shared);
+            }
+            return i;
         }
     };
 }
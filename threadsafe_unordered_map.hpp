@@ -9,11 +9,22 @@
 #pragma once
 
 #include <mutex>
+#include <atomic>
+#include <tuple>
+#include <vector>
 #include <memory>
+#include <thread>
+#include <cstdint>
 #include <utility>
+#include <optional>
+#include <algorithm>
 #include <functional>
 #include <shared_mutex>
+#include <memory_resource>
 #include <unordered_map>
+#include "threadsafe_mutex.hpp"
+#include "threadsafe_parallel.hpp"
+#include "threadsafe_read_view.hpp"
 
 namespace std
 {
@@ -21,7 +32,8 @@ namespace std
               typename _Key, typename _Tp,
               typename _Hash = hash<_Key>,
               typename _Pred = equal_to<_Key>,
-              typename _Alloc = allocator<pair<const _Key, _Tp>>
+              typename _Alloc = allocator<pair<const _Key, _Tp>>,
+              typename _Mutex = shared_timed_mutex
              >
     class threadsafe_unordered_map
     {
@@ -31,14 +43,15 @@ namespace std
         typedef _Hash                                          hasher;
         typedef _Pred                                          key_equal;
         typedef _Alloc                                         allocator_type;
+        typedef _Mutex                                         mutex_type;
         typedef pair<const key_type, mapped_type>              value_type;
         typedef value_type&                                    reference;
         typedef const value_type&                              const_reference;
 
     private:
         typedef std::unordered_map<key_type, mapped_type, hasher, key_equal, allocator_type> __map_type;
-        mutable std::shared_timed_mutex __mutex_;
-        __map_type __internal_map_;
+        mutable _Mutex __mutex_;
+        shared_ptr<__map_type> __internal_map_;
     
     public:
         typedef          __map_type                         map_type;
@@ -52,105 +65,297 @@ namespace std
         typedef typename __map_type::const_local_iterator   const_local_iterator;
     
     public:
-        threadsafe_unordered_map() : __internal_map_() {}
-        threadsafe_unordered_map(const map_type& __m) : __internal_map_(__m) {}
-        threadsafe_unordered_map(map_type&& __m) : __internal_map_(std::move(__m)) {}
-        threadsafe_unordered_map(initializer_list<value_type> __il) : __internal_map_(__il) {}
+        threadsafe_unordered_map() : __internal_map_(std::make_shared<__map_type>()) {}
+        explicit threadsafe_unordered_map(const allocator_type& __a) : __internal_map_(std::make_shared<__map_type>(__a)) {}
+        threadsafe_unordered_map(const map_type& __m) : __internal_map_(std::make_shared<__map_type>(__m)) {}
+        threadsafe_unordered_map(map_type&& __m) : __internal_map_(std::make_shared<__map_type>(std::move(__m))) {}
+        threadsafe_unordered_map(initializer_list<value_type> __il) : __internal_map_(std::make_shared<__map_type>(__il)) {}
         
         template <class _InputIterator>
-        threadsafe_unordered_map(_InputIterator __f, _InputIterator __l) : __internal_map_(__f, __l) {}
+        threadsafe_unordered_map(_InputIterator __f, _InputIterator __l) : __internal_map_(std::make_shared<__map_type>(__f, __l)) {}
         
         threadsafe_unordered_map(const threadsafe_unordered_map&) = delete;
         threadsafe_unordered_map& operator=(const threadsafe_unordered_map&) = delete;
         threadsafe_unordered_map(threadsafe_unordered_map&&) = delete;
         threadsafe_unordered_map& operator=(threadsafe_unordered_map&&) = delete;
     
+    private:
+        // Called under the unique lock before every write. The map is copied
+        // only if a snapshot still refers to it.
+        void __detach(bool __copy = true)
+        {
+            if (__internal_map_.use_count() > 1)
+            {
+                __internal_map_ = __copy ? std::make_shared<__map_type>(*__internal_map_, __internal_map_->get_allocator())
+                                         : std::make_shared<__map_type>(__internal_map_->get_allocator());
+            }
+            else
+            {
+                atomic_thread_fence(memory_order_acquire);
+            }
+        }
+        
+        template <class _Op>
+        auto __parallel(_Op __op)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            const __map_type& c = *__internal_map_;
+            auto visit = [&c](size_t __f, size_t __l, auto& __bl)
+            {
+                for (; __f < __l; ++__f)
+                {
+                    for (auto it = c.begin(__f); it != c.end(__f); ++it)
+                    {
+                        __bl(*it);
+                    }
+                }
+            };
+            return __op(c.bucket_count(), __parallel_pieces(c.bucket_count()), visit);
+        }
+        
     public:
+        allocator_type get_allocator() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_map_->get_allocator();
+        }
+        
         bool empty() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_map_.empty();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_map_->empty();
         }
         
         size_type size() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_map_.size();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_map_->size();
         }
         
         size_type max_size() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_map_.max_size();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_map_->max_size();
         }
         
         void operator=(const map_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_map_ = __v;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            *__internal_map_ = __v;
         }
         
-        void operator=(initializer_list<map_type> __il)
+        void operator=(initializer_list<value_type> __il)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_map_ = __il;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            *__internal_map_ = __il;
         }
         
         map_type value()
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return *__internal_map_;
+        }
+        
+        std::shared_ptr<const map_type> snapshot() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
             return __internal_map_;
         }
         
+        threadsafe_read_view<map_type, mutex_type> read() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return threadsafe_read_view<map_type, mutex_type>(std::move(lock), __internal_map_.get());
+        }
+        
+        threadsafe_read_view<mapped_type, mutex_type> read(const key_type& __k) const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            auto it = __internal_map_->find(__k);
+            const mapped_type* p = it == __internal_map_->end() ? nullptr : &it->second;
+            return threadsafe_read_view<mapped_type, mutex_type>(std::move(lock), p);
+        }
+        
         template <class... _Args>
         bool emplace(_Args&&... __args)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_map_.emplace(std::forward<_Args>(__args)...).second;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_map_->emplace(std::forward<_Args>(__args)...).second;
         }
         
         bool insert(const value_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_map_.insert(__v).second;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_map_->insert(__v).second;
+        }
+        
+        bool insert(value_type&& __v)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_map_->insert(std::move(__v)).second;
         }
         
         void insert(initializer_list<value_type> __il)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_map_.insert(__il);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_map_->insert(__il);
         }
         
         template <class _InputIterator>
         void insert(_InputIterator __f, _InputIterator __l)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_map_.insert(__f, __l);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_map_->insert(__f, __l);
         }
         
         const mapped_type& operator[](const key_type& __k)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_map_[__k];
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return (*__internal_map_)[__k];
         }
         
         const mapped_type& at(const key_type& __k)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_map_.at(__k);
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_map_->at(__k);
         }
         
         void set(const key_type& __k, const mapped_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_map_[__k] = __v;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            (*__internal_map_)[__k] = __v;
+        }
+        
+        void set(const key_type& __k, mapped_type&& __v)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            (*__internal_map_)[__k] = std::move(__v);
+        }
+        
+        template <class... _Args>
+        bool try_emplace(const key_type& __k, _Args&&... __args)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_map_->try_emplace(__k, std::forward<_Args>(__args)...).second;
+        }
+        
+        template <class... _Args>
+        bool try_emplace(key_type&& __k, _Args&&... __args)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_map_->try_emplace(std::move(__k), std::forward<_Args>(__args)...).second;
+        }
+        
+        template <class _Vp>
+        bool insert_or_assign(const key_type& __k, _Vp&& __v)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_map_->insert_or_assign(__k, std::forward<_Vp>(__v)).second;
+        }
+        
+        template <class _Vp>
+        bool insert_or_assign(key_type&& __k, _Vp&& __v)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_map_->insert_or_assign(std::move(__k), std::forward<_Vp>(__v)).second;
+        }
+        
+        // Read-modify-write helpers: the callable runs on the stored value in
+        // place under one exclusive lock. Each returns whether the key was found
+        // (update, compute_if_present) or inserted (the others).
+        template <class _Function>
+        bool update(const key_type& __k, _Function __fn)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            auto it = __internal_map_->find(__k);
+            if (it == __internal_map_->end())
+            {
+                return false;
+            }
+            
+            __fn(it->second);
+            return true;
+        }
+        
+        // __fn returns false to erase the entry.
+        template <class _Function>
+        bool compute_if_present(const key_type& __k, _Function __fn)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            auto it = __internal_map_->find(__k);
+            if (it == __internal_map_->end())
+            {
+                return false;
+            }
+            
+            if (!__fn(it->second))
+            {
+                __internal_map_->erase(it);
+            }
+            return true;
+        }
+        
+        // __factory is only called when the key is missing.
+        template <class _Factory>
+        bool compute_if_absent(const key_type& __k, _Factory __factory)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            if (__internal_map_->find(__k) != __internal_map_->end())
+            {
+                return false;
+            }
+            
+            __internal_map_->emplace(__k, __factory());
+            return true;
+        }
+        
+        // Inserts __v, or folds it into the stored value with __combiner(stored, __v).
+        template <class _Vp, class _Combiner>
+        bool merge(const key_type& __k, _Vp&& __v, _Combiner __combiner)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            auto r = __internal_map_->try_emplace(__k, std::forward<_Vp>(__v));
+            if (!r.second)
+            {
+                __combiner(r.first->second, std::forward<_Vp>(__v));
+            }
+            return r.second;
+        }
+        
+        // Runs __fn on the stored value, default-constructing it first if needed.
+        template <class _Function>
+        bool upsert(const key_type& __k, _Function __fn)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            auto r = __internal_map_->try_emplace(__k);
+            __fn(r.first->second);
+            return r.second;
         }
         
         const std::pair<const mapped_type, bool> get(const key_type& __k)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            auto it = __internal_map_.find(__k);
-            if (it == __internal_map_.end())
+            std::shared_lock<mutex_type> lock(__mutex_);
+            auto it = __internal_map_->find(__k);
+            if (it == __internal_map_->end())
             {
                 return std::make_pair(mapped_type(), false);
             }
@@ -162,31 +367,156 @@ namespace std
         
         void clear()
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_map_.clear();
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            __internal_map_->clear();
         }
         
         bool contains(const key_type& __k)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            auto it = __internal_map_.find(__k);
-            return it != __internal_map_.end();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            auto it = __internal_map_->find(__k);
+            return it != __internal_map_->end();
         }
         
         size_type erase(const key_type& __k)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_map_.erase(__k);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_map_->erase(__k);
+        }
+        
+        // Batched lookups under a single lock acquisition. One
+        // std::optional<mapped_type> is written to __out per key, in input
+        // order, and the number of hits is returned.
+        template <class _InputIterator, class _OutputIterator>
+        size_type get_many(_InputIterator __f, _InputIterator __l, _OutputIterator __out)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            size_type hits = 0;
+            for (; __f != __l; ++__f)
+            {
+                auto it = __internal_map_->find(*__f);
+                if (it == __internal_map_->end())
+                {
+                    *__out++ = std::optional<mapped_type>();
+                }
+                else
+                {
+                    *__out++ = std::optional<mapped_type>(it->second);
+                    ++hits;
+                }
+            }
+            return hits;
+        }
+        
+        // Assigns every (key, value) pair of the range; returns how many keys were new.
+        template <class _InputIterator>
+        size_type set_many(_InputIterator __f, _InputIterator __l)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            size_type inserted = 0;
+            for (; __f != __l; ++__f)
+            {
+                inserted += __internal_map_->insert_or_assign(__f->first, __f->second).second;
+            }
+            return inserted;
+        }
+        
+        template <class _InputIterator>
+        size_type erase_many(_InputIterator __f, _InputIterator __l)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            size_type erased = 0;
+            for (; __f != __l; ++__f)
+            {
+                erased += __internal_map_->erase(*__f);
+            }
+            return erased;
         }
         
-        void for_each(std::function<void(const value_type&)> __bl)
+        template <typename _Function>
+        void for_each(_Function __bl)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            for (const auto& v : __internal_map_)
+            std::shared_lock<mutex_type> lock(__mutex_);
+            for (const auto& v : *__internal_map_)
             {
                 __bl(v);
             }
         }
+        
+        // Chunked traversal that releases the lock between calls:
+        //
+        //     scan_cursor c;
+        //     while (!c.done()) m.scan(c, 1024, fn);
+        //
+        // The cursor is a bucket index and every call finishes the buckets it
+        // starts, so __count may be exceeded by up to one bucket. Elements
+        // present for the whole scan are always visited. If the table was
+        // rehashed since the previous call the scan restarts from bucket 0,
+        // so elements may then be visited more than once, and a table that
+        // keeps growing between calls can keep a scan from ever finishing.
+        // Callers that need it to terminate should bound the number of calls.
+        class scan_cursor
+        {
+            friend class threadsafe_unordered_map;
+            
+            size_type __bucket_ = 0;
+            size_type __bucket_count_ = 0;
+            bool __done_ = false;
+            
+        public:
+            bool done() const { return __done_; }
+        };
+        
+        template <typename _Function>
+        size_type scan(scan_cursor& __c, size_type __count, _Function __bl)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            if (__c.__done_)
+            {
+                return 0;
+            }
+            
+            size_type bc = __internal_map_->bucket_count();
+            if (__c.__bucket_count_ != bc)
+            {
+                __c.__bucket_ = 0;
+                __c.__bucket_count_ = bc;
+            }
+            
+            size_type n = 0;
+            for (; n < __count && __c.__bucket_ < bc; ++__c.__bucket_)
+            {
+                for (auto it = __internal_map_->begin(__c.__bucket_); it != __internal_map_->end(__c.__bucket_); ++it, ++n)
+                {
+                    __bl(*it);
+                }
+            }
+            __c.__done_ = __c.__bucket_ == bc;
+            return n;
+        }
+        
+        // Pieces are ranges of buckets; see threadsafe_vector::parallel_for_each.
+        template <typename _Function>
+        void parallel_for_each(_Function __bl)
+        {
+            __parallel([&](size_t __units, size_t __pieces, auto& __visit) { __parallel_for_each(__units, __pieces, __visit, __bl); });
+        }
+        
+        template <typename _Result, typename _Accumulate, typename _Combine>
+        _Result parallel_reduce(_Result __identity, _Accumulate __acc, _Combine __comb)
+        {
+            return __parallel([&](size_t __units, size_t __pieces, auto& __visit) { return __parallel_reduce(__units, __pieces, __visit, std::move(__identity), __acc, __comb); });
+        }
+        
+        template <typename _Predicate>
+        size_type parallel_count_if(_Predicate __pred)
+        {
+            return __parallel([&](size_t __units, size_t __pieces, auto& __visit) { return __parallel_count_if(__units, __pieces, __visit, __pred); });
+        }
     };
     
     
@@ -194,7 +524,8 @@ namespace std
               typename _Key, typename _Tp,
               typename _Hash = hash<_Key>,
               typename _Pred = equal_to<_Key>,
-              typename _Alloc = allocator<pair<const _Key, _Tp>>
+              typename _Alloc = allocator<pair<const _Key, _Tp>>,
+              typename _Mutex = shared_timed_mutex
              >
     class threadsafe_unordered_multimap
     {
@@ -204,14 +535,15 @@ namespace std
         typedef _Hash                                          hasher;
         typedef _Pred                                          key_equal;
         typedef _Alloc                                         allocator_type;
+        typedef _Mutex                                         mutex_type;
         typedef pair<const key_type, mapped_type>              value_type;
         typedef value_type&                                    reference;
         typedef const value_type&                              const_reference;
         
     private:
         typedef std::unordered_multimap<key_type, mapped_type, hasher, key_equal, allocator_type> __map_type;
-        mutable std::shared_timed_mutex __mutex_;
-        __map_type __internal_map_;
+        mutable _Mutex __mutex_;
+        shared_ptr<__map_type> __internal_map_;
         
     public:
         typedef          __map_type                         map_type;
@@ -225,87 +557,151 @@ namespace std
         typedef typename __map_type::const_local_iterator   const_local_iterator;
         
     public:
-        threadsafe_unordered_multimap() : __internal_map_() {}
-        threadsafe_unordered_multimap(const map_type& __m) : __internal_map_(__m) {}
-        threadsafe_unordered_multimap(map_type&& __m) : __internal_map_(std::move(__m)) {}
-        threadsafe_unordered_multimap(initializer_list<value_type> __il) : __internal_map_(__il) {}
+        threadsafe_unordered_multimap() : __internal_map_(std::make_shared<__map_type>()) {}
+        explicit threadsafe_unordered_multimap(const allocator_type& __a) : __internal_map_(std::make_shared<__map_type>(__a)) {}
+        threadsafe_unordered_multimap(const map_type& __m) : __internal_map_(std::make_shared<__map_type>(__m)) {}
+        threadsafe_unordered_multimap(map_type&& __m) : __internal_map_(std::make_shared<__map_type>(std::move(__m))) {}
+        threadsafe_unordered_multimap(initializer_list<value_type> __il) : __internal_map_(std::make_shared<__map_type>(__il)) {}
         
         template <class _InputIterator>
-        threadsafe_unordered_multimap(_InputIterator __f, _InputIterator __l) : __internal_map_(__f, __l) {}
+        threadsafe_unordered_multimap(_InputIterator __f, _InputIterator __l) : __internal_map_(std::make_shared<__map_type>(__f, __l)) {}
         
         threadsafe_unordered_multimap(const threadsafe_unordered_multimap&) = delete;
         threadsafe_unordered_multimap& operator=(const threadsafe_unordered_multimap&) = delete;
         threadsafe_unordered_multimap(threadsafe_unordered_multimap&&) = delete;
         threadsafe_unordered_multimap& operator=(threadsafe_unordered_multimap&&) = delete;
         
+    private:
+        void __detach(bool __copy = true)
+        {
+            if (__internal_map_.use_count() > 1)
+            {
+                __internal_map_ = __copy ? std::make_shared<__map_type>(*__internal_map_, __internal_map_->get_allocator())
+                                         : std::make_shared<__map_type>(__internal_map_->get_allocator());
+            }
+            else
+            {
+                atomic_thread_fence(memory_order_acquire);
+            }
+        }
+        
+        template <class _Op>
+        auto __parallel(_Op __op)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            const __map_type& c = *__internal_map_;
+            auto visit = [&c](size_t __f, size_t __l, auto& __bl)
+            {
+                for (; __f < __l; ++__f)
+                {
+                    for (auto it = c.begin(__f); it != c.end(__f); ++it)
+                    {
+                        __bl(*it);
+                    }
+                }
+            };
+            return __op(c.bucket_count(), __parallel_pieces(c.bucket_count()), visit);
+        }
+        
     public:
+        allocator_type get_allocator() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_map_->get_allocator();
+        }
+        
         bool empty() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_map_.empty();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_map_->empty();
         }
         
         size_type size() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_map_.size();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_map_->size();
         }
         
         size_type max_size() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_map_.max_size();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_map_->max_size();
         }
         
         void operator=(const map_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_map_ = __v;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            *__internal_map_ = __v;
         }
         
-        void operator=(initializer_list<map_type> __il)
+        void operator=(initializer_list<value_type> __il)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_map_ = __il;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            *__internal_map_ = __il;
         }
         
         map_type value()
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return *__internal_map_;
+        }
+        
+        std::shared_ptr<const map_type> snapshot() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
             return __internal_map_;
         }
         
+        threadsafe_read_view<map_type, mutex_type> read() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return threadsafe_read_view<map_type, mutex_type>(std::move(lock), __internal_map_.get());
+        }
+        
         template <class... _Args>
         void emplace(_Args&&... __args)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_map_.emplace(std::forward<_Args>(__args)...);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_map_->emplace(std::forward<_Args>(__args)...);
         }
         
         void insert(const value_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_map_.insert(__v);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_map_->insert(__v);
+        }
+        
+        void insert(value_type&& __v)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_map_->insert(std::move(__v));
         }
         
         void insert(initializer_list<value_type> __il)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_map_.insert(__il);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_map_->insert(__il);
         }
         
         template <class _InputIterator>
         void insert(_InputIterator __f, _InputIterator __l)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_map_.insert(__f, __l);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_map_->insert(__f, __l);
         }
         
         const std::pair<const mapped_type, bool> get(const key_type& __k)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            auto it = __internal_map_.find(__k);
-            if (it == __internal_map_.end())
+            std::shared_lock<mutex_type> lock(__mutex_);
+            auto it = __internal_map_->find(__k);
+            if (it == __internal_map_->end())
             {
                 return std::make_pair(mapped_type(), false);
             }
@@ -317,37 +713,959 @@ namespace std
         
         void clear()
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_map_.clear();
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            __internal_map_->clear();
         }
         
         bool contains(const key_type& __k)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            auto it = __internal_map_.find(__k);
-            return it != __internal_map_.end();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            auto it = __internal_map_->find(__k);
+            return it != __internal_map_->end();
         }
         
         size_type erase(const key_type& __k)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_map_.erase(__k);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_map_->erase(__k);
         }
         
-        void for_each(std::function<void(const value_type&)> __bl)
+        template <typename _Function>
+        void for_each(_Function __bl)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            for (const auto& v : __internal_map_)
+            std::shared_lock<mutex_type> lock(__mutex_);
+            for (const auto& v : *__internal_map_)
             {
                 __bl(v);
             }
         }
+        
+        // Bucket cursor; see threadsafe_unordered_map::scan.
+        class scan_cursor
+        {
+            friend class threadsafe_unordered_multimap;
+            
+            size_type __bucket_ = 0;
+            size_type __bucket_count_ = 0;
+            bool __done_ = false;
+            
+        public:
+            bool done() const { return __done_; }
+        };
+        
+        template <typename _Function>
+        size_type scan(scan_cursor& __c, size_type __count, _Function __bl)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            if (__c.__done_)
+            {
+                return 0;
+            }
+            
+            size_type bc = __internal_map_->bucket_count();
+            if (__c.__bucket_count_ != bc)
+            {
+                __c.__bucket_ = 0;
+                __c.__bucket_count_ = bc;
+            }
+            
+            size_type n = 0;
+            for (; n < __count && __c.__bucket_ < bc; ++__c.__bucket_)
+            {
+                for (auto it = __internal_map_->begin(__c.__bucket_); it != __internal_map_->end(__c.__bucket_); ++it, ++n)
+                {
+                    __bl(*it);
+                }
+            }
+            __c.__done_ = __c.__bucket_ == bc;
+            return n;
+        }
+        
+        // See threadsafe_vector::parallel_for_each.
+        template <typename _Function>
+        void parallel_for_each(_Function __bl)
+        {
+            __parallel([&](size_t __units, size_t __pieces, auto& __visit) { __parallel_for_each(__units, __pieces, __visit, __bl); });
+        }
+        
+        template <typename _Result, typename _Accumulate, typename _Combine>
+        _Result parallel_reduce(_Result __identity, _Accumulate __acc, _Combine __comb)
+        {
+            return __parallel([&](size_t __units, size_t __pieces, auto& __visit) { return __parallel_reduce(__units, __pieces, __visit, std::move(__identity), __acc, __comb); });
+        }
+        
+        template <typename _Predicate>
+        size_type parallel_count_if(_Predicate __pred)
+        {
+            return __parallel([&](size_t __units, size_t __pieces, auto& __visit) { return __parallel_count_if(__units, __pieces, __visit, __pred); });
+        }
     
-        void for_each(const key_type& __k, std::function<void(const std::pair<iterator, iterator>&)> __bl)
+        template <typename _Function>
+        void for_each(const key_type& __k, _Function __bl)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            std::pair<iterator, iterator> r = __internal_map_.equal_range(__k);
+            std::shared_lock<mutex_type> lock(__mutex_);
+            std::pair<iterator, iterator> r = __internal_map_->equal_range(__k);
             __bl(r);
         }
     };
+    
+    
+    template <
+              typename _Key, typename _Tp,
+              typename _Hash = hash<_Key>,
+              typename _Pred = equal_to<_Key>,
+              typename _Alloc = allocator<pair<const _Key, _Tp>>,
+              size_t _Shards = 16,
+              typename _Mutex = shared_timed_mutex
+             >
+    class threadsafe_sharded_unordered_map
+    {
+        static_assert(_Shards > 0 && (_Shards & (_Shards - 1)) == 0, "shard count must be a power of two");
+        
+    public:
+        typedef _Key                                           key_type;
+        typedef _Tp                                            mapped_type;
+        typedef _Hash                                          hasher;
+        typedef _Pred                                          key_equal;
+        typedef _Alloc                                         allocator_type;
+        typedef _Mutex                                         mutex_type;
+        typedef pair<const key_type, mapped_type>              value_type;
+        typedef value_type&                                    reference;
+        typedef const value_type&                              const_reference;
+        
+    private:
+        typedef std::unordered_map<key_type, mapped_type, hasher, key_equal, allocator_type> __map_type;
+        
+        struct alignas(64) __shard
+        {
+            mutable _Mutex __mutex_;
+            __map_type __map_;
+        };
+        
+        hasher __hash_;
+        __shard __shards_[_Shards];
+        
+    public:
+        typedef          __map_type                         map_type;
+        typedef typename __map_type::pointer                pointer;
+        typedef typename __map_type::const_pointer          const_pointer;
+        typedef typename __map_type::size_type              size_type;
+        typedef typename __map_type::difference_type        difference_type;
+        
+        static constexpr size_type shard_count = _Shards;
+        
+    public:
+        threadsafe_sharded_unordered_map() : __hash_() {}
+        threadsafe_sharded_unordered_map(const map_type& __m) : __hash_() { __distribute(__m.begin(), __m.end()); }
+        threadsafe_sharded_unordered_map(initializer_list<value_type> __il) : __hash_() { __distribute(__il.begin(), __il.end()); }
+        
+        template <class _InputIterator>
+        threadsafe_sharded_unordered_map(_InputIterator __f, _InputIterator __l) : __hash_() { __distribute(__f, __l); }
+        
+        threadsafe_sharded_unordered_map(const threadsafe_sharded_unordered_map&) = delete;
+        threadsafe_sharded_unordered_map& operator=(const threadsafe_sharded_unordered_map&) = delete;
+        threadsafe_sharded_unordered_map(threadsafe_sharded_unordered_map&&) = delete;
+        threadsafe_sharded_unordered_map& operator=(threadsafe_sharded_unordered_map&&) = delete;
+        
+    private:
+        // std::unordered_map picks buckets from the low bits of the hash, so the
+        // shard is taken from the high bits of a Fibonacci-mixed hash instead;
+        // otherwise every key in a shard would share the same low bits.
+        size_type __shard_index(const key_type& __k) const
+        {
+            uint64_t __h = static_cast<uint64_t>(__hash_(__k)) * 0x9E3779B97F4A7C15ull;
+            return static_cast<size_type>(__h >> 32) & (_Shards - 1);
+        }
+        
+        __shard& __shard_for(const key_type& __k)
+        {
+            return __shards_[__shard_index(__k)];
+        }
+        
+        // Stable counting sort of [__f, __l) by shard: __items holds the
+        // iterators in input order, and __order[__offsets[i], __offsets[i + 1])
+        // are the indices into __items of the elements that belong to shard i.
+        template <class _ForwardIterator, class _KeyOf>
+        void __group(_ForwardIterator __f, _ForwardIterator __l, _KeyOf __key_of,
+                     vector<_ForwardIterator>& __items, vector<size_type>& __order, size_type (&__offsets)[_Shards + 1]) const
+        {
+            vector<size_type> shard;
+            for (; __f != __l; ++__f)
+            {
+                __items.push_back(__f);
+                shard.push_back(__shard_index(__key_of(*__f)));
+            }
+            
+            std::fill(__offsets, __offsets + _Shards + 1, 0);
+            for (size_type i : shard)
+            {
+                ++__offsets[i + 1];
+            }
+            for (size_type i = 0; i < _Shards; ++i)
+            {
+                __offsets[i + 1] += __offsets[i];
+            }
+            
+            size_type next[_Shards];
+            std::copy(__offsets, __offsets + _Shards, next);
+            __order.resize(shard.size());
+            for (size_type i = 0; i < shard.size(); ++i)
+            {
+                __order[next[shard[i]]++] = i;
+            }
+        }
+        
+        template <class _InputIterator>
+        void __distribute(_InputIterator __f, _InputIterator __l)
+        {
+            for (; __f != __l; ++__f)
+            {
+                __shard_for(__f->first).__map_.insert(*__f);
+            }
+        }
+        
+    public:
+        bool empty() const
+        {
+            for (const auto& s : __shards_)
+            {
+                std::shared_lock<mutex_type> lock(s.__mutex_);
+                if (!s.__map_.empty())
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+        
+        // Shards are counted one at a time, so under concurrent writes the
+        // result is not a single point-in-time size.
+        size_type size() const
+        {
+            size_type n = 0;
+            for (const auto& s : __shards_)
+            {
+                std::shared_lock<mutex_type> lock(s.__mutex_);
+                n += s.__map_.size();
+            }
+            return n;
+        }
+        
+        size_type max_size() const
+        {
+            std::shared_lock<mutex_type> lock(__shards_[0].__mutex_);
+            return __shards_[0].__map_.max_size();
+        }
+        
+        void operator=(const map_type& __v)
+        {
+            std::unique_lock<mutex_type> locks[_Shards];
+            for (size_type i = 0; i < _Shards; ++i)
+            {
+                locks[i] = std::unique_lock<mutex_type>(__shards_[i].__mutex_);
+                __shards_[i].__map_.clear();
+            }
+            __distribute(__v.begin(), __v.end());
+        }
+        
+        void operator=(initializer_list<value_type> __il)
+        {
+            std::unique_lock<mutex_type> locks[_Shards];
+            for (size_type i = 0; i < _Shards; ++i)
+            {
+                locks[i] = std::unique_lock<mutex_type>(__shards_[i].__mutex_);
+                __shards_[i].__map_.clear();
+            }
+            __distribute(__il.begin(), __il.end());
+        }
+        
+        map_type value()
+        {
+            std::shared_lock<mutex_type> locks[_Shards];
+            size_type n = 0;
+            for (size_type i = 0; i < _Shards; ++i)
+            {
+                locks[i] = std::shared_lock<mutex_type>(__shards_[i].__mutex_);
+                n += __shards_[i].__map_.size();
+            }
+            
+            map_type r;
+            r.reserve(n);
+            for (const auto& s : __shards_)
+            {
+                r.insert(s.__map_.begin(), s.__map_.end());
+            }
+            return r;
+        }
+        
+        template <class... _Args>
+        bool emplace(const key_type& __k, _Args&&... __args)
+        {
+            __shard& s = __shard_for(__k);
+            std::unique_lock<mutex_type> lock(s.__mutex_);
+            return s.__map_.emplace(std::piecewise_construct,
+                                    std::forward_as_tuple(__k),
+                                    std::forward_as_tuple(std::forward<_Args>(__args)...)).second;
+        }
+        
+        bool insert(const value_type& __v)
+        {
+            __shard& s = __shard_for(__v.first);
+            std::unique_lock<mutex_type> lock(s.__mutex_);
+            return s.__map_.insert(__v).second;
+        }
+        
+        bool insert(value_type&& __v)
+        {
+            __shard& s = __shard_for(__v.first);
+            std::unique_lock<mutex_type> lock(s.__mutex_);
+            return s.__map_.insert(std::move(__v)).second;
+        }
+        
+        void insert(initializer_list<value_type> __il)
+        {
+            insert(__il.begin(), __il.end());
+        }
+        
+        template <class _InputIterator>
+        void insert(_InputIterator __f, _InputIterator __l)
+        {
+            for (; __f != __l; ++__f)
+            {
+                insert(*__f);
+            }
+        }
+        
+        const mapped_type& operator[](const key_type& __k)
+        {
+            __shard& s = __shard_for(__k);
+            std::unique_lock<mutex_type> lock(s.__mutex_);
+            return s.__map_[__k];
+        }
+        
+        const mapped_type& at(const key_type& __k)
+        {
+            __shard& s = __shard_for(__k);
+            std::shared_lock<mutex_type> lock(s.__mutex_);
+            return s.__map_.at(__k);
+        }
+        
+        // Holds only the shared lock of the key's shard.
+        threadsafe_read_view<mapped_type, mutex_type> read(const key_type& __k)
+        {
+            __shard& s = __shard_for(__k);
+            std::shared_lock<mutex_type> lock(s.__mutex_);
+            auto it = s.__map_.find(__k);
+            const mapped_type* p = it == s.__map_.end() ? nullptr : &it->second;
+            return threadsafe_read_view<mapped_type, mutex_type>(std::move(lock), p);
+        }
+        
+        void set(const key_type& __k, const mapped_type& __v)
+        {
+            __shard& s = __shard_for(__k);
+            std::unique_lock<mutex_type> lock(s.__mutex_);
+            s.__map_[__k] = __v;
+        }
+        
+        void set(const key_type& __k, mapped_type&& __v)
+        {
+            __shard& s = __shard_for(__k);
+            std::unique_lock<mutex_type> lock(s.__mutex_);
+            s.__map_[__k] = std::move(__v);
+        }
+        
+        template <class... _Args>
+        bool try_emplace(const key_type& __k, _Args&&... __args)
+        {
+            __shard& s = __shard_for(__k);
+            std::unique_lock<mutex_type> lock(s.__mutex_);
+            return s.__map_.try_emplace(__k, std::forward<_Args>(__args)...).second;
+        }
+        
+        template <class... _Args>
+        bool try_emplace(key_type&& __k, _Args&&... __args)
+        {
+            __shard& s = __shard_for(__k);
+            std::unique_lock<mutex_type> lock(s.__mutex_);
+            return s.__map_.try_emplace(std::move(__k), std::forward<_Args>(__args)...).second;
+        }
+        
+        template <class _Vp>
+        bool insert_or_assign(const key_type& __k, _Vp&& __v)
+        {
+            __shard& s = __shard_for(__k);
+            std::unique_lock<mutex_type> lock(s.__mutex_);
+            return s.__map_.insert_or_assign(__k, std::forward<_Vp>(__v)).second;
+        }
+        
+        template <class _Vp>
+        bool insert_or_assign(key_type&& __k, _Vp&& __v)
+        {
+            __shard& s = __shard_for(__k);
+            std::unique_lock<mutex_type> lock(s.__mutex_);
+            return s.__map_.insert_or_assign(std::move(__k), std::forward<_Vp>(__v)).second;
+        }
+        
+        // Same read-modify-write helpers as threadsafe_unordered_map, holding
+        // only the key's shard lock.
+        template <class _Function>
+        bool update(const key_type& __k, _Function __fn)
+        {
+            __shard& s = __shard_for(__k);
+            std::unique_lock<mutex_type> lock(s.__mutex_);
+            auto it = s.__map_.find(__k);
+            if (it == s.__map_.end())
+            {
+                return false;
+            }
+            
+            __fn(it->second);
+            return true;
+        }
+        
+        // __fn returns false to erase the entry.
+        template <class _Function>
+        bool compute_if_present(const key_type& __k, _Function __fn)
+        {
+            __shard& s = __shard_for(__k);
+            std::unique_lock<mutex_type> lock(s.__mutex_);
+            auto it = s.__map_.find(__k);
+            if (it == s.__map_.end())
+            {
+                return false;
+            }
+            
+            if (!__fn(it->second))
+            {
+                s.__map_.erase(it);
+            }
+            return true;
+        }
+        
+        // __factory is only called when the key is missing.
+        template <class _Factory>
+        bool compute_if_absent(const key_type& __k, _Factory __factory)
+        {
+            __shard& s = __shard_for(__k);
+            std::unique_lock<mutex_type> lock(s.__mutex_);
+            if (s.__map_.find(__k) != s.__map_.end())
+            {
+                return false;
+            }
+            
+            s.__map_.emplace(__k, __factory());
+            return true;
+        }
+        
+        // Inserts __v, or folds it into the stored value with __combiner(stored, __v).
+        template <class _Vp, class _Combiner>
+        bool merge(const key_type& __k, _Vp&& __v, _Combiner __combiner)
+        {
+            __shard& s = __shard_for(__k);
+            std::unique_lock<mutex_type> lock(s.__mutex_);
+            auto r = s.__map_.try_emplace(__k, std::forward<_Vp>(__v));
+            if (!r.second)
+            {
+                __combiner(r.first->second, std::forward<_Vp>(__v));
+            }
+            return r.second;
+        }
+        
+        // Runs __fn on the stored value, default-constructing it first if needed.
+        template <class _Function>
+        bool upsert(const key_type& __k, _Function __fn)
+        {
+            __shard& s = __shard_for(__k);
+            std::unique_lock<mutex_type> lock(s.__mutex_);
+            auto r = s.__map_.try_emplace(__k);
+            __fn(r.first->second);
+            return r.second;
+        }
+        
+        const std::pair<const mapped_type, bool> get(const key_type& __k)
+        {
+            __shard& s = __shard_for(__k);
+            std::shared_lock<mutex_type> lock(s.__mutex_);
+            auto it = s.__map_.find(__k);
+            if (it == s.__map_.end())
+            {
+                return std::make_pair(mapped_type(), false);
+            }
+            else
+            {
+                return std::make_pair(it->second, true);
+            }
+        }
+        
+        void clear()
+        {
+            std::unique_lock<mutex_type> locks[_Shards];
+            for (size_type i = 0; i < _Shards; ++i)
+            {
+                locks[i] = std::unique_lock<mutex_type>(__shards_[i].__mutex_);
+                __shards_[i].__map_.clear();
+            }
+        }
+        
+        bool contains(const key_type& __k)
+        {
+            __shard& s = __shard_for(__k);
+            std::shared_lock<mutex_type> lock(s.__mutex_);
+            return s.__map_.find(__k) != s.__map_.end();
+        }
+        
+        size_type erase(const key_type& __k)
+        {
+            __shard& s = __shard_for(__k);
+            std::unique_lock<mutex_type> lock(s.__mutex_);
+            return s.__map_.erase(__k);
+        }
+        
+        // Batched variants of get/set/erase. Keys are hashed once up front and
+        // grouped by shard, then every shard involved is locked exactly once.
+        // The ranges have to be forward ranges; get_many writes its results in
+        // input order as in threadsafe_unordered_map::get_many.
+        template <class _ForwardIterator, class _OutputIterator>
+        size_type get_many(_ForwardIterator __f, _ForwardIterator __l, _OutputIterator __out)
+        {
+            vector<_ForwardIterator> items;
+            vector<size_type> order;
+            size_type offsets[_Shards + 1];
+            __group(__f, __l, [](const key_type& __k) -> const key_type& { return __k; }, items, order, offsets);
+            
+            vector<std::optional<mapped_type>> found(items.size());
+            size_type hits = 0;
+            for (size_type i = 0; i < _Shards; ++i)
+            {
+                if (offsets[i] == offsets[i + 1])
+                {
+                    continue;
+                }
+                
+                const __shard& s = __shards_[i];
+                std::shared_lock<mutex_type> lock(s.__mutex_);
+                for (size_type j = offsets[i]; j < offsets[i + 1]; ++j)
+                {
+                    auto it = s.__map_.find(*items[order[j]]);
+                    if (it != s.__map_.end())
+                    {
+                        found[order[j]].emplace(it->second);
+                        ++hits;
+                    }
+                }
+            }
+            
+            for (auto& v : found)
+            {
+                *__out++ = std::move(v);
+            }
+            return hits;
+        }
+        
+        template <class _ForwardIterator>
+        size_type set_many(_ForwardIterator __f, _ForwardIterator __l)
+        {
+            vector<_ForwardIterator> items;
+            vector<size_type> order;
+            size_type offsets[_Shards + 1];
+            __group(__f, __l, [](const auto& __v) -> const key_type& { return __v.first; }, items, order, offsets);
+            
+            size_type inserted = 0;
+            for (size_type i = 0; i < _Shards; ++i)
+            {
+                if (offsets[i] == offsets[i + 1])
+                {
+                    continue;
+                }
+                
+                __shard& s = __shards_[i];
+                std::unique_lock<mutex_type> lock(s.__mutex_);
+                for (size_type j = offsets[i]; j < offsets[i + 1]; ++j)
+                {
+                    const auto& v = *items[order[j]];
+                    inserted += s.__map_.insert_or_assign(v.first, v.second).second;
+                }
+            }
+            return inserted;
+        }
+        
+        template <class _ForwardIterator>
+        size_type erase_many(_ForwardIterator __f, _ForwardIterator __l)
+        {
+            vector<_ForwardIterator> items;
+            vector<size_type> order;
+            size_type offsets[_Shards + 1];
+            __group(__f, __l, [](const key_type& __k) -> const key_type& { return __k; }, items, order, offsets);
+            
+            size_type erased = 0;
+            for (size_type i = 0; i < _Shards; ++i)
+            {
+                if (offsets[i] == offsets[i + 1])
+                {
+                    continue;
+                }
+                
+                __shard& s = __shards_[i];
+                std::unique_lock<mutex_type> lock(s.__mutex_);
+                for (size_type j = offsets[i]; j < offsets[i + 1]; ++j)
+                {
+                    erased += s.__map_.erase(*items[order[j]]);
+                }
+            }
+            return erased;
+        }
+        
+        // Visits one shard at a time; writers to other shards are not blocked.
+        template <typename _Function>
+        void for_each(_Function __bl)
+        {
+            for (const auto& s : __shards_)
+            {
+                std::shared_lock<mutex_type> lock(s.__mutex_);
+                for (const auto& v : s.__map_)
+                {
+                    __bl(v);
+                }
+            }
+        }
+        
+        // Shard-by-shard scan; within a shard the cursor behaves like the one of
+        // threadsafe_unordered_map::scan. Only one shard lock is held at a time.
+        class scan_cursor
+        {
+            friend class threadsafe_sharded_unordered_map;
+            
+            size_type __shard_ = 0;
+            size_type __bucket_ = 0;
+            size_type __bucket_count_ = 0;
+            
+        public:
+            bool done() const { return __shard_ == _Shards; }
+        };
+        
+        template <typename _Function>
+        size_type scan(scan_cursor& __c, size_type __count, _Function __bl)
+        {
+            size_type n = 0;
+            while (n < __count && __c.__shard_ < _Shards)
+            {
+                const __shard& s = __shards_[__c.__shard_];
+                std::shared_lock<mutex_type> lock(s.__mutex_);
+                size_type bc = s.__map_.bucket_count();
+                if (__c.__bucket_count_ != bc)
+                {
+                    __c.__bucket_ = 0;
+                    __c.__bucket_count_ = bc;
+                }
+                
+                for (; n < __count && __c.__bucket_ < bc; ++__c.__bucket_)
+                {
+                    for (auto it = s.__map_.begin(__c.__bucket_); it != s.__map_.end(__c.__bucket_); ++it, ++n)
+                    {
+                        __bl(*it);
+                    }
+                }
+                
+                if (__c.__bucket_ == bc)
+                {
+                    ++__c.__shard_;
+                    __c.__bucket_ = 0;
+                    __c.__bucket_count_ = 0;
+                }
+            }
+            return n;
+        }
+    };
+    
+    
+    // Left-right map for read-mostly tables. Two copies of the map are kept:
+    // readers use the one selected by __left_right_ and never block or write
+    // to a shared cache line - they only bump a counter in a per-thread slot
+    // of the current version's read indicator. A writer (serialised by
+    // _Mutex) applies its operation to the idle copy, switches readers over,
+    // waits for the readers still on the old copy to drain and then applies
+    // the same operation to that copy. Writes therefore run twice, and the
+    // functions passed to update() have to be deterministic.
+    template <
+              typename _Key, typename _Tp,
+              typename _Hash = hash<_Key>,
+              typename _Pred = equal_to<_Key>,
+              typename _Alloc = allocator<pair<const _Key, _Tp>>,
+              typename _Mutex = mutex
+             >
+    class threadsafe_left_right_unordered_map
+    {
+    public:
+        typedef _Key                                           key_type;
+        typedef _Tp                                            mapped_type;
+        typedef _Hash                                          hasher;
+        typedef _Pred                                          key_equal;
+        typedef _Alloc                                         allocator_type;
+        typedef _Mutex                                         mutex_type;
+        typedef pair<const key_type, mapped_type>              value_type;
+        typedef value_type&                                    reference;
+        typedef const value_type&                              const_reference;
+        
+    private:
+        typedef std::unordered_map<key_type, mapped_type, hasher, key_equal, allocator_type> __map_type;
+        
+        static constexpr size_t __reader_slots = 32;
+        
+        struct alignas(64) __counter
+        {
+            atomic<long> __n_;
+            
+            __counter() : __n_(0) {}
+        };
+        
+        struct __read_indicator
+        {
+            __counter __counters_[__reader_slots];
+            
+            bool __empty() const
+            {
+                for (const auto& c : __counters_)
+                {
+                    if (c.__n_.load(memory_order_seq_cst) != 0)
+                    {
+                        return false;
+                    }
+                }
+                return true;
+            }
+        };
+        
+        // Registers the calling thread with the current version for the
+        // lifetime of the object.
+        class __reader
+        {
+        private:
+            const threadsafe_left_right_unordered_map& __m_;
+            size_t __version_;
+            size_t __slot_;
+            
+        public:
+            explicit __reader(const threadsafe_left_right_unordered_map& __m) : __m_(__m), __version_(__m.__version_.load(memory_order_seq_cst)), __slot_(__slot())
+            {
+                __m_.__indicators_[__version_].__counters_[__slot_].__n_.fetch_add(1, memory_order_seq_cst);
+            }
+            
+            ~__reader()
+            {
+                __m_.__indicators_[__version_].__counters_[__slot_].__n_.fetch_sub(1, memory_order_release);
+            }
+            
+            __reader(const __reader&) = delete;
+            __reader& operator=(const __reader&) = delete;
+            
+            // A writer may switch copies between two calls, so an operation
+            // has to take the copy once and stay on it.
+            const __map_type& get() const
+            {
+                return __m_.__maps_[__m_.__left_right_.load(memory_order_seq_cst)];
+            }
+        };
+        
+        mutable _Mutex __mutex_;
+        __map_type __maps_[2];
+        alignas(64) atomic<size_t> __left_right_;
+        atomic<size_t> __version_;
+        mutable __read_indicator __indicators_[2];
+        
+    public:
+        typedef          __map_type                         map_type;
+        typedef typename __map_type::size_type              size_type;
+        
+    public:
+        threadsafe_left_right_unordered_map() : __left_right_(0), __version_(0) {}
+        threadsafe_left_right_unordered_map(const map_type& __m) : __maps_{__m, __m}, __left_right_(0), __version_(0) {}
+        threadsafe_left_right_unordered_map(initializer_list<value_type> __il) : __maps_{map_type(__il), map_type(__il)}, __left_right_(0), __version_(0) {}
+        
+        template <class _InputIterator>
+        threadsafe_left_right_unordered_map(_InputIterator __f, _InputIterator __l) : __maps_{map_type(__f, __l), map_type()}, __left_right_(0), __version_(0)
+        {
+            __maps_[1] = __maps_[0];
+        }
+        
+        threadsafe_left_right_unordered_map(const threadsafe_left_right_unordered_map&) = delete;
+        threadsafe_left_right_unordered_map& operator=(const threadsafe_left_right_unordered_map&) = delete;
+        threadsafe_left_right_unordered_map(threadsafe_left_right_unordered_map&&) = delete;
+        threadsafe_left_right_unordered_map& operator=(threadsafe_left_right_unordered_map&&) = delete;
+        
+    private:
+        static size_t __slot()
+        {
+            static atomic<size_t> next(0);
+            static thread_local size_t slot = next.fetch_add(1, memory_order_relaxed) % __reader_slots;
+            return slot;
+        }
+        
+        // Makes copy __i equal to the other one again after an operation
+        // failed half way through it. There is no way back from a failed
+        // copy, hence noexcept.
+        void __resync(size_t __i) noexcept
+        {
+            __maps_[__i] = __maps_[1 - __i];
+        }
+        
+        template <class _Op>
+        auto __apply(_Op& __op, size_t __i, bool __last)
+        {
+            try
+            {
+                return __op(__maps_[__i], __last);
+            }
+            catch (...)
+            {
+                __resync(__i);
+                throw;
+            }
+        }
+        
+        // Applies __op(map, last) to both copies, last being true for the
+        // second application, and returns the result of the first one. If
+        // the first application throws, the idle copy is restored from the
+        // published one and the map is unchanged. If the second one throws,
+        // the write is already visible; the idle copy is rebuilt from it
+        // before the exception propagates, so the copies never diverge.
+        template <class _Op>
+        auto __write(_Op __op)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            size_t lr = __left_right_.load(memory_order_relaxed);
+            auto r = __apply(__op, 1 - lr, false);
+            __left_right_.store(1 - lr, memory_order_seq_cst);
+            
+            size_t prev = __version_.load(memory_order_relaxed);
+            size_t next = 1 - prev;
+            while (!__indicators_[next].__empty())
+            {
+                this_thread::yield();
+            }
+            __version_.store(next, memory_order_seq_cst);
+            while (!__indicators_[prev].__empty())
+            {
+                this_thread::yield();
+            }
+            
+            __apply(__op, lr, true);
+            return r;
+        }
+        
+    public:
+        bool empty() const
+        {
+            __reader reader(*this);
+            return reader.get().empty();
+        }
+        
+        size_type size() const
+        {
+            __reader reader(*this);
+            return reader.get().size();
+        }
+        
+        map_type value() const
+        {
+            __reader reader(*this);
+            return reader.get();
+        }
+        
+        const std::pair<const mapped_type, bool> get(const key_type& __k) const
+        {
+            __reader reader(*this);
+            const map_type& m = reader.get();
+            auto it = m.find(__k);
+            if (it == m.end())
+            {
+                return std::make_pair(mapped_type(), false);
+            }
+            else
+            {
+                return std::make_pair(it->second, true);
+            }
+        }
+        
+        bool contains(const key_type& __k) const
+        {
+            __reader reader(*this);
+            const map_type& m = reader.get();
+            return m.find(__k) != m.end();
+        }
+        
+        // Writers wait for the visit to finish before they reuse this copy.
+        template <typename _Function>
+        void for_each(_Function __bl) const
+        {
+            __reader reader(*this);
+            for (const auto& v : reader.get())
+            {
+                __bl(v);
+            }
+        }
+        
+        bool insert(const value_type& __v)
+        {
+            return __write([&](map_type& __m, bool) { return __m.insert(__v).second; });
+        }
+        
+        void set(const key_type& __k, const mapped_type& __v)
+        {
+            __write([&](map_type& __m, bool) { __m[__k] = __v; return true; });
+        }
+        
+        void set(const key_type& __k, mapped_type&& __v)
+        {
+            __write([&](map_type& __m, bool __last)
+            {
+                if (__last)
+                {
+                    __m[__k] = std::move(__v);
+                }
+                else
+                {
+                    __m[__k] = __v;
+                }
+                return true;
+            });
+        }
+        
+        template <typename _Function>
+        bool update(const key_type& __k, _Function __fn)
+        {
+            return __write([&](map_type& __m, bool)
+            {
+                auto it = __m.find(__k);
+                if (it == __m.end())
+                {
+                    return false;
+                }
+                
+                __fn(it->second);
+                return true;
+            });
+        }
+        
+        size_type erase(const key_type& __k)
+        {
+            return __write([&](map_type& __m, bool) { return __m.erase(__k); });
+        }
+        
+        void clear()
+        {
+            __write([](map_type& __m, bool) { __m.clear(); return true; });
+        }
+    };
+    
+    
+    namespace pmr
+    {
+        template <typename _Key, typename _Tp, typename _Hash = hash<_Key>, typename _Pred = equal_to<_Key>, typename _Mutex = shared_timed_mutex>
+        using threadsafe_unordered_map = std::threadsafe_unordered_map<_Key, _Tp, _Hash, _Pred, polymorphic_allocator<pair<const _Key, _Tp>>, _Mutex>;
+        
+        template <typename _Key, typename _Tp, typename _Hash = hash<_Key>, typename _Pred = equal_to<_Key>, typename _Mutex = shared_timed_mutex>
+        using threadsafe_unordered_multimap = std::threadsafe_unordered_multimap<_Key, _Tp, _Hash, _Pred, polymorphic_allocator<pair<const _Key, _Tp>>, _Mutex>;
+    }
 }
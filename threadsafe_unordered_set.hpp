@@ -9,11 +9,19 @@
 #pragma once
 
 #include <mutex>
+#include <atomic>
 #include <memory>
+#include <limits>
+#include <cstdint>
 #include <utility>
 #include <functional>
 #include <shared_mutex>
+#include <memory_resource>
 #include <unordered_set>
+#include "threadsafe_mutex.hpp"
+#include "threadsafe_parallel.hpp"
+#include "threadsafe_read_view.hpp"
+#include "threadsafe_reclamation.hpp"
 
 namespace std
 {
@@ -21,7 +29,8 @@ namespace std
               typename _Value,
               typename _Hash = hash<_Value>,
               typename _Pred = equal_to<_Value>,
-              typename _Alloc = allocator<_Value>
+              typename _Alloc = allocator<_Value>,
+              typename _Mutex = shared_timed_mutex
              >
     class threadsafe_unordered_set
     {
@@ -31,14 +40,15 @@ namespace std
         typedef _Hash                                       hasher;
         typedef _Pred                                       key_equal;
         typedef _Alloc                                      allocator_type;
+        typedef _Mutex                                      mutex_type;
         typedef value_type&                                 reference;
         typedef const value_type&                           const_reference;
         
     private:
         typedef std::unordered_set<value_type, hasher, key_equal, allocator_type> __set_type;
         
-        mutable std::shared_timed_mutex __mutex_;
-        __set_type __internal_set_;
+        mutable _Mutex __mutex_;
+        shared_ptr<__set_type> __internal_set_;
         
     public:
         typedef          __set_type                         set_type;
@@ -52,65 +62,120 @@ namespace std
         typedef typename __set_type::const_local_iterator   const_local_iterator;
         
     public:
-        threadsafe_unordered_set() : __internal_set_() {}
-        threadsafe_unordered_set(const set_type& __s) : __internal_set_(__s) {}
-        threadsafe_unordered_set(set_type&& __s) : __internal_set_(std::move(__s)) {}
-        threadsafe_unordered_set(initializer_list<value_type> __il) : __internal_set_(__il) {}
+        threadsafe_unordered_set() : __internal_set_(std::make_shared<__set_type>()) {}
+        explicit threadsafe_unordered_set(const allocator_type& __a) : __internal_set_(std::make_shared<__set_type>(__a)) {}
+        threadsafe_unordered_set(const set_type& __s) : __internal_set_(std::make_shared<__set_type>(__s)) {}
+        threadsafe_unordered_set(set_type&& __s) : __internal_set_(std::make_shared<__set_type>(std::move(__s))) {}
+        threadsafe_unordered_set(initializer_list<value_type> __il) : __internal_set_(std::make_shared<__set_type>(__il)) {}
         
         template <class _InputIterator>
-        threadsafe_unordered_set(_InputIterator __f, _InputIterator __l) : __internal_set_(__f, __l) {}
+        threadsafe_unordered_set(_InputIterator __f, _InputIterator __l) : __internal_set_(std::make_shared<__set_type>(__f, __l)) {}
         
         threadsafe_unordered_set(const threadsafe_unordered_set&) = delete;
         threadsafe_unordered_set& operator=(const threadsafe_unordered_set&) = delete;
         threadsafe_unordered_set(threadsafe_unordered_set&&) = delete;
         threadsafe_unordered_set& operator=(threadsafe_unordered_set&&) = delete;
         
+    private:
+        // Called under the unique lock before every write. The set is copied
+        // only if a snapshot still refers to it.
+        void __detach(bool __copy = true)
+        {
+            if (__internal_set_.use_count() > 1)
+            {
+                __internal_set_ = __copy ? std::make_shared<__set_type>(*__internal_set_, __internal_set_->get_allocator())
+                                         : std::make_shared<__set_type>(__internal_set_->get_allocator());
+            }
+            else
+            {
+                atomic_thread_fence(memory_order_acquire);
+            }
+        }
+        
+        template <class _Op>
+        auto __parallel(_Op __op)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            const __set_type& c = *__internal_set_;
+            auto visit = [&c](size_t __f, size_t __l, auto& __bl)
+            {
+                for (; __f < __l; ++__f)
+                {
+                    for (auto it = c.begin(__f); it != c.end(__f); ++it)
+                    {
+                        __bl(*it);
+                    }
+                }
+            };
+            return __op(c.bucket_count(), __parallel_pieces(c.bucket_count()), visit);
+        }
+        
     public:
+        allocator_type get_allocator() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_set_->get_allocator();
+        }
+        
         bool empty() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_set_.empty();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_set_->empty();
         }
         
         size_type size() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_set_.size();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_set_->size();
         }
         
         size_type max_size() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_set_.max_size();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_set_->max_size();
         }
         
         void operator=(const set_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_set_ = __v;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            *__internal_set_ = __v;
         }
         
-        void operator=(initializer_list<set_type> __il)
+        void operator=(initializer_list<value_type> __il)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_set_ = __il;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            *__internal_set_ = __il;
         }
         
         set_type value()
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return *__internal_set_;
+        }
+        
+        std::shared_ptr<const set_type> snapshot() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
             return __internal_set_;
         }
         
+        threadsafe_read_view<set_type, mutex_type> read() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return threadsafe_read_view<set_type, mutex_type>(std::move(lock), __internal_set_.get());
+        }
+        
         set_type set_intersection(const set_type& s)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::shared_lock<mutex_type> lock(__mutex_);
             
             set_type r;
             for (auto v : s)
             {
-                auto it = __internal_set_.find(v);
-                if (it != __internal_set_.end())
+                auto it = __internal_set_->find(v);
+                if (it != __internal_set_->end())
                 {
                     r.insert(v);
                 }
@@ -120,9 +185,9 @@ namespace std
         
         set_type set_union(const set_type& s)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::shared_lock<mutex_type> lock(__mutex_);
             
-            set_type r(__internal_set_);
+            set_type r(*__internal_set_);
             for (auto v : s)
             {
                 auto it = r.find(v);
@@ -136,9 +201,9 @@ namespace std
         
         set_type set_different(const set_type& s)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::shared_lock<mutex_type> lock(__mutex_);
             
-            set_type r(__internal_set_);
+            set_type r(*__internal_set_);
             for (auto v : s)
             {
                 auto it = r.find(v);
@@ -152,10 +217,10 @@ namespace std
         
         set_type set_symmetric_difference(const set_type& s)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::shared_lock<mutex_type> lock(__mutex_);
             
             set_type r(s);
-            for (auto v : __internal_set_)
+            for (auto v : *__internal_set_)
             {
                 auto it = s.find(v);
                 if (it != s.end())
@@ -173,34 +238,45 @@ namespace std
         template <class... _Args>
         bool emplace(_Args&&... __args)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_set_.emplace(std::forward<_Args>(__args)...).second;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_set_->emplace(std::forward<_Args>(__args)...).second;
         }
         
         bool insert(const value_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_set_.insert(__v).second;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_set_->insert(__v).second;
+        }
+        
+        bool insert(value_type&& __v)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_set_->insert(std::move(__v)).second;
         }
         
         void insert(initializer_list<value_type> __il)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_set_.insert(__il);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_set_->insert(__il);
         }
         
         template <class _InputIterator>
         void insert(_InputIterator __f, _InputIterator __l)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_set_.insert(__f, __l);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_set_->insert(__f, __l);
         }
         
         const std::pair<const value_type, bool> get(const key_type& __k)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            auto it = __internal_set_.find(__k);
-            if (it == __internal_set_.end())
+            std::shared_lock<mutex_type> lock(__mutex_);
+            auto it = __internal_set_->find(__k);
+            if (it == __internal_set_->end())
             {
                 return std::make_pair(value_type(), false);
             }
@@ -212,31 +288,94 @@ namespace std
         
         void clear()
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_set_.clear();
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            __internal_set_->clear();
         }
         
         bool contains(const key_type& __k)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            auto it = __internal_set_.find(__k);
-            return it != __internal_set_.end();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            auto it = __internal_set_->find(__k);
+            return it != __internal_set_->end();
         }
         
         size_type erase(const key_type& __k)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_set_.erase(__k);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_set_->erase(__k);
         }
         
-        void for_each(std::function<void(const value_type&)> __bl)
+        template <typename _Function>
+        void for_each(_Function __bl)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            for (const auto& v : __internal_set_)
+            std::shared_lock<mutex_type> lock(__mutex_);
+            for (const auto& v : *__internal_set_)
             {
                 __bl(v);
             }
         }
+        
+        // Bucket cursor; see threadsafe_unordered_map::scan.
+        class scan_cursor
+        {
+            friend class threadsafe_unordered_set;
+            
+            size_type __bucket_ = 0;
+            size_type __bucket_count_ = 0;
+            bool __done_ = false;
+            
+        public:
+            bool done() const { return __done_; }
+        };
+        
+        template <typename _Function>
+        size_type scan(scan_cursor& __c, size_type __count, _Function __bl)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            if (__c.__done_)
+            {
+                return 0;
+            }
+            
+            size_type bc = __internal_set_->bucket_count();
+            if (__c.__bucket_count_ != bc)
+            {
+                __c.__bucket_ = 0;
+                __c.__bucket_count_ = bc;
+            }
+            
+            size_type n = 0;
+            for (; n < __count && __c.__bucket_ < bc; ++__c.__bucket_)
+            {
+                for (auto it = __internal_set_->begin(__c.__bucket_); it != __internal_set_->end(__c.__bucket_); ++it, ++n)
+                {
+                    __bl(*it);
+                }
+            }
+            __c.__done_ = __c.__bucket_ == bc;
+            return n;
+        }
+        
+        // Pieces are ranges of buckets; see threadsafe_vector::parallel_for_each.
+        template <typename _Function>
+        void parallel_for_each(_Function __bl)
+        {
+            __parallel([&](size_t __units, size_t __pieces, auto& __visit) { __parallel_for_each(__units, __pieces, __visit, __bl); });
+        }
+        
+        template <typename _Result, typename _Accumulate, typename _Combine>
+        _Result parallel_reduce(_Result __identity, _Accumulate __acc, _Combine __comb)
+        {
+            return __parallel([&](size_t __units, size_t __pieces, auto& __visit) { return __parallel_reduce(__units, __pieces, __visit, std::move(__identity), __acc, __comb); });
+        }
+        
+        template <typename _Predicate>
+        size_type parallel_count_if(_Predicate __pred)
+        {
+            return __parallel([&](size_t __units, size_t __pieces, auto& __visit) { return __parallel_count_if(__units, __pieces, __visit, __pred); });
+        }
     };
     
     
@@ -244,7 +383,8 @@ namespace std
               typename _Value,
               typename _Hash = hash<_Value>,
               typename _Pred = equal_to<_Value>,
-              typename _Alloc = allocator<_Value>
+              typename _Alloc = allocator<_Value>,
+              typename _Mutex = shared_timed_mutex
              >
     class threadsafe_unordered_multiset
     {
@@ -254,14 +394,15 @@ namespace std
         typedef _Hash                                       hasher;
         typedef _Pred                                       key_equal;
         typedef _Alloc                                      allocator_type;
+        typedef _Mutex                                      mutex_type;
         typedef value_type&                                 reference;
         typedef const value_type&                           const_reference;
         
     private:
         typedef std::unordered_multiset<value_type, hasher, key_equal, allocator_type> __set_type;
         
-        mutable std::shared_timed_mutex __mutex_;
-        __set_type __internal_set_;
+        mutable _Mutex __mutex_;
+        shared_ptr<__set_type> __internal_set_;
         
     public:
         typedef          __set_type                         set_type;
@@ -275,65 +416,118 @@ namespace std
         typedef typename __set_type::const_local_iterator   const_local_iterator;
         
     public:
-        threadsafe_unordered_multiset() : __internal_set_() {}
-        threadsafe_unordered_multiset(const set_type& __s) : __internal_set_(__s) {}
-        threadsafe_unordered_multiset(set_type&& __s) : __internal_set_(std::move(__s)) {}
-        threadsafe_unordered_multiset(initializer_list<value_type> __il) : __internal_set_(__il) {}
+        threadsafe_unordered_multiset() : __internal_set_(std::make_shared<__set_type>()) {}
+        explicit threadsafe_unordered_multiset(const allocator_type& __a) : __internal_set_(std::make_shared<__set_type>(__a)) {}
+        threadsafe_unordered_multiset(const set_type& __s) : __internal_set_(std::make_shared<__set_type>(__s)) {}
+        threadsafe_unordered_multiset(set_type&& __s) : __internal_set_(std::make_shared<__set_type>(std::move(__s))) {}
+        threadsafe_unordered_multiset(initializer_list<value_type> __il) : __internal_set_(std::make_shared<__set_type>(__il)) {}
         
         template <class _InputIterator>
-        threadsafe_unordered_multiset(_InputIterator __f, _InputIterator __l) : __internal_set_(__f, __l) {}
+        threadsafe_unordered_multiset(_InputIterator __f, _InputIterator __l) : __internal_set_(std::make_shared<__set_type>(__f, __l)) {}
         
         threadsafe_unordered_multiset(const threadsafe_unordered_multiset&) = delete;
         threadsafe_unordered_multiset& operator=(const threadsafe_unordered_multiset&) = delete;
         threadsafe_unordered_multiset(threadsafe_unordered_multiset&&) = delete;
         threadsafe_unordered_multiset& operator=(threadsafe_unordered_multiset&&) = delete;
         
+    private:
+        void __detach(bool __copy = true)
+        {
+            if (__internal_set_.use_count() > 1)
+            {
+                __internal_set_ = __copy ? std::make_shared<__set_type>(*__internal_set_, __internal_set_->get_allocator())
+                                         : std::make_shared<__set_type>(__internal_set_->get_allocator());
+            }
+            else
+            {
+                atomic_thread_fence(memory_order_acquire);
+            }
+        }
+        
+        template <class _Op>
+        auto __parallel(_Op __op)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            const __set_type& c = *__internal_set_;
+            auto visit = [&c](size_t __f, size_t __l, auto& __bl)
+            {
+                for (; __f < __l; ++__f)
+                {
+                    for (auto it = c.begin(__f); it != c.end(__f); ++it)
+                    {
+                        __bl(*it);
+                    }
+                }
+            };
+            return __op(c.bucket_count(), __parallel_pieces(c.bucket_count()), visit);
+        }
+        
     public:
+        allocator_type get_allocator() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_set_->get_allocator();
+        }
+        
         bool empty() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_set_.empty();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_set_->empty();
         }
         
         size_type size() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_set_.size();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_set_->size();
         }
         
         size_type max_size() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_set_.max_size();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_set_->max_size();
         }
         
         void operator=(const set_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_set_ = __v;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            *__internal_set_ = __v;
         }
         
-        void operator=(initializer_list<set_type> __il)
+        void operator=(initializer_list<value_type> __il)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_set_ = __il;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            *__internal_set_ = __il;
         }
         
         set_type value()
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return *__internal_set_;
+        }
+        
+        std::shared_ptr<const set_type> snapshot() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
             return __internal_set_;
         }
         
+        threadsafe_read_view<set_type, mutex_type> read() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return threadsafe_read_view<set_type, mutex_type>(std::move(lock), __internal_set_.get());
+        }
+        
         set_type set_intersection(const set_type& s)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::shared_lock<mutex_type> lock(__mutex_);
             
             set_type r;
             for (auto v : s)
             {
-                auto it = __internal_set_.find(v);
-                if (it != __internal_set_.end() && std::min(s.count(v), __internal_set_.count(v)) != r.count(v))
+                auto it = __internal_set_->find(v);
+                if (it != __internal_set_->end() && std::min(s.count(v), __internal_set_->count(v)) != r.count(v))
                 {
                     r.insert(v);
                 }
@@ -343,19 +537,19 @@ namespace std
         
         set_type set_union(const set_type& s)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::shared_lock<mutex_type> lock(__mutex_);
             
-            set_type r(__internal_set_);
+            set_type r(*__internal_set_);
             for (auto v : s)
             {
-                auto it = __internal_set_.find(v);
-                if (it == __internal_set_.end())
+                auto it = __internal_set_->find(v);
+                if (it == __internal_set_->end())
                 {
                     r.insert(v);
                 }
                 else
                 {
-                    if (std::max(s.count(v), __internal_set_.count(v)) != r.count(v))
+                    if (std::max(s.count(v), __internal_set_->count(v)) != r.count(v))
                     {
                         r.insert(v);
                     }
@@ -366,10 +560,10 @@ namespace std
         
         set_type set_different(const set_type& s)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::shared_lock<mutex_type> lock(__mutex_);
             
             set_type r;
-            for (auto v : __internal_set_)
+            for (auto v : *__internal_set_)
             {
                 auto it = s.find(v);
                 if (it == s.end())
@@ -378,7 +572,7 @@ namespace std
                 }
                 else
                 {
-                    auto c = __internal_set_.count(v) - s.count(v);
+                    auto c = __internal_set_->count(v) - s.count(v);
                     if (c > 0 && c != r.count(v))
                     {
                         r.insert(v);
@@ -391,34 +585,45 @@ namespace std
         template <class... _Args>
         void emplace(_Args&&... __args)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_set_.emplace(std::forward<_Args>(__args)...);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_set_->emplace(std::forward<_Args>(__args)...);
         }
         
         void insert(const value_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_set_.insert(__v);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_set_->insert(__v);
+        }
+        
+        void insert(value_type&& __v)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_set_->insert(std::move(__v));
         }
         
         void insert(initializer_list<value_type> __il)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_set_.insert(__il);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_set_->insert(__il);
         }
         
         template <class _InputIterator>
         void insert(_InputIterator __f, _InputIterator __l)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_set_.insert(__f, __l);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_set_->insert(__f, __l);
         }
         
         const std::pair<const value_type, bool> get(const key_type& __k)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            auto it = __internal_set_.find(__k);
-            if (it == __internal_set_.end())
+            std::shared_lock<mutex_type> lock(__mutex_);
+            auto it = __internal_set_->find(__k);
+            if (it == __internal_set_->end())
             {
                 return std::make_pair(value_type(), false);
             }
@@ -430,37 +635,689 @@ namespace std
         
         void clear()
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_set_.clear();
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            __internal_set_->clear();
         }
         
         bool contains(const key_type& __k)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            auto it = __internal_set_.find(__k);
-            return it != __internal_set_.end();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            auto it = __internal_set_->find(__k);
+            return it != __internal_set_->end();
         }
         
         size_type erase(const key_type& __k)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_set_.erase(__k);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            return __internal_set_->erase(__k);
         }
         
-        void for_each(std::function<void(const value_type&)> __bl)
+        template <typename _Function>
+        void for_each(_Function __bl)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            for (const auto& v : __internal_set_)
+            std::shared_lock<mutex_type> lock(__mutex_);
+            for (const auto& v : *__internal_set_)
             {
                 __bl(v);
             }
         }
         
-        void for_each(const key_type& __k, std::function<void(const std::pair<iterator, iterator>&)> __bl)
+        class scan_cursor
+        {
+            friend class threadsafe_unordered_multiset;
+            
+            size_type __bucket_ = 0;
+            size_type __bucket_count_ = 0;
+            bool __done_ = false;
+            
+        public:
+            bool done() const { return __done_; }
+        };
+        
+        template <typename _Function>
+        size_type scan(scan_cursor& __c, size_type __count, _Function __bl)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            if (__c.__done_)
+            {
+                return 0;
+            }
+            
+            size_type bc = __internal_set_->bucket_count();
+            if (__c.__bucket_count_ != bc)
+            {
+                __c.__bucket_ = 0;
+                __c.__bucket_count_ = bc;
+            }
+            
+            size_type n = 0;
+            for (; n < __count && __c.__bucket_ < bc; ++__c.__bucket_)
+            {
+                for (auto it = __internal_set_->begin(__c.__bucket_); it != __internal_set_->end(__c.__bucket_); ++it, ++n)
+                {
+                    __bl(*it);
+                }
+            }
+            __c.__done_ = __c.__bucket_ == bc;
+            return n;
+        }
+        
+        // See threadsafe_vector::parallel_for_each.
+        template <typename _Function>
+        void parallel_for_each(_Function __bl)
+        {
+            __parallel([&](size_t __units, size_t __pieces, auto& __visit) { __parallel_for_each(__units, __pieces, __visit, __bl); });
+        }
+        
+        template <typename _Result, typename _Accumulate, typename _Combine>
+        _Result parallel_reduce(_Result __identity, _Accumulate __acc, _Combine __comb)
+        {
+            return __parallel([&](size_t __units, size_t __pieces, auto& __visit) { return __parallel_reduce(__units, __pieces, __visit, std::move(__identity), __acc, __comb); });
+        }
+        
+        template <typename _Predicate>
+        size_type parallel_count_if(_Predicate __pred)
+        {
+            return __parallel([&](size_t __units, size_t __pieces, auto& __visit) { return __parallel_count_if(__units, __pieces, __visit, __pred); });
+        }
+        
+        template <typename _Function>
+        void for_each(const key_type& __k, _Function __bl)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            std::pair<iterator, iterator> r = __internal_set_.equal_range(__k);
+            std::shared_lock<mutex_type> lock(__mutex_);
+            std::pair<iterator, iterator> r = __internal_set_->equal_range(__k);
             __bl(r);
         }
     };
+    
+    
+    // Lock-free unordered set built on a split-ordered list (Shalev & Shavit).
+    // All elements live in one Harris-Michael linked list sorted by their
+    // bit-reversed hash; buckets are lazily created dummy nodes pointing into
+    // that list, so growing the table never moves an element. Unlinked nodes
+    // are reclaimed through __epoch_domain. The allocator must be stateless,
+    // because retired nodes can outlive the set that allocated them.
+    template <
+              typename _Value,
+              typename _Hash = hash<_Value>,
+              typename _Pred = equal_to<_Value>,
+              typename _Alloc = allocator<_Value>
+             >
+    class threadsafe_lockfree_unordered_set
+    {
+    public:
+        typedef _Value                                      key_type;
+        typedef key_type                                    value_type;
+        typedef _Hash                                       hasher;
+        typedef _Pred                                       key_equal;
+        typedef _Alloc                                      allocator_type;
+        typedef value_type&                                 reference;
+        typedef const value_type&                           const_reference;
+        
+    private:
+        typedef std::unordered_set<value_type, hasher, key_equal, allocator_type> __set_type;
+        
+    public:
+        typedef          __set_type                         set_type;
+        typedef typename __set_type::pointer                pointer;
+        typedef typename __set_type::const_pointer          const_pointer;
+        typedef typename __set_type::size_type              size_type;
+        typedef typename __set_type::difference_type        difference_type;
+        
+    private:
+        struct __node_base
+        {
+            atomic<uintptr_t> __next_;
+            size_t            __key_;
+            
+            explicit __node_base(size_t __k) : __next_(0), __key_(__k) {}
+        };
+        
+        struct __node : __node_base
+        {
+            value_type __value_;
+            
+            template <class... _Args>
+            explicit __node(size_t __k, _Args&&... __args) : __node_base(__k), __value_(std::forward<_Args>(__args)...) {}
+        };
+        
+        typedef typename allocator_traits<allocator_type>::template rebind_alloc<__node> __node_allocator;
+        typedef allocator_traits<__node_allocator>                                      __node_traits;
+        typedef atomic<__node_base*>                                                    __bucket_type;
+        
+        static constexpr unsigned  __hash_bits     = numeric_limits<size_t>::digits;
+        static constexpr size_t    __max_load      = 2;
+        static constexpr size_t    __max_buckets   = size_t(1) << (__hash_bits - 1);
+        
+        hasher                __hash_;
+        key_equal             __equal_;
+        atomic<size_type>     __size_;
+        atomic<size_t>        __bucket_count_;
+        atomic<__bucket_type*> __segments_[__hash_bits];
+        
+    public:
+        threadsafe_lockfree_unordered_set() : __hash_(), __equal_(), __size_(0), __bucket_count_(2) { __init(); }
+        threadsafe_lockfree_unordered_set(const set_type& __s) : threadsafe_lockfree_unordered_set() { insert(__s.begin(), __s.end()); }
+        threadsafe_lockfree_unordered_set(initializer_list<value_type> __il) : threadsafe_lockfree_unordered_set() { insert(__il); }
+        
+        template <class _InputIterator>
+        threadsafe_lockfree_unordered_set(_InputIterator __f, _InputIterator __l) : threadsafe_lockfree_unordered_set() { insert(__f, __l); }
+        
+        threadsafe_lockfree_unordered_set(const threadsafe_lockfree_unordered_set&) = delete;
+        threadsafe_lockfree_unordered_set& operator=(const threadsafe_lockfree_unordered_set&) = delete;
+        threadsafe_lockfree_unordered_set(threadsafe_lockfree_unordered_set&&) = delete;
+        threadsafe_lockfree_unordered_set& operator=(threadsafe_lockfree_unordered_set&&) = delete;
+        
+        ~threadsafe_lockfree_unordered_set()
+        {
+            __node_base* n = __as_node(__segments_[0].load(memory_order_relaxed)[0].load(memory_order_relaxed)->__next_.load(memory_order_relaxed));
+            while (n)
+            {
+                __node_base* next = __as_node(n->__next_.load(memory_order_relaxed));
+                __destroy(n);
+                n = next;
+            }
+            
+            delete __segments_[0].load(memory_order_relaxed)[0].load(memory_order_relaxed);
+            for (unsigned i = 0; i < __hash_bits; ++i)
+            {
+                delete[] __segments_[i].load(memory_order_relaxed);
+            }
+        }
+        
+    private:
+        static __node_base* __as_node(uintptr_t __p)
+        {
+            return reinterpret_cast<__node_base*>(__p & ~uintptr_t(1));
+        }
+        
+        static bool __is_marked(uintptr_t __p)
+        {
+            return (__p & 1) != 0;
+        }
+        
+        static size_t __reverse_bits(size_t __x)
+        {
+            uint64_t v = __x;
+            v = ((v >> 1)  & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+            v = ((v >> 2)  & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+            v = ((v >> 4)  & 0x0F0F0F0F0F0F0F0Full) | ((v & 0x0F0F0F0F0F0F0F0Full) << 4);
+            v = ((v >> 8)  & 0x00FF00FF00FF00FFull) | ((v & 0x00FF00FF00FF00FFull) << 8);
+            v = ((v >> 16) & 0x0000FFFF0000FFFFull) | ((v & 0x0000FFFF0000FFFFull) << 16);
+            v = (v >> 32) | (v << 32);
+            return static_cast<size_t>(v >> (64 - __hash_bits));
+        }
+        
+        // Regular keys always have the lowest bit set and dummy keys never do,
+        // so a bucket's dummy node sorts in front of every element it owns.
+        static size_t __regular_key(size_t __h)
+        {
+            return __reverse_bits(__h | __max_buckets);
+        }
+        
+        static size_t __dummy_key(size_t __b)
+        {
+            return __reverse_bits(__b);
+        }
+        
+        static bool __is_dummy(const __node_base* __n)
+        {
+            return (__n->__key_ & 1) == 0;
+        }
+        
+        static value_type& __value_of(__node_base* __n)
+        {
+            return static_cast<__node*>(__n)->__value_;
+        }
+        
+        static void __destroy(__node_base* __n)
+        {
+            if (__is_dummy(__n))
+            {
+                delete __n;
+            }
+            else
+            {
+                __node_allocator a;
+                __node* n = static_cast<__node*>(__n);
+                __node_traits::destroy(a, n);
+                __node_traits::deallocate(a, n, 1);
+            }
+        }
+        
+        static void __reclaim(void* __p)
+        {
+            __destroy(static_cast<__node_base*>(__p));
+        }
+        
+        template <class... _Args>
+        static __node* __create(size_t __k, _Args&&... __args)
+        {
+            __node_allocator a;
+            __node* n = __node_traits::allocate(a, 1);
+            try
+            {
+                __node_traits::construct(a, n, __k, std::forward<_Args>(__args)...);
+            }
+            catch (...)
+            {
+                __node_traits::deallocate(a, n, 1);
+                throw;
+            }
+            return n;
+        }
+        
+        void __init()
+        {
+            for (unsigned i = 0; i < __hash_bits; ++i)
+            {
+                __segments_[i].store(nullptr, memory_order_relaxed);
+            }
+            __bucket(0).store(new __node_base(__dummy_key(0)), memory_order_release);
+        }
+        
+        // Segment 0 holds buckets 0 and 1, segment s > 0 holds [2^s, 2^(s+1)).
+        __bucket_type& __bucket(size_t __b)
+        {
+            unsigned s = 0;
+            for (size_t b = __b >> 1; b; b >>= 1)
+            {
+                ++s;
+            }
+            
+            __bucket_type* seg = __segments_[s].load(memory_order_acquire);
+            if (!seg)
+            {
+                size_t n = s == 0 ? 2 : size_t(1) << s;
+                __bucket_type* fresh = new __bucket_type[n];
+                for (size_t i = 0; i < n; ++i)
+                {
+                    fresh[i].store(nullptr, memory_order_relaxed);
+                }
+                
+                if (__segments_[s].compare_exchange_strong(seg, fresh, memory_order_acq_rel, memory_order_acquire))
+                {
+                    seg = fresh;
+                }
+                else
+                {
+                    delete[] fresh;
+                }
+            }
+            
+            return seg[s == 0 ? __b : __b - (size_t(1) << s)];
+        }
+        
+        __node_base* __bucket_head(size_t __h)
+        {
+            size_t b = __h & (__bucket_count_.load(memory_order_acquire) - 1);
+            __node_base* head = __bucket(b).load(memory_order_acquire);
+            return head ? head : __init_bucket(b);
+        }
+        
+        __node_base* __init_bucket(size_t __b)
+        {
+            size_t parent = __b;
+            for (size_t bit = __max_buckets; bit; bit >>= 1)
+            {
+                if (__b & bit)
+                {
+                    parent = __b & ~bit;
+                    break;
+                }
+            }
+            
+            __node_base* head = __bucket(parent).load(memory_order_acquire);
+            if (!head)
+            {
+                head = __init_bucket(parent);
+            }
+            
+            __node_base* dummy = new __node_base(__dummy_key(__b));
+            atomic<uintptr_t>* prev;
+            __node_base* curr;
+            for (;;)
+            {
+                if (__find(head, dummy->__key_, nullptr, prev, curr))
+                {
+                    delete dummy;
+                    dummy = curr;
+                    break;
+                }
+                
+                dummy->__next_.store(reinterpret_cast<uintptr_t>(curr), memory_order_relaxed);
+                uintptr_t expected = reinterpret_cast<uintptr_t>(curr);
+                if (prev->compare_exchange_strong(expected, reinterpret_cast<uintptr_t>(dummy), memory_order_acq_rel, memory_order_acquire))
+                {
+                    break;
+                }
+            }
+            
+            __bucket(__b).store(dummy, memory_order_release);
+            return dummy;
+        }
+        
+        // Positions __prev/__curr around the node with split-order key __k (and
+        // value __v for regular nodes), unlinking marked nodes on the way.
+        bool __find(__node_base* __head, size_t __k, const value_type* __v, atomic<uintptr_t>*& __prev, __node_base*& __curr)
+        {
+        retry:
+            __prev = &__head->__next_;
+            __curr = __as_node(__prev->load(memory_order_acquire));
+            for (;;)
+            {
+                if (!__curr)
+                {
+                    return false;
+                }
+                
+                uintptr_t next = __curr->__next_.load(memory_order_acquire);
+                if (__is_marked(next))
+                {
+                    uintptr_t expected = reinterpret_cast<uintptr_t>(__curr);
+                    if (!__prev->compare_exchange_strong(expected, next & ~uintptr_t(1), memory_order_acq_rel, memory_order_acquire))
+                    {
+                        goto retry;
+                    }
+                    
+                    __epoch_domain::instance().retire(__curr, &__reclaim);
+                    __curr = __as_node(next);
+                    continue;
+                }
+                
+                if (__curr->__key_ > __k)
+                {
+                    return false;
+                }
+                
+                if (__curr->__key_ == __k && (!__v || __equal_(__value_of(__curr), *__v)))
+                {
+                    return true;
+                }
+                
+                __prev = &__curr->__next_;
+                __curr = __as_node(next);
+            }
+        }
+        
+        // Read-only lookup: skips marked nodes instead of unlinking them, so
+        // readers never write to shared memory.
+        __node_base* __lookup(const key_type& __k)
+        {
+            size_t h = __hash_(__k);
+            size_t k = __regular_key(h);
+            __node_base* curr = __as_node(__bucket_head(h)->__next_.load(memory_order_acquire));
+            while (curr && curr->__key_ <= k)
+            {
+                uintptr_t next = curr->__next_.load(memory_order_acquire);
+                if (curr->__key_ == k && !__is_marked(next) && __equal_(__value_of(curr), __k))
+                {
+                    return curr;
+                }
+                curr = __as_node(next);
+            }
+            return nullptr;
+        }
+        
+        bool __insert_node(__node* __n)
+        {
+            size_t h = __hash_(__n->__value_);
+            __n->__key_ = __regular_key(h);
+            __node_base* head = __bucket_head(h);
+            
+            atomic<uintptr_t>* prev;
+            __node_base* curr;
+            for (;;)
+            {
+                if (__find(head, __n->__key_, &__n->__value_, prev, curr))
+                {
+                    __destroy(__n);
+                    return false;
+                }
+                
+                __n->__next_.store(reinterpret_cast<uintptr_t>(curr), memory_order_relaxed);
+                uintptr_t expected = reinterpret_cast<uintptr_t>(curr);
+                if (prev->compare_exchange_strong(expected, reinterpret_cast<uintptr_t>(__n), memory_order_acq_rel, memory_order_acquire))
+                {
+                    break;
+                }
+            }
+            
+            size_t n = __size_.fetch_add(1, memory_order_relaxed) + 1;
+            size_t bc = __bucket_count_.load(memory_order_relaxed);
+            if (n / bc > __max_load && bc < __max_buckets)
+            {
+                __bucket_count_.compare_exchange_strong(bc, bc << 1, memory_order_release, memory_order_relaxed);
+            }
+            return true;
+        }
+        
+        template <class _Function>
+        void __for_each_node(_Function __fn)
+        {
+            __node_base* curr = __as_node(__bucket(0).load(memory_order_acquire)->__next_.load(memory_order_acquire));
+            while (curr)
+            {
+                uintptr_t next = curr->__next_.load(memory_order_acquire);
+                if (!__is_dummy(curr) && !__is_marked(next))
+                {
+                    __fn(curr);
+                }
+                curr = __as_node(next);
+            }
+        }
+        
+    public:
+        bool empty() const
+        {
+            return __size_.load(memory_order_acquire) == 0;
+        }
+        
+        size_type size() const
+        {
+            return __size_.load(memory_order_acquire);
+        }
+        
+        size_type max_size() const
+        {
+            return __node_traits::max_size(__node_allocator());
+        }
+        
+        // Assignment clears and refills the set; it is not atomic with respect
+        // to concurrent readers and writers.
+        void operator=(const set_type& __v)
+        {
+            clear();
+            insert(__v.begin(), __v.end());
+        }
+        
+        void operator=(initializer_list<value_type> __il)
+        {
+            clear();
+            insert(__il);
+        }
+        
+        set_type value()
+        {
+            __epoch_guard guard;
+            set_type r;
+            __for_each_node([&](__node_base* __n) { r.insert(__value_of(__n)); });
+            return r;
+        }
+        
+        set_type set_intersection(const set_type& s)
+        {
+            set_type r;
+            for (const auto& v : s)
+            {
+                if (contains(v))
+                {
+                    r.insert(v);
+                }
+            }
+            return r;
+        }
+        
+        set_type set_union(const set_type& s)
+        {
+            set_type r = value();
+            r.insert(s.begin(), s.end());
+            return r;
+        }
+        
+        set_type set_different(const set_type& s)
+        {
+            set_type r = value();
+            for (const auto& v : s)
+            {
+                r.erase(v);
+            }
+            return r;
+        }
+        
+        set_type set_symmetric_difference(const set_type& s)
+        {
+            set_type r(s);
+            for (const auto& v : value())
+            {
+                if (s.find(v) != s.end())
+                {
+                    r.erase(v);
+                }
+                else
+                {
+                    r.insert(v);
+                }
+            }
+            return r;
+        }
+        
+        template <class... _Args>
+        bool emplace(_Args&&... __args)
+        {
+            __epoch_guard guard;
+            return __insert_node(__create(0, std::forward<_Args>(__args)...));
+        }
+        
+        bool insert(const value_type& __v)
+        {
+            __epoch_guard guard;
+            if (__lookup(__v))
+            {
+                return false;
+            }
+            return __insert_node(__create(0, __v));
+        }
+        
+        bool insert(value_type&& __v)
+        {
+            __epoch_guard guard;
+            if (__lookup(__v))
+            {
+                return false;
+            }
+            return __insert_node(__create(0, std::move(__v)));
+        }
+        
+        void insert(initializer_list<value_type> __il)
+        {
+            insert(__il.begin(), __il.end());
+        }
+        
+        template <class _InputIterator>
+        void insert(_InputIterator __f, _InputIterator __l)
+        {
+            for (; __f != __l; ++__f)
+            {
+                insert(*__f);
+            }
+        }
+        
+        const std::pair<const value_type, bool> get(const key_type& __k)
+        {
+            __epoch_guard guard;
+            __node_base* n = __lookup(__k);
+            if (!n)
+            {
+                return std::make_pair(value_type(), false);
+            }
+            else
+            {
+                return std::make_pair(__value_of(n), true);
+            }
+        }
+        
+        // Erases the elements one by one; elements inserted concurrently may
+        // survive the call.
+        void clear()
+        {
+            __epoch_guard guard;
+            __for_each_node([&](__node_base* __n) { erase(__value_of(__n)); });
+        }
+        
+        bool contains(const key_type& __k)
+        {
+            __epoch_guard guard;
+            return __lookup(__k) != nullptr;
+        }
+        
+        size_type erase(const key_type& __k)
+        {
+            __epoch_guard guard;
+            size_t h = __hash_(__k);
+            size_t k = __regular_key(h);
+            __node_base* head = __bucket_head(h);
+            
+            atomic<uintptr_t>* prev;
+            __node_base* curr;
+            for (;;)
+            {
+                if (!__find(head, k, &__k, prev, curr))
+                {
+                    return 0;
+                }
+                
+                uintptr_t next = curr->__next_.load(memory_order_acquire);
+                if (__is_marked(next) ||
+                    !curr->__next_.compare_exchange_strong(next, next | 1, memory_order_acq_rel, memory_order_acquire))
+                {
+                    continue;
+                }
+                
+                __size_.fetch_sub(1, memory_order_relaxed);
+                
+                uintptr_t expected = reinterpret_cast<uintptr_t>(curr);
+                if (prev->compare_exchange_strong(expected, next, memory_order_acq_rel, memory_order_acquire))
+                {
+                    __epoch_domain::instance().retire(curr, &__reclaim);
+                }
+                else
+                {
+                    __find(head, k, &__k, prev, curr);
+                }
+                return 1;
+            }
+        }
+        
+        // Weakly consistent: every element present for the whole call is
+        // visited once, concurrent inserts and erases may or may not be seen.
+        template <typename _Function>
+        void for_each(_Function __bl)
+        {
+            __epoch_guard guard;
+            __for_each_node([&](__node_base* __n) { __bl(__value_of(__n)); });
+        }
+    };
+    
+    
+    namespace pmr
+    {
+        template <typename _Value, typename _Hash = hash<_Value>, typename _Pred = equal_to<_Value>, typename _Mutex = shared_timed_mutex>
+        using threadsafe_unordered_set = std::threadsafe_unordered_set<_Value, _Hash, _Pred, polymorphic_allocator<_Value>, _Mutex>;
+        
+        template <typename _Value, typename _Hash = hash<_Value>, typename _Pred = equal_to<_Value>, typename _Mutex = shared_timed_mutex>
+        using threadsafe_unordered_multiset = std::threadsafe_unordered_multiset<_Value, _Hash, _Pred, polymorphic_allocator<_Value>, _Mutex>;
+    }
 }
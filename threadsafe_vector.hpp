@@ -9,26 +9,33 @@
 #pragma once
 
 #include <mutex>
+#include <atomic>
 #include <vector>
 #include <memory>
+#include <stdexcept>
 #include <algorithm>
 #include <functional>
 #include <shared_mutex>
+#include <memory_resource>
+#include "threadsafe_mutex.hpp"
+#include "threadsafe_parallel.hpp"
+#include "threadsafe_read_view.hpp"
 
 namespace std
 {
-    template <typename _Tp, typename _Allocator = allocator<_Tp>>
+    template <typename _Tp, typename _Allocator = allocator<_Tp>, typename _Mutex = shared_timed_mutex>
     class threadsafe_vector
     {
     private:
         typedef std::vector<_Tp, _Allocator> __vector_type;
         
-        mutable std::shared_timed_mutex __mutex_;
-        __vector_type __internal_vector_;
+        mutable _Mutex __mutex_;
+        shared_ptr<__vector_type> __internal_vector_;
         
     public:
         typedef _Tp                                             value_type;
         typedef _Allocator                                      allocator_type;
+        typedef _Mutex                                          mutex_type;
 
         typedef          __vector_type                          vector_type;
         typedef typename __vector_type::reference               reference;
@@ -43,237 +50,792 @@ namespace std
         typedef typename __vector_type::const_reverse_iterator  const_reverse_iterator;
         
     public:
-        threadsafe_vector() : __internal_vector_() {}
-        explicit threadsafe_vector(size_type __n) : __internal_vector_(__n) {}
-        threadsafe_vector(size_type __n, const value_type& __v) : __internal_vector_(__n, __v) {}
-        threadsafe_vector(const vector_type& __v) : __internal_vector_(__v) {}
-        threadsafe_vector(vector_type&& __v) : __internal_vector_(std::move(__v)) {}
-        threadsafe_vector(initializer_list<value_type> __il) : __internal_vector_(__il) {}
+        threadsafe_vector() : __internal_vector_(std::make_shared<__vector_type>()) {}
+        explicit threadsafe_vector(const allocator_type& __a) : __internal_vector_(std::make_shared<__vector_type>(__a)) {}
+        explicit threadsafe_vector(size_type __n) : __internal_vector_(std::make_shared<__vector_type>(__n)) {}
+        threadsafe_vector(size_type __n, const value_type& __v) : __internal_vector_(std::make_shared<__vector_type>(__n, __v)) {}
+        threadsafe_vector(const vector_type& __v) : __internal_vector_(std::make_shared<__vector_type>(__v)) {}
+        threadsafe_vector(vector_type&& __v) : __internal_vector_(std::make_shared<__vector_type>(std::move(__v))) {}
+        threadsafe_vector(initializer_list<value_type> __il) : __internal_vector_(std::make_shared<__vector_type>(__il)) {}
         
         template <class _InputIterator>
-        threadsafe_vector(_InputIterator __f, _InputIterator __l) : __internal_vector_(__f, __l) {}
+        threadsafe_vector(_InputIterator __f, _InputIterator __l) : __internal_vector_(std::make_shared<__vector_type>(__f, __l)) {}
         
         threadsafe_vector(const threadsafe_vector&) = delete;
         threadsafe_vector& operator=(const threadsafe_vector&) = delete;
         threadsafe_vector(threadsafe_vector&&) = delete;
         threadsafe_vector& operator=(threadsafe_vector&&) = delete;
         
+    private:
+        // The vector is shared with the snapshots taken since the last write.
+        // A writer that finds it shared copies it first, or starts from an
+        // empty vector when it is about to overwrite the contents anyway.
+        void __detach(bool __copy = true)
+        {
+            if (__internal_vector_.use_count() > 1)
+            {
+                __internal_vector_ = __copy ? std::make_shared<__vector_type>(*__internal_vector_, __internal_vector_->get_allocator())
+                                            : std::make_shared<__vector_type>(__internal_vector_->get_allocator());
+            }
+            else
+            {
+                // The last snapshot may have been released by another thread;
+                // its reads have to happen before this thread's writes.
+                atomic_thread_fence(memory_order_acquire);
+            }
+        }
+        
+        // Locks the container for reading and hands its layout to one of the
+        // __parallel_* algorithms of threadsafe_parallel.hpp.
+        template <class _Op>
+        auto __parallel(_Op __op)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            const __vector_type& c = *__internal_vector_;
+            auto visit = [&c](size_t __f, size_t __l, auto& __bl)
+            {
+                for (; __f < __l; ++__f)
+                {
+                    __bl(c[__f]);
+                }
+            };
+            return __op(c.size(), __parallel_pieces(c.size()), visit);
+        }
+        
     public:
         template <class _InputIterator>
         void assign(_InputIterator __f, _InputIterator __l)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_vector_.assign(__f, __l);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            __internal_vector_->assign(__f, __l);
         }
         
         void assign(size_type __n, const value_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_vector_.assign(__n, __v);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            __internal_vector_->assign(__n, __v);
         }
         
         void assign(initializer_list<value_type> __il)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_vector_.assign(__il);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            __internal_vector_->assign(__il);
         }
         
         size_type size() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_vector_.size();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_vector_->size();
         }
         
         size_type max_size() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_vector_.max_size();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_vector_->max_size();
         }
 
         size_type capacity() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_vector_.capacity();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_vector_->capacity();
+        }
+        
+        allocator_type get_allocator() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_vector_->get_allocator();
         }
         
         bool empty() const
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_vector_.empty();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_vector_->empty();
         }
         
         void reserve(size_type __n)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_vector_.reserve(__n);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_vector_->reserve(__n);
         }
         
         void shrink_to_fit()
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_vector_.shrink_to_fit();
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_vector_->shrink_to_fit();
         }
         
         void resize(size_type __n)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_vector_.resize(__n);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_vector_->resize(__n);
         }
         
         void resize(size_type __n, const value_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_vector_.resize(__n, __v);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_vector_->resize(__n, __v);
         }
         
+        // front(), back(), data(), operator[] and at() return into the vector
+        // after the lock is released; use read() to keep the lock held.
         const value_type& front()
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return static_cast<const value_type&>(__internal_vector_.front());
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return static_cast<const value_type&>(__internal_vector_->front());
         }
 
         const value_type& back()
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return static_cast<const value_type&>(__internal_vector_.back());
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return static_cast<const value_type&>(__internal_vector_->back());
         }
 
         const value_type* data()
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_vector_.data();
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_vector_->data();
         }
         
         void push_back(const value_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_vector_.push_back(__v);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_vector_->push_back(__v);
+        }
+        
+        void push_back(value_type&& __v)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_vector_->push_back(std::move(__v));
+        }
+        
+        template <class... _Args>
+        void emplace_back(_Args&&... __args)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_vector_->emplace_back(std::forward<_Args>(__args)...);
         }
         
         void pop_back()
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_vector_.pop_back();
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __internal_vector_->pop_back();
         }
         
         void clear()
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_vector_.clear();
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            __internal_vector_->clear();
         }
         
         const value_type& operator[](size_type __n)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_vector_[__n];
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return (*__internal_vector_)[__n];
         }
         
         const value_type& at(size_type __n)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            return __internal_vector_.at(__n);
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return __internal_vector_->at(__n);
         }
         
         void set(size_type __n, const value_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_vector_[__n] = __v;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            (*__internal_vector_)[__n] = __v;
+        }
+        
+        void set(size_type __n, value_type&& __v)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            (*__internal_vector_)[__n] = std::move(__v);
         }
         
         void operator=(const vector_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_vector_ = __v;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            *__internal_vector_ = __v;
         }
         
         void operator=(initializer_list<value_type> __il)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            __internal_vector_ = __il;
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach(false);
+            *__internal_vector_ = __il;
         }
         
-        value_type value()
+        vector_type value()
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return *__internal_vector_;
+        }
+        
+        // O(1) read-only view of the current contents. Writers leave it intact
+        // by copying the vector the first time they modify it afterwards.
+        std::shared_ptr<const vector_type> snapshot() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
             return __internal_vector_;
         }
         
-        void insert(std::function<const_iterator(const vector_type&)> __pos, const value_type& __v)
+        threadsafe_read_view<vector_type, mutex_type> read() const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            return threadsafe_read_view<vector_type, mutex_type>(std::move(lock), __internal_vector_.get());
+        }
+        
+        threadsafe_read_view<value_type, mutex_type> read(size_type __n) const
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            const value_type* p = &__internal_vector_->at(__n);
+            return threadsafe_read_view<value_type, mutex_type>(std::move(lock), p);
+        }
+        
+        template <class _Position>
+        void insert(_Position __pos, value_type&& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            
+            const_iterator pos = __pos(*__internal_vector_);
+            
+            __internal_vector_->insert(pos, std::move(__v));
+        }
+        
+        template <class _Position, class... _Args>
+        void emplace(_Position __pos, _Args&&... __args)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            
+            const_iterator pos = __pos(*__internal_vector_);
             
-            const_iterator pos = __pos(__internal_vector_);
+            __internal_vector_->emplace(pos, std::forward<_Args>(__args)...);
+        }
+        
+        template <class _Position>
+        void insert(_Position __pos, const value_type& __v)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            
+            const_iterator pos = __pos(*__internal_vector_);
 
-            __internal_vector_.insert(pos, __v);
+            __internal_vector_->insert(pos, __v);
         }
         
-        void insert(std::function<const_iterator(const vector_type&)> __pos, size_type __n, const value_type& __v)
+        template <class _Position>
+        void insert(_Position __pos, size_type __n, const value_type& __v)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
             
-            const_iterator pos = __pos(__internal_vector_);
+            const_iterator pos = __pos(*__internal_vector_);
             
-            __internal_vector_.insert(pos, __n, __v);
+            __internal_vector_->insert(pos, __n, __v);
         }
         
-        template <class _InputIterator>
-        void insert(std::function<const_iterator(const vector_type&)> __pos, _InputIterator __f, _InputIterator __l)
+        template <class _Position, class _InputIterator,
+                  class = typename enable_if<is_convertible<typename iterator_traits<_InputIterator>::iterator_category, input_iterator_tag>::value>::type>
+        void insert(_Position __pos, _InputIterator __f, _InputIterator __l)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
             
-            const_iterator pos = __pos(__internal_vector_);
+            const_iterator pos = __pos(*__internal_vector_);
             
-            __internal_vector_.insert(pos, __f, __l);
+            __internal_vector_->insert(pos, __f, __l);
+        }
+        
+        template <class _Position>
+        void insert(_Position __pos, initializer_list<value_type> __il)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            
+            const_iterator pos = __pos(*__internal_vector_);
+            
+            __internal_vector_->insert(pos, __il);
+        }
+        
+        // Erases every element matching __pred in one pass and returns how
+        // many were erased.
+        template <typename _Predicate>
+        size_type erase(_Predicate __pred)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            auto it = __compact(__internal_vector_->begin(), __internal_vector_->end(), __pred);
+            size_type n = __internal_vector_->end() - it;
+            __internal_vector_->erase(it, __internal_vector_->end());
+            return n;
         }
         
-        void insert(std::function<const_iterator(const vector_type&)> __pos, initializer_list<value_type> __il)
+        // Same as erase(__pred), but the predicate is evaluated on
+        // threadsafe_thread_pool::instance() and has to be thread-safe.
+        template <typename _Predicate>
+        size_type parallel_erase(_Predicate __pred)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            auto it = __parallel_remove_if(__internal_vector_->begin(), __internal_vector_->end(), __pred);
+            size_type n = __internal_vector_->end() - it;
+            __internal_vector_->erase(it, __internal_vector_->end());
+            return n;
+        }
+        
+        template <typename _Function>
+        void for_each(_Function __bl)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            for (const auto& v : *__internal_vector_)
+            {
+                __bl(v);
+            }
+        }
+        
+        // Chunked traversal that releases the lock between calls:
+        //
+        //     scan_cursor c;
+        //     while (!c.done()) v.scan(c, 1024, fn);
+        //
+        // Each call visits up to __count elements and returns how many it
+        // visited. The cursor is an index, so elements inserted or erased in
+        // front of it shift the remaining ones and may cause them to be
+        // skipped or visited twice; appends and pop_back are safe. A cursor
+        // that is done() stays done: further calls visit nothing.
+        class scan_cursor
+        {
+            friend class threadsafe_vector;
             
-            const_iterator pos = __pos(__internal_vector_);
+            size_type __index_ = 0;
+            bool __done_ = false;
+            
+        public:
+            bool done() const { return __done_; }
+        };
+        
+        template <typename _Function>
+        size_type scan(scan_cursor& __c, size_type __count, _Function __bl)
+        {
+            std::shared_lock<mutex_type> lock(__mutex_);
+            if (__c.__done_)
+            {
+                return 0;
+            }
             
-            __internal_vector_.insert(pos, __il);
+            size_type size = __internal_vector_->size();
+            size_type n = 0;
+            for (; n < __count && __c.__index_ < size; ++__c.__index_, ++n)
+            {
+                __bl((*__internal_vector_)[__c.__index_]);
+            }
+            __c.__done_ = __c.__index_ >= size;
+            return n;
+        }
+        
+        // Parallel traversal on threadsafe_thread_pool::instance(). The shared
+        // lock is held until every piece is done, and the callables run
+        // concurrently on const elements, so they must be thread-safe.
+        // parallel_reduce starts every piece from __identity, folds elements
+        // in with __acc(result, element) and merges the pieces in container
+        // order with __comb(result, result).
+        template <typename _Function>
+        void parallel_for_each(_Function __bl)
+        {
+            __parallel([&](size_t __units, size_t __pieces, auto& __visit) { __parallel_for_each(__units, __pieces, __visit, __bl); });
+        }
+        
+        template <typename _Result, typename _Accumulate, typename _Combine>
+        _Result parallel_reduce(_Result __identity, _Accumulate __acc, _Combine __comb)
+        {
+            return __parallel([&](size_t __units, size_t __pieces, auto& __visit) { return __parallel_reduce(__units, __pieces, __visit, std::move(__identity), __acc, __comb); });
+        }
+        
+        template <typename _Predicate>
+        size_type parallel_count_if(_Predicate __pred)
+        {
+            return __parallel([&](size_t __units, size_t __pieces, auto& __visit) { return __parallel_count_if(__units, __pieces, __visit, __pred); });
         }
         
-        void erase(std::function<bool(const value_type&)> __comp)
+        template <typename _Function>
+        void for_each(size_type __f, size_type __l, _Function __bl)
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            for (const_iterator it = __internal_vector_.begin(); it != __internal_vector_.end();)
+            std::shared_lock<mutex_type> lock(__mutex_);
+            for (size_type i = __f; i < __l; ++i)
             {
-                if (__comp(*it))
+                __bl(i, (*__internal_vector_)[i]);
+            }
+        }
+        
+        template <typename _Compare>
+        void sort(_Compare __comp)
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            std::sort(__internal_vector_->begin(), __internal_vector_->end(), __comp);
+        }
+        
+        // Sorts on threadsafe_thread_pool::instance(). Writers are still blocked
+        // for the whole sort, but for a much shorter time than with sort().
+        // Arithmetic elements ordered by std::less are radix sorted.
+        template <typename _Compare = std::less<value_type>>
+        void parallel_sort(_Compare __comp = _Compare())
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __parallel_sort(__internal_vector_->data(), __internal_vector_->data() + __internal_vector_->size(), __comp, false);
+        }
+        
+        template <typename _Compare = std::less<value_type>>
+        void parallel_stable_sort(_Compare __comp = _Compare())
+        {
+            std::unique_lock<mutex_type> lock(__mutex_);
+            __detach();
+            __parallel_sort(__internal_vector_->data(), __internal_vector_->data() + __internal_vector_->size(), __comp, true);
+        }
+    };
+    
+    
+    // Append-only vector in the style of TBB's concurrent_vector. Elements
+    // live in segments that double in size and are never relocated, so their
+    // addresses stay valid for the lifetime of the container. push_back,
+    // emplace_back and grow_by reserve their slots with one fetch_add and
+    // construct the elements outside any lock; readers take no lock at all.
+    // size() counts reserved slots, and an element becomes visible to at()
+    // and for_each() once its construction has finished. The element
+    // references handed out are not synchronised by the container.
+    template <typename _Tp, typename _Allocator = allocator<_Tp>>
+    class threadsafe_concurrent_vector
+    {
+    public:
+        typedef _Tp                                             value_type;
+        typedef _Allocator                                      allocator_type;
+        typedef value_type&                                     reference;
+        typedef const value_type&                               const_reference;
+        typedef size_t                                          size_type;
+        typedef std::vector<_Tp, _Allocator>                    vector_type;
+        
+    private:
+        enum : unsigned char { __empty, __ready, __failed };
+        
+        struct __slot
+        {
+            atomic<unsigned char> __state_;
+            alignas(value_type) unsigned char __storage_[sizeof(value_type)];
+            
+            __slot() : __state_(__empty) {}
+            
+            value_type* __value() { return reinterpret_cast<value_type*>(__storage_); }
+        };
+        
+        typedef typename allocator_traits<allocator_type>::template rebind_alloc<__slot> __slot_allocator;
+        typedef allocator_traits<__slot_allocator>                                      __slot_traits;
+        
+        // Segment k holds __first_size << k slots, starting at index
+        // __first_size * (2^k - 1).
+        static constexpr unsigned  __first_bits = 5;
+        static constexpr size_type __first_size = size_type(1) << __first_bits;
+        static constexpr unsigned  __max_segments = sizeof(size_type) * 8 - __first_bits;
+        
+        __slot_allocator __alloc_;
+        alignas(64) atomic<size_type> __size_;
+        atomic<__slot*> __segments_[__max_segments];
+        
+    public:
+        threadsafe_concurrent_vector() : __alloc_(), __size_(0)
+        {
+            for (auto& s : __segments_)
+            {
+                s.store(nullptr, memory_order_relaxed);
+            }
+        }
+        
+        threadsafe_concurrent_vector(initializer_list<value_type> __il) : threadsafe_concurrent_vector()
+        {
+            for (const auto& v : __il)
+            {
+                push_back(v);
+            }
+        }
+        
+        template <class _InputIterator>
+        threadsafe_concurrent_vector(_InputIterator __f, _InputIterator __l) : threadsafe_concurrent_vector()
+        {
+            for (; __f != __l; ++__f)
+            {
+                push_back(*__f);
+            }
+        }
+        
+        threadsafe_concurrent_vector(const threadsafe_concurrent_vector&) = delete;
+        threadsafe_concurrent_vector& operator=(const threadsafe_concurrent_vector&) = delete;
+        threadsafe_concurrent_vector(threadsafe_concurrent_vector&&) = delete;
+        threadsafe_concurrent_vector& operator=(threadsafe_concurrent_vector&&) = delete;
+        
+        ~threadsafe_concurrent_vector()
+        {
+            size_type size = __size_.load(memory_order_relaxed);
+            for (size_type i = 0; i < size; ++i)
+            {
+                __slot* s = __slot_at(i);
+                if (s && s->__state_.load(memory_order_relaxed) == __ready)
                 {
-                    it = __internal_vector_.erase(it);
+                    s->__value()->~value_type();
                 }
-                else
+            }
+            
+            for (unsigned k = 0; k < __max_segments; ++k)
+            {
+                __slot* seg = __segments_[k].load(memory_order_relaxed);
+                if (seg)
                 {
-                    ++it;
+                    __slot_traits::deallocate(__alloc_, seg, __first_size << k);
                 }
             }
         }
         
-        void for_each(std::function<void(const value_type&)> __bl)
+    private:
+        static unsigned __segment_of(size_type __i)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
-            for (const auto& v : __internal_vector_)
+            size_type v = (__i >> __first_bits) + 1;
+#if defined(__GNUC__) || defined(__clang__)
+            return static_cast<unsigned>(sizeof(unsigned long long) * 8 - 1 - __builtin_clzll(v));
+#else
+            unsigned k = 0;
+            while (v >>= 1)
             {
-                __bl(v);
+                ++k;
             }
+            return k;
+#endif
+        }
+        
+        static size_type __segment_base(unsigned __k)
+        {
+            return __first_size * ((size_type(1) << __k) - 1);
         }
         
-        void for_each(size_type __f, size_type __l, std::function<void(size_type, const value_type&)> __bl)
+        __slot* __slot_at(size_type __i) const
+        {
+            unsigned k = __segment_of(__i);
+            __slot* seg = __segments_[k].load(memory_order_acquire);
+            return seg ? seg + (__i - __segment_base(k)) : nullptr;
+        }
+        
+        // Installs segment __k unless another thread got there first.
+        __slot* __segment(unsigned __k)
+        {
+            __slot* seg = __segments_[__k].load(memory_order_acquire);
+            if (seg)
+            {
+                return seg;
+            }
+            
+            size_type n = __first_size << __k;
+            __slot* fresh = __slot_traits::allocate(__alloc_, n);
+            for (size_type i = 0; i < n; ++i)
+            {
+                ::new (static_cast<void*>(fresh + i)) __slot();
+            }
+            
+            if (__segments_[__k].compare_exchange_strong(seg, fresh, memory_order_acq_rel, memory_order_acquire))
+            {
+                return fresh;
+            }
+            __slot_traits::deallocate(__alloc_, fresh, n);
+            return seg;
+        }
+        
+        __slot* __reserved_slot(size_type __i)
+        {
+            unsigned k = __segment_of(__i);
+            return __segment(k) + (__i - __segment_base(k));
+        }
+        
+        // Constructs the reserved slots [__f, __l) in order. If a constructor
+        // or a segment allocation throws, that slot and the rest of the range
+        // are marked failed so readers skip them, and the exception
+        // propagates. Slots whose segment could not be allocated cannot be
+        // marked; they stay empty, which readers treat the same way.
+        template <class _Construct>
+        void __fill(size_type __f, size_type __l, _Construct __construct)
         {
-            std::shared_lock<std::shared_timed_mutex> lock(__mutex_);
             for (size_type i = __f; i < __l; ++i)
             {
-                __bl(i, __internal_vector_[i]);
+                __slot* s = nullptr;
+                try
+                {
+                    s = __reserved_slot(i);
+                    __construct(s->__value());
+                }
+                catch (...)
+                {
+                    for (size_type j = i; j < __l; ++j)
+                    {
+                        __slot* f = __slot_at(j);
+                        if (f)
+                        {
+                            f->__state_.store(__failed, memory_order_release);
+                        }
+                    }
+                    throw;
+                }
+                s->__state_.store(__ready, memory_order_release);
             }
         }
         
-        template <typename _Compare>
-        void sort(_Compare __comp)
+        __slot* __published(size_type __n) const
         {
-            std::unique_lock<std::shared_timed_mutex> lock(__mutex_);
-            std::sort(__internal_vector_.begin(), __internal_vector_.end(), __comp);
+            if (__n >= __size_.load(memory_order_acquire))
+            {
+                return nullptr;
+            }
+            
+            __slot* s = __slot_at(__n);
+            return s && s->__state_.load(memory_order_acquire) == __ready ? s : nullptr;
+        }
+        
+    public:
+        bool empty() const
+        {
+            return __size_.load(memory_order_acquire) == 0;
+        }
+        
+        size_type size() const
+        {
+            return __size_.load(memory_order_acquire);
+        }
+        
+        template <class... _Args>
+        size_type emplace_back(_Args&&... __args)
+        {
+            size_type i = __size_.fetch_add(1, memory_order_acq_rel);
+            __fill(i, i + 1, [&](value_type* __p) { ::new (static_cast<void*>(__p)) value_type(std::forward<_Args>(__args)...); });
+            return i;
+        }
+        
+        size_type push_back(const value_type& __v)
+        {
+            return emplace_back(__v);
+        }
+        
+        size_type push_back(value_type&& __v)
+        {
+            return emplace_back(std::move(__v));
+        }
+        
+        // Appends __n value-initialised elements and returns the index of the
+        // first one; the new elements are contiguous in index space.
+        size_type grow_by(size_type __n)
+        {
+            size_type i = __size_.fetch_add(__n, memory_order_acq_rel);
+            __fill(i, i + __n, [](value_type* __p) { ::new (static_cast<void*>(__p)) value_type(); });
+            return i;
+        }
+        
+        size_type grow_by(size_type __n, const value_type& __v)
+        {
+            size_type i = __size_.fetch_add(__n, memory_order_acq_rel);
+            __fill(i, i + __n, [&__v](value_type* __p) { ::new (static_cast<void*>(__p)) value_type(__v); });
+            return i;
+        }
+        
+        // Unchecked: __n has to be an index returned by an append that
+        // happened before this call.
+        reference operator[](size_type __n)
+        {
+            return *__slot_at(__n)->__value();
+        }
+        
+        const_reference operator[](size_type __n) const
+        {
+            return *__slot_at(__n)->__value();
+        }
+        
+        // Throws out_of_range unless element __n has been published.
+        reference at(size_type __n)
+        {
+            __slot* s = __published(__n);
+            if (!s)
+            {
+                throw std::out_of_range("threadsafe_concurrent_vector");
+            }
+            return *s->__value();
+        }
+        
+        const_reference at(size_type __n) const
+        {
+            __slot* s = __published(__n);
+            if (!s)
+            {
+                throw std::out_of_range("threadsafe_concurrent_vector");
+            }
+            return *s->__value();
+        }
+        
+        vector_type value() const
+        {
+            size_type size = __size_.load(memory_order_acquire);
+            vector_type r;
+            r.reserve(size);
+            for (size_type i = 0; i < size; ++i)
+            {
+                __slot* s = __slot_at(i);
+                if (s && s->__state_.load(memory_order_acquire) == __ready)
+                {
+                    r.push_back(*s->__value());
+                }
+            }
+            return r;
+        }
+        
+        // Visits the published elements in index order, skipping slots that
+        // are still being constructed.
+        template <typename _Function>
+        void for_each(_Function __bl)
+        {
+            size_type size = __size_.load(memory_order_acquire);
+            for (size_type i = 0; i < size; ++i)
+            {
+                __slot* s = __slot_at(i);
+                if (s && s->__state_.load(memory_order_acquire) == __ready)
+                {
+                    __bl(static_cast<const value_type&>(*s->__value()));
+                }
+            }
         }
     };
+    
+    
+    namespace pmr
+    {
+        // threadsafe_vector on a std::pmr::memory_resource, e.g.
+        //
+        //     std::pmr::monotonic_buffer_resource arena;
+        //     std::pmr::threadsafe_vector<int> v(&arena);
+        //
+        // Copy-on-write copies are made with the allocator of the container
+        // they are copied from, so every generation stays in the same arena.
+        // With a monotonic resource clear() and destruction only run the
+        // element destructors - nothing is handed back until the resource
+        // itself is released, in one go.
+        template <typename _Tp, typename _Mutex = shared_timed_mutex>
+        using threadsafe_vector = std::threadsafe_vector<_Tp, polymorphic_allocator<_Tp>, _Mutex>;
+    }
 }